@@ -73,7 +73,7 @@ include $(CLEAR_VARS)
 LOCAL_ALLOW_UNDEFINED_SYMBOLS=false
 LOCAL_MODULE := ffmpeg-jni
 LOCAL_CFLAGS += -Wall -g
-LOCAL_SRC_FILES := ffmpeg-jni.c player.c queue.c helpers.c
+LOCAL_SRC_FILES := ffmpeg-jni.c player.c queue.c packet_pool.c frame_pool.c keyframe_index.c stream_info_cache.c decode_governor.c cache-protocol.c helpers.c
 LOCAL_C_INCLUDES := $(LOCAL_PATH)/ffmpeg_build/$(TARGET_ARCH_ABI)/include
 LOCAL_SHARED_LIBRARY := ffmpeg-prebuilt
 
@@ -111,7 +111,7 @@ include $(CLEAR_VARS)
 LOCAL_ALLOW_UNDEFINED_SYMBOLS=false
 LOCAL_MODULE := ffmpeg-jni-neon
 LOCAL_CFLAGS += -Wall -g
-LOCAL_SRC_FILES := ffmpeg-jni.c player.c queue.c helpers.c
+LOCAL_SRC_FILES := ffmpeg-jni.c player.c queue.c packet_pool.c frame_pool.c keyframe_index.c stream_info_cache.c decode_governor.c cache-protocol.c helpers.c
 LOCAL_C_INCLUDES := $(LOCAL_PATH)/ffmpeg_build/$(TARGET_ARCH_ABI)-neon/include
 LOCAL_SHARED_LIBRARY := ffmpeg-prebuilt-neon
 
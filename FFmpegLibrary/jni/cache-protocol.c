@@ -0,0 +1,456 @@
+/*
+ * cache-protocol.c
+ * Copyright (c) 2026 FFmpegAndroid contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <libavutil/avstring.h>
+#include <libavformat/avformat.h>
+#include <libavutil/opt.h>
+
+#include "ffmpeg/libavformat/url.h"
+
+#include <android/log.h>
+#include <jni.h>
+
+#include "helpers.h"
+#include "cache-protocol.h"
+
+#define LOG_LEVEL 2
+#define LOG_TAG "AVEngine::cache-protocol.c"
+
+/*
+ * Nested protocol: "cache+http://..." downloads the nested url on its own
+ * thread into a ring file of cache_size bytes. Stream byte pos lives at file
+ * offset pos % cache_size. Bytes [window_start, window_end) are in the ring,
+ * download stops cache_readahead bytes in front of the reader so everything
+ * behind the reader that still fits in the ring is kept for backward seeks.
+ */
+#define CACHE_CHUNK_SIZE		(32 * 1024)
+#define CACHE_WAIT_MS			100
+#define CACHE_DEFAULT_SIZE		(32 * 1024 * 1024)
+#define CACHE_DEFAULT_READAHEAD	(8 * 1024 * 1024)
+
+typedef struct {
+	const AVClass *class;
+	URLContext *hd;
+	char *cache_dir;
+	int64_t cache_size;
+	int64_t readahead;
+
+	int fd;
+	int64_t stream_size;
+	AVIOInterruptCB interrupt_callback;
+
+	pthread_t download_thread;
+	int download_thread_created;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+
+	// guarded by mutex
+	int64_t window_start;
+	int64_t window_end;
+	int64_t read_pos;
+	// target of pending reposition or -1, reader waits until it is done
+	int64_t seek_request;
+	// bumped by every reposition request, downloader keeps the one it
+	// serves so only a newer request interrupts it
+	int seek_generation;
+	int download_generation;
+	int eof;
+	int error;
+	int abort_request;
+
+	int64_t bytes_downloaded;
+	int64_t bytes_served;
+	int seeks_cached;
+	int seeks_reconnect;
+} CacheContext;
+
+#define OFFSET(x) offsetof(CacheContext, x)
+
+static const AVOption options[] =
+{
+	{ "cache_dir", "directory for cache ring file", OFFSET(cache_dir), AV_OPT_TYPE_STRING, .flags = AV_OPT_FLAG_DECODING_PARAM },
+	{ "cache_size", "size of cache ring file in bytes", OFFSET(cache_size), AV_OPT_TYPE_INT64, { .i64 = CACHE_DEFAULT_SIZE }, 2 * CACHE_CHUNK_SIZE, INT64_MAX, AV_OPT_FLAG_DECODING_PARAM },
+	{ "cache_readahead", "bytes downloaded in front of reader", OFFSET(readahead), AV_OPT_TYPE_INT64, { .i64 = CACHE_DEFAULT_READAHEAD }, CACHE_CHUNK_SIZE, INT64_MAX, AV_OPT_FLAG_DECODING_PARAM },
+	{ NULL }
+};
+
+static const AVClass cache_class =
+{
+	.class_name = "cache",
+	.item_name = av_default_item_name,
+	.option = options,
+	.version	 = LIBAVUTIL_VERSION_INT,
+};
+
+static int cache_nested_interrupt_cb(void *ctx) {
+	CacheContext *c = ctx;
+	int interrupt;
+	pthread_mutex_lock(&c->mutex);
+	// newer reposition makes data read from the old position useless,
+	// the one being served must not interrupt its own reconnect
+	interrupt = c->abort_request
+			|| c->seek_generation != c->download_generation;
+	pthread_mutex_unlock(&c->mutex);
+	return interrupt || ff_check_interrupt(&c->interrupt_callback);
+}
+
+static int cache_write(CacheContext *c, int64_t pos, uint8_t *buf, int size) {
+	while (size > 0) {
+		int64_t offset = pos % c->cache_size;
+		int len = size;
+		if (len > c->cache_size - offset)
+			len = c->cache_size - offset;
+		int n = pwrite(c->fd, buf, len, offset);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			LOGE(1, "cache_write: could not write cache file: %d", errno);
+			return AVERROR(errno);
+		}
+		pos += n;
+		buf += n;
+		size -= n;
+	}
+	return 0;
+}
+
+static void *cache_download(void *arg) {
+	CacheContext *c = arg;
+	uint8_t *buf = av_malloc(CACHE_CHUNK_SIZE);
+	int64_t pos;
+	int n;
+
+	pthread_mutex_lock(&c->mutex);
+	if (buf == NULL) {
+		c->error = AVERROR(ENOMEM);
+		pthread_cond_broadcast(&c->cond);
+		goto end;
+	}
+	while (!c->abort_request) {
+		if (c->seek_generation != c->download_generation) {
+			int64_t ret;
+			int generation = c->seek_generation;
+			pos = c->seek_request;
+			c->download_generation = generation;
+			pthread_mutex_unlock(&c->mutex);
+			LOGI(3, "cache_download: reconnecting at: %"PRId64, pos);
+			ret = ffurl_seek(c->hd, pos, SEEK_SET);
+			pthread_mutex_lock(&c->mutex);
+			// superseded by newer request
+			if (c->seek_generation != generation)
+				continue;
+			c->seek_request = -1;
+			c->window_start = pos;
+			c->window_end = pos;
+			c->eof = FALSE;
+			c->error = ret < 0 ? ret : 0;
+			if (ret < 0)
+				LOGE(1, "cache_download: could not seek to: %"PRId64", error: %"PRId64, pos, ret);
+			pthread_cond_broadcast(&c->cond);
+			continue;
+		}
+		if (c->eof || c->error
+				|| c->window_end - c->read_pos >= c->readahead) {
+			pthread_cond_wait(&c->cond, &c->mutex);
+			continue;
+		}
+		pthread_mutex_unlock(&c->mutex);
+
+		n = ffurl_read(c->hd, buf, CACHE_CHUNK_SIZE);
+
+		pthread_mutex_lock(&c->mutex);
+		if (c->abort_request || c->seek_request >= 0)
+			continue;
+		if (n == 0 || n == AVERROR_EOF) {
+			LOGI(3, "cache_download: end of stream at: %"PRId64, c->window_end);
+			c->eof = TRUE;
+			pthread_cond_broadcast(&c->cond);
+			continue;
+		}
+		if (n < 0) {
+			LOGE(1, "cache_download: read error: %d", n);
+			c->error = n;
+			pthread_cond_broadcast(&c->cond);
+			continue;
+		}
+
+		// reader could go back while we were downloading, do not overwrite
+		// bytes in front of it
+		while (!c->abort_request && c->seek_request < 0
+				&& c->window_end + n - c->read_pos > c->cache_size)
+			pthread_cond_wait(&c->cond, &c->mutex);
+		if (c->abort_request || c->seek_request >= 0)
+			continue;
+		if (c->window_end + n - c->window_start > c->cache_size)
+			c->window_start = c->window_end + n - c->cache_size;
+		pos = c->window_end;
+		pthread_mutex_unlock(&c->mutex);
+
+		int ret = cache_write(c, pos, buf, n);
+
+		pthread_mutex_lock(&c->mutex);
+		if (ret < 0) {
+			c->error = ret;
+		} else {
+			c->window_end += n;
+			c->bytes_downloaded += n;
+		}
+		pthread_cond_broadcast(&c->cond);
+	}
+end:
+	pthread_mutex_unlock(&c->mutex);
+	av_free(buf);
+	return NULL;
+}
+
+static int cache_open(URLContext *h, const char *uri, int flags) {
+	const char *nested_url;
+	char path[1024];
+	int ret = 0;
+	CacheContext *c = h->priv_data;
+	LOGI(3, "cache_open: opening data");
+
+	if (!av_strstart(uri, "cache+", &nested_url)
+			&& !av_strstart(uri, "cache:", &nested_url)) {
+		av_log(h, AV_LOG_ERROR, "Unsupported url %s", uri);
+		LOGE(1, "Unsupported url %s", uri);
+		ret = AVERROR(EINVAL);
+		goto err;
+	}
+	if (flags & AVIO_FLAG_WRITE) {
+		av_log(h, AV_LOG_ERROR, "Only reading is supported\n");
+		LOGE(1, "Only reading is supported");
+		ret = AVERROR(ENOSYS);
+		goto err;
+	}
+	if (c->cache_dir == NULL) {
+		av_log(h, AV_LOG_ERROR, "Cache directory is not set\n");
+		LOGE(1, "Cache directory is not set");
+		ret = AVERROR(EINVAL);
+		goto err;
+	}
+	if (c->readahead > c->cache_size - CACHE_CHUNK_SIZE)
+		c->readahead = c->cache_size - CACHE_CHUNK_SIZE;
+
+	snprintf(path, sizeof(path), "%s/cache-XXXXXX", c->cache_dir);
+	c->fd = mkstemp(path);
+	if (c->fd < 0) {
+		ret = AVERROR(errno);
+		av_log(h, AV_LOG_ERROR, "Could not create cache file in %s\n",
+				c->cache_dir);
+		LOGE(1, "Could not create cache file in %s", c->cache_dir);
+		goto err;
+	}
+	// file is removed when last descriptor is closed
+	unlink(path);
+
+	c->window_start = 0;
+	c->window_end = 0;
+	c->read_pos = 0;
+	c->seek_request = -1;
+	c->seek_generation = 0;
+	c->download_generation = 0;
+	c->eof = FALSE;
+	c->error = 0;
+	c->abort_request = FALSE;
+	pthread_mutex_init(&c->mutex, NULL);
+	pthread_cond_init(&c->cond, NULL);
+
+	c->interrupt_callback = h->interrupt_callback;
+	AVIOInterruptCB nested_interrupt_callback = { cache_nested_interrupt_cb, c };
+	if ((ret = ffurl_open(&c->hd, nested_url, AVIO_FLAG_READ,
+			&nested_interrupt_callback, NULL)) < 0) {
+		av_log(h, AV_LOG_ERROR, "Unable to open input\n");
+		LOGE(1, "Unable to open input");
+		goto destroy_mutex;
+	}
+	c->stream_size = ffurl_size(c->hd);
+	h->is_streamed = c->hd->is_streamed;
+
+	if (pthread_create(&c->download_thread, NULL, cache_download, c)) {
+		LOGE(1, "Could not create download thread");
+		ret = AVERROR(ENOMEM);
+		goto close_nested;
+	}
+	c->download_thread_created = TRUE;
+
+	LOGI(3, "cache_open: size: %"PRId64", readahead: %"PRId64", stream size: %"PRId64,
+			c->cache_size, c->readahead, c->stream_size);
+	goto err;
+
+close_nested:
+	ffurl_close(c->hd);
+	c->hd = NULL;
+destroy_mutex:
+	pthread_cond_destroy(&c->cond);
+	pthread_mutex_destroy(&c->mutex);
+	close(c->fd);
+	c->fd = -1;
+err:
+	return ret;
+}
+
+static int cache_read(URLContext *h, uint8_t *buf, int size) {
+	CacheContext *c = h->priv_data;
+	int ret;
+
+	pthread_mutex_lock(&c->mutex);
+	for (;;) {
+		if (c->seek_request < 0) {
+			if (c->read_pos >= c->window_start && c->read_pos < c->window_end)
+				break;
+			if (c->error) {
+				ret = c->error;
+				goto end;
+			}
+			if (c->eof) {
+				ret = AVERROR_EOF;
+				goto end;
+			}
+		}
+		if (ff_check_interrupt(&h->interrupt_callback)) {
+			ret = AVERROR_EXIT;
+			goto end;
+		}
+		pthread_cond_timeout_np(&c->cond, &c->mutex, CACHE_WAIT_MS);
+	}
+
+	int64_t offset = c->read_pos % c->cache_size;
+	int64_t available = c->window_end - c->read_pos;
+	if (size > available)
+		size = available;
+	if (size > c->cache_size - offset)
+		size = c->cache_size - offset;
+	pthread_mutex_unlock(&c->mutex);
+
+	// downloader never overwrites bytes at or after read_pos
+	do {
+		ret = pread(c->fd, buf, size, offset);
+	} while (ret < 0 && errno == EINTR);
+
+	pthread_mutex_lock(&c->mutex);
+	if (ret < 0) {
+		LOGE(1, "cache_read: could not read cache file: %d", errno);
+		ret = AVERROR(errno);
+		goto end;
+	}
+	c->read_pos += ret;
+	c->bytes_served += ret;
+	pthread_cond_broadcast(&c->cond);
+end:
+	pthread_mutex_unlock(&c->mutex);
+	return ret;
+}
+
+static int64_t cache_seek(URLContext *h, int64_t pos, int whence) {
+	CacheContext *c = h->priv_data;
+	int64_t target;
+
+	if (whence == AVSEEK_SIZE)
+		return c->stream_size;
+
+	pthread_mutex_lock(&c->mutex);
+	switch (whence) {
+	case SEEK_SET:
+		target = pos;
+		break;
+	case SEEK_CUR:
+		target = c->read_pos + pos;
+		break;
+	case SEEK_END:
+		if (c->stream_size < 0) {
+			target = AVERROR(ENOSYS);
+			goto end;
+		}
+		target = c->stream_size + pos;
+		break;
+	default:
+		LOGE(1, "cache_seek: unknown whence: %d", whence);
+		target = AVERROR(EINVAL);
+		goto end;
+	}
+	if (target < 0) {
+		target = AVERROR(EINVAL);
+		goto end;
+	}
+
+	if (c->seek_request < 0 && target >= c->window_start
+			&& target <= c->window_end + c->readahead) {
+		// in cache or close enough that downloader will get there
+		LOGI(3, "cache_seek: cached seek to: %"PRId64, target);
+		c->seeks_cached += 1;
+	} else if (h->is_streamed) {
+		LOGE(2, "cache_seek: could not seek outside cache in stream");
+		target = AVERROR(ESPIPE);
+		goto end;
+	} else {
+		// reposition is done lazily by downloader, errors are reported by
+		// next read
+		LOGI(3, "cache_seek: reconnect seek to: %"PRId64, target);
+		c->seek_request = target;
+		c->seek_generation += 1;
+		c->seeks_reconnect += 1;
+	}
+	c->read_pos = target;
+	pthread_cond_broadcast(&c->cond);
+end:
+	pthread_mutex_unlock(&c->mutex);
+	return target;
+}
+
+static int cache_close(URLContext *h) {
+	CacheContext *c = h->priv_data;
+	if (c->download_thread_created) {
+		pthread_mutex_lock(&c->mutex);
+		c->abort_request = TRUE;
+		pthread_cond_broadcast(&c->cond);
+		pthread_mutex_unlock(&c->mutex);
+		pthread_join(c->download_thread, NULL);
+		c->download_thread_created = FALSE;
+	}
+	LOGI(2, "cache_close: downloaded: %"PRId64", served: %"PRId64", seeks cached: %d, reconnect: %d",
+			c->bytes_downloaded, c->bytes_served, c->seeks_cached, c->seeks_reconnect);
+	// nested context could call interrupt callback until it is closed
+	ffurl_close(c->hd);
+	pthread_cond_destroy(&c->cond);
+	pthread_mutex_destroy(&c->mutex);
+	close(c->fd);
+	return 0;
+}
+
+URLProtocol cache_protocol = {
+	.name = "cache",
+	.url_open = cache_open,
+	.url_read = cache_read,
+	.url_close = cache_close,
+	.url_seek = cache_seek,
+	.priv_data_size = sizeof(CacheContext),
+	.priv_data_class = &cache_class,
+	.flags = URL_PROTOCOL_FLAG_NESTED_SCHEME,
+};
+
+void register_cache_protocol() {
+	ffurl_register_protocol(&cache_protocol, sizeof(cache_protocol));
+}
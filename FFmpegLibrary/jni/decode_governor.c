@@ -0,0 +1,200 @@
+/*
+ * decode_governor.c
+ * Copyright (c) 2026 FFmpegAndroid contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <android/log.h>
+#include <jni.h>
+
+#include "helpers.h"
+#include "decode_governor.h"
+
+#define LOG_LEVEL 1
+#define LOG_TAG "AVEngine:decode_governor.c"
+
+/*
+ * Load is moving average (weight 1/DECODE_GOVERNOR_LOAD_WEIGHT) of packet
+ * decode time divided by its duration, above 1.0 decoder can not keep up.
+ * Decoder is overloaded when load or frame lateness is over its limit for
+ * DECODE_GOVERNOR_ESCALATE_SAMPLES packets in a row and has headroom when
+ * both are below their lower limits. Level goes up at most once per
+ * DECODE_GOVERNOR_ESCALATE_HOLD_US so previous step could show its effect,
+ * and down after headroom lasted deescalate_hold_us. Hold is doubled every
+ * time going down was followed by going up again within it, so decoder
+ * does not flip between two levels.
+ */
+#define DECODE_GOVERNOR_LOAD_WEIGHT 8
+#define DECODE_GOVERNOR_OVERLOAD 0.9
+#define DECODE_GOVERNOR_HEADROOM 0.5
+#define DECODE_GOVERNOR_LATE_US 100000
+#define DECODE_GOVERNOR_IN_TIME_US 20000
+#define DECODE_GOVERNOR_ESCALATE_SAMPLES 8
+#define DECODE_GOVERNOR_ESCALATE_HOLD_US 1000000
+#define DECODE_GOVERNOR_DEESCALATE_HOLD_US 2000000
+#define DECODE_GOVERNOR_MAX_DEESCALATE_HOLD_US 32000000
+
+struct _DecodeGovernor {
+	pthread_mutex_t mutex;
+	DecodeGovernorStats stats;
+	double load;
+	int has_load;
+	int64_t late_us;
+	int overloaded;
+	// start of current headroom or 0
+	int64_t headroom_since;
+	int64_t changed_at;
+	int64_t deescalated_at;
+	int64_t degraded_since;
+	int64_t deescalate_hold_us;
+};
+
+DecodeGovernor *decode_governor_init() {
+	DecodeGovernor *governor = malloc(sizeof(DecodeGovernor));
+	if (governor == NULL)
+		return NULL;
+	memset(governor, 0, sizeof(DecodeGovernor));
+	governor->deescalate_hold_us = DECODE_GOVERNOR_DEESCALATE_HOLD_US;
+	pthread_mutex_init(&governor->mutex, NULL);
+	return governor;
+}
+
+void decode_governor_free(DecodeGovernor *governor) {
+	pthread_mutex_destroy(&governor->mutex);
+	free(governor);
+}
+
+static void decode_governor_forget(DecodeGovernor *governor) {
+	governor->has_load = 0;
+	governor->load = 0.0;
+	governor->late_us = 0;
+	governor->overloaded = 0;
+	governor->headroom_since = 0;
+}
+
+static void decode_governor_set_level(DecodeGovernor *governor,
+		int64_t now, DecodeGovernorLevel level) {
+	DecodeGovernorLevel old_level = governor->stats.level;
+	if (level == old_level)
+		return;
+	if (old_level == DECODE_GOVERNOR_LEVEL_FULL)
+		governor->degraded_since = now;
+	else if (level == DECODE_GOVERNOR_LEVEL_FULL)
+		governor->stats.degraded_us += now - governor->degraded_since;
+	if (level > old_level) {
+		governor->stats.escalations += 1;
+		if (governor->deescalated_at != 0
+				&& now - governor->deescalated_at
+						< governor->deescalate_hold_us
+				&& governor->deescalate_hold_us
+						< DECODE_GOVERNOR_MAX_DEESCALATE_HOLD_US)
+			governor->deescalate_hold_us *= 2;
+		governor->deescalated_at = 0;
+	} else {
+		governor->stats.deescalations += 1;
+		governor->deescalated_at = now;
+	}
+	governor->stats.level = level;
+	governor->changed_at = now;
+	governor->overloaded = 0;
+	governor->headroom_since = 0;
+	LOGI(2, "decode_governor level: %d -> %d", old_level, level);
+}
+
+int decode_governor_update(DecodeGovernor *governor, int64_t now,
+		int64_t decode_us, int64_t duration_us, int64_t late_us) {
+	DecodeGovernorLevel level;
+	int headroom;
+
+	pthread_mutex_lock(&governor->mutex);
+	level = governor->stats.level;
+	if (duration_us > 0) {
+		double sample = (double) decode_us / duration_us;
+		if (governor->has_load)
+			governor->load += (sample - governor->load)
+					/ DECODE_GOVERNOR_LOAD_WEIGHT;
+		else
+			governor->load = sample;
+		governor->has_load = 1;
+	}
+	if (late_us != DECODE_GOVERNOR_NO_LATENESS)
+		governor->late_us = late_us;
+	if (!governor->has_load)
+		goto end;
+
+	if (governor->load > DECODE_GOVERNOR_OVERLOAD
+			|| governor->late_us > DECODE_GOVERNOR_LATE_US)
+		governor->overloaded += 1;
+	else
+		governor->overloaded = 0;
+	headroom = governor->load < DECODE_GOVERNOR_HEADROOM
+			&& governor->late_us < DECODE_GOVERNOR_IN_TIME_US;
+	if (!headroom)
+		governor->headroom_since = 0;
+	else if (governor->headroom_since == 0)
+		governor->headroom_since = now;
+
+	if (governor->overloaded >= DECODE_GOVERNOR_ESCALATE_SAMPLES
+			&& level + 1 < DECODE_GOVERNOR_LEVEL_NB
+			&& now - governor->changed_at >= DECODE_GOVERNOR_ESCALATE_HOLD_US) {
+		level += 1;
+	} else if (headroom && level > DECODE_GOVERNOR_LEVEL_FULL
+			&& now - governor->headroom_since
+					>= governor->deescalate_hold_us) {
+		level -= 1;
+	} else {
+		goto end;
+	}
+	decode_governor_set_level(governor, now, level);
+	pthread_mutex_unlock(&governor->mutex);
+	return level;
+
+end:
+	pthread_mutex_unlock(&governor->mutex);
+	return -1;
+}
+
+void decode_governor_reset(DecodeGovernor *governor, int64_t now,
+		int keep_level) {
+	pthread_mutex_lock(&governor->mutex);
+	decode_governor_forget(governor);
+	if (!keep_level) {
+		decode_governor_set_level(governor, now, DECODE_GOVERNOR_LEVEL_FULL);
+		governor->deescalated_at = 0;
+		governor->deescalate_hold_us = DECODE_GOVERNOR_DEESCALATE_HOLD_US;
+	}
+	pthread_mutex_unlock(&governor->mutex);
+}
+
+DecodeGovernorLevel decode_governor_level(DecodeGovernor *governor) {
+	DecodeGovernorLevel level;
+	pthread_mutex_lock(&governor->mutex);
+	level = governor->stats.level;
+	pthread_mutex_unlock(&governor->mutex);
+	return level;
+}
+
+void decode_governor_get_stats(DecodeGovernor *governor, int64_t now,
+		DecodeGovernorStats *stats) {
+	pthread_mutex_lock(&governor->mutex);
+	*stats = governor->stats;
+	if (stats->level != DECODE_GOVERNOR_LEVEL_FULL)
+		stats->degraded_us += now - governor->degraded_since;
+	pthread_mutex_unlock(&governor->mutex);
+}
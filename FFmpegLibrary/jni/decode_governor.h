@@ -0,0 +1,79 @@
+/*
+ * decode_governor.h
+ * Copyright (c) 2026 FFmpegAndroid contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef DECODE_GOVERNOR_H_
+#define DECODE_GOVERNOR_H_
+
+#include <stdint.h>
+
+typedef struct _DecodeGovernor DecodeGovernor;
+
+/*
+ * Steps of video decoding degradation, every step keeps skips of the
+ * previous ones.
+ */
+typedef enum DecodeGovernorLevel {
+	DECODE_GOVERNOR_LEVEL_FULL = 0,
+	// no deblocking of frames nothing refers to
+	DECODE_GOVERNOR_LEVEL_SKIP_LOOP_FILTER,
+	// frames nothing refers to (B-frames mostly) are not decoded
+	DECODE_GOVERNOR_LEVEL_SKIP_NONREF,
+	// only keyframes are decoded
+	DECODE_GOVERNOR_LEVEL_SKIP_NONKEY,
+	DECODE_GOVERNOR_LEVEL_NB,
+} DecodeGovernorLevel;
+
+typedef struct DecodeGovernorStats {
+	DecodeGovernorLevel level;
+	int escalations;
+	int deescalations;
+	// time spent above DECODE_GOVERNOR_LEVEL_FULL
+	int64_t degraded_us;
+} DecodeGovernorStats;
+
+// lateness of packet that did not give a frame
+#define DECODE_GOVERNOR_NO_LATENESS INT64_MIN
+
+/*
+ * Picks degradation level from decode time of packets against their
+ * duration and lateness of decoded frames against master clock. Level goes
+ * up after load stays too high for a while and down after there is enough
+ * headroom for longer. Fed by one thread, stats could be read from any.
+ */
+DecodeGovernor *decode_governor_init();
+void decode_governor_free(DecodeGovernor *governor);
+
+/*
+ * Feeds one decoded packet, late_us is negative for early frames. Returns
+ * new level when it changed, -1 otherwise.
+ */
+int decode_governor_update(DecodeGovernor *governor, int64_t now,
+		int64_t decode_us, int64_t duration_us, int64_t late_us);
+
+/*
+ * Forgets samples (after seek or when clock was stopped). Level is dropped
+ * to DECODE_GOVERNOR_LEVEL_FULL unless keep_level is set.
+ */
+void decode_governor_reset(DecodeGovernor *governor, int64_t now,
+		int keep_level);
+
+DecodeGovernorLevel decode_governor_level(DecodeGovernor *governor);
+void decode_governor_get_stats(DecodeGovernor *governor, int64_t now,
+		DecodeGovernorStats *stats);
+
+#endif /* DECODE_GOVERNOR_H_ */
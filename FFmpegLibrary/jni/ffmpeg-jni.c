@@ -35,12 +35,14 @@
 #define LOG_LEVEL 10
 
 static JNINativeMethod player_methods[] = {
-	{"initNative", "()I", (void*) jni_player_init},
+	{"initNative", "(I)I", (void*) jni_player_init},
 	{"deallocNative", "()V", (void*) jni_player_dealloc},
 	{"seekNative", "(I)V", (void*) jni_player_seek},
 	{"pauseNative", "()V", (void*) jni_player_pause},
 	{"resumeNative", "()V", (void*) jni_player_resume},
 	{"setDataSourceNative", "(Ljava/lang/String;Ljava/util/Map;III)I", (void*) jni_player_set_data_source},
+	{"prepareNextDataSourceNative", "(Ljava/lang/String;Ljava/util/Map;)I", (void*) jni_player_prepare_next},
+	{"playNextDataSourceNative", "()I", (void*) jni_player_play_next},
 	{"stopNative", "()V", (void*) jni_player_stop},
 	{"renderFrameStart", "()V", (void*) jni_player_render_frame_start},
 	{"renderFrameStop", "()V", (void*) jni_player_render_frame_stop},
@@ -48,6 +50,7 @@ static JNINativeMethod player_methods[] = {
 	{"releaseFrame", "()V", (void*) jni_player_release_frame},
 	{"getVideoDurationNative", "()I", (void*) jni_player_get_video_duration},
 	{"getStreamingTypeNative", "()I", (void*) jni_player_get_streaming_type},
+	{"getStatsNative", "()[J", (void*) jni_player_get_stats},
 };
 
 static int register_native_methods(JNIEnv* env,
@@ -0,0 +1,290 @@
+/*
+ * frame_pool.c
+ * Copyright (c) 2026 FFmpegAndroid contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/common.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/mem.h>
+#include <libavutil/pixdesc.h>
+
+#include <android/log.h>
+#include <jni.h>
+
+#include "helpers.h"
+#include "frame_pool.h"
+
+#define LOG_LEVEL 1
+#define LOG_TAG "AVEngine:frame_pool.c"
+
+/*
+ * Every picture is a single buffer with planes one after another. Planes
+ * and their lines start at FRAME_POOL_ALIGN bytes and every plane is
+ * followed by the same padding avcodec_default_get_buffer2 leaves, some
+ * decoders read behind the last line.
+ */
+#define FRAME_POOL_ALIGN 64
+#define FRAME_POOL_PLANE_PADDING (16 + FRAME_POOL_ALIGN - 1)
+#define FRAME_POOL_PLANES 4
+
+typedef struct FramePoolBuffer {
+	struct FramePoolBuffer *next;
+	FramePool *pool;
+	// as returned by av_malloc, data is aligned to FRAME_POOL_ALIGN
+	uint8_t *allocated;
+	uint8_t *data;
+	int size;
+} FramePoolBuffer;
+
+struct _FramePool {
+	pthread_mutex_t mutex;
+	FramePoolBuffer *free_buffers;
+	// geometry of the last requested picture
+	int format;
+	int width;
+	int height;
+	int linesizes[FRAME_POOL_PLANES];
+	int offsets[FRAME_POOL_PLANES];
+	int size;
+	// buffers held by decoders or decoded frames
+	int taken;
+	int freed;
+	FramePoolStats stats;
+};
+
+FramePool *frame_pool_init() {
+	FramePool *pool = malloc(sizeof(FramePool));
+	if (pool == NULL)
+		return NULL;
+	memset(pool, 0, sizeof(FramePool));
+	pool->format = -1;
+	pthread_mutex_init(&pool->mutex, NULL);
+	return pool;
+}
+
+static void frame_pool_free_buffers(FramePoolBuffer *buffer) {
+	while (buffer != NULL) {
+		FramePoolBuffer *next = buffer->next;
+		av_free(buffer->allocated);
+		av_free(buffer);
+		buffer = next;
+	}
+}
+
+static void frame_pool_destroy(FramePool *pool) {
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool);
+}
+
+void frame_pool_free(FramePool *pool) {
+	FramePoolBuffer *free_buffers;
+	int destroy;
+
+	pthread_mutex_lock(&pool->mutex);
+	free_buffers = pool->free_buffers;
+	pool->free_buffers = NULL;
+	pool->freed = TRUE;
+	destroy = pool->taken == 0;
+	pthread_mutex_unlock(&pool->mutex);
+
+	frame_pool_free_buffers(free_buffers);
+	if (destroy)
+		frame_pool_destroy(pool);
+}
+
+void frame_pool_get_stats(FramePool *pool, FramePoolStats *stats) {
+	pthread_mutex_lock(&pool->mutex);
+	*stats = pool->stats;
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+#if LIBAVCODEC_VERSION_MAJOR >= 55
+
+/*
+ * Lines are padded the way decoder wants them for given coded dimensions
+ * and rounded up to FRAME_POOL_ALIGN. Has to be called with mutex locked.
+ */
+static int frame_pool_set_geometry(FramePool *pool, AVCodecContext *ctx,
+		AVFrame *frame) {
+	int stride_align[AV_NUM_DATA_POINTERS];
+	int linesizes[FRAME_POOL_PLANES];
+	uint8_t *planes[FRAME_POOL_PLANES];
+	int w = frame->width;
+	int h = frame->height;
+	int size, offset, i;
+
+	avcodec_align_dimensions2(ctx, &w, &h, stride_align);
+	if (av_image_fill_linesizes(linesizes, frame->format, w) < 0)
+		return -1;
+	for (i = 0; i < FRAME_POOL_PLANES; ++i)
+		linesizes[i] = FFALIGN(linesizes[i], FRAME_POOL_ALIGN);
+	// with NULL data planes are offsets of tightly packed picture
+	size = av_image_fill_pointers(planes, frame->format, h, NULL, linesizes);
+	if (size < 0)
+		return -1;
+
+	offset = 0;
+	for (i = 0; i < FRAME_POOL_PLANES; ++i) {
+		int plane_size;
+		pool->linesizes[i] = linesizes[i];
+		if (linesizes[i] == 0) {
+			pool->offsets[i] = 0;
+			continue;
+		}
+		if (i + 1 < FRAME_POOL_PLANES && linesizes[i + 1] != 0)
+			plane_size = planes[i + 1] - planes[i];
+		else
+			plane_size = size - (planes[i] - planes[0]);
+		pool->offsets[i] = offset;
+		offset += FFALIGN(plane_size + FRAME_POOL_PLANE_PADDING,
+				FRAME_POOL_ALIGN);
+	}
+	pool->format = frame->format;
+	pool->width = frame->width;
+	pool->height = frame->height;
+	pool->size = offset;
+	LOGI(3, "frame_pool_set_geometry format: %d, %dx%d, size: %d",
+			frame->format, frame->width, frame->height, pool->size);
+	return 0;
+}
+
+static FramePoolBuffer *frame_pool_alloc(FramePool *pool, int size) {
+	FramePoolBuffer *buffer = av_malloc(sizeof(FramePoolBuffer));
+	if (buffer == NULL)
+		return NULL;
+	// av_malloc alignment depends on how FFmpeg was configured
+	buffer->allocated = av_malloc(size + FRAME_POOL_ALIGN - 1);
+	if (buffer->allocated == NULL) {
+		av_free(buffer);
+		return NULL;
+	}
+	buffer->data = (uint8_t *) FFALIGN((uintptr_t) buffer->allocated,
+			FRAME_POOL_ALIGN);
+	buffer->pool = pool;
+	buffer->size = size;
+	buffer->next = NULL;
+	return buffer;
+}
+
+static void frame_pool_release(void *opaque, uint8_t *data) {
+	FramePoolBuffer *buffer = opaque;
+	FramePool *pool = buffer->pool;
+	int destroy;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->taken -= 1;
+	if (pool->freed || buffer->size != pool->size) {
+		pool->stats.resident_bytes -= buffer->size;
+	} else {
+		buffer->next = pool->free_buffers;
+		pool->free_buffers = buffer;
+		buffer = NULL;
+	}
+	destroy = pool->freed && pool->taken == 0;
+	pthread_mutex_unlock(&pool->mutex);
+
+	if (buffer != NULL)
+		frame_pool_free_buffers(buffer);
+	if (destroy)
+		frame_pool_destroy(pool);
+}
+
+static int frame_pool_get_buffer2(AVCodecContext *ctx, AVFrame *frame,
+		int flags) {
+	FramePool *pool = ctx->opaque;
+	const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+	FramePoolBuffer *buffer;
+	FramePoolBuffer *dropped = NULL;
+	int linesizes[FRAME_POOL_PLANES];
+	int offsets[FRAME_POOL_PLANES];
+	int size, i;
+
+	// palettes and hardware surfaces are left to libavcodec
+	if (desc == NULL
+			|| desc->flags & (PIX_FMT_PAL | PIX_FMT_PSEUDOPAL | PIX_FMT_HWACCEL))
+		return avcodec_default_get_buffer2(ctx, frame, flags);
+
+	pthread_mutex_lock(&pool->mutex);
+	if (frame->format != pool->format || frame->width != pool->width
+			|| frame->height != pool->height) {
+		if (frame_pool_set_geometry(pool, ctx, frame) < 0) {
+			pool->format = -1;
+			pthread_mutex_unlock(&pool->mutex);
+			return avcodec_default_get_buffer2(ctx, frame, flags);
+		}
+		// new stream or resolution change, old buffers would not fit
+		dropped = pool->free_buffers;
+		pool->free_buffers = NULL;
+		for (buffer = dropped; buffer != NULL; buffer = buffer->next)
+			pool->stats.resident_bytes -= buffer->size;
+	}
+	memcpy(linesizes, pool->linesizes, sizeof(linesizes));
+	memcpy(offsets, pool->offsets, sizeof(offsets));
+	size = pool->size;
+	buffer = pool->free_buffers;
+	if (buffer != NULL) {
+		pool->free_buffers = buffer->next;
+		pool->stats.hits += 1;
+	} else {
+		pool->stats.misses += 1;
+		pool->stats.resident_bytes += size;
+	}
+	pool->taken += 1;
+	pthread_mutex_unlock(&pool->mutex);
+
+	frame_pool_free_buffers(dropped);
+	if (buffer == NULL) {
+		buffer = frame_pool_alloc(pool, size);
+		if (buffer == NULL) {
+			LOGE(1, "frame_pool_get_buffer2 could not allocate %d bytes", size);
+			pthread_mutex_lock(&pool->mutex);
+			pool->taken -= 1;
+			pool->stats.resident_bytes -= size;
+			pthread_mutex_unlock(&pool->mutex);
+			return AVERROR(ENOMEM);
+		}
+	}
+
+	frame->buf[0] = av_buffer_create(buffer->data, buffer->size,
+			frame_pool_release, buffer, 0);
+	if (frame->buf[0] == NULL) {
+		frame_pool_release(buffer, buffer->data);
+		return AVERROR(ENOMEM);
+	}
+	for (i = 0; i < FRAME_POOL_PLANES; ++i) {
+		frame->linesize[i] = linesizes[i];
+		frame->data[i] = linesizes[i] ? buffer->data + offsets[i] : NULL;
+	}
+	frame->extended_data = frame->data;
+	return 0;
+}
+
+void frame_pool_attach(FramePool *pool, AVCodecContext *ctx,
+		AVCodec *codec) {
+	if (!(codec->capabilities & CODEC_CAP_DR1))
+		return;
+	ctx->opaque = pool;
+	ctx->get_buffer2 = frame_pool_get_buffer2;
+	// pool is locked by itself, frame threads do not have to ask main one
+	ctx->thread_safe_callbacks = 1;
+}
+
+#endif
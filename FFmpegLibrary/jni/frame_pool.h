@@ -0,0 +1,62 @@
+/*
+ * frame_pool.h
+ * Copyright (c) 2026 FFmpegAndroid contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef FRAME_POOL_H_
+#define FRAME_POOL_H_
+
+#include <stdint.h>
+
+#include <libavcodec/avcodec.h>
+
+typedef struct _FramePool FramePool;
+
+typedef struct FramePoolStats {
+	// pictures served from free buffers and from newly allocated ones
+	int hits;
+	int misses;
+	// bytes of buffers owned by the pool, free and handed to decoder
+	int64_t resident_bytes;
+} FramePoolStats;
+
+/*
+ * Pool of decoded picture buffers handed to video decoder through
+ * get_buffer2. All buffers have geometry of the last requested picture
+ * (pixel format and coded dimensions), buffers of other geometry are given
+ * back to the heap. Buffers could be taken and given back from any thread.
+ */
+FramePool *frame_pool_init();
+
+/*
+ * Frees free buffers, the pool itself goes away when decoders give back
+ * the last taken buffer.
+ */
+void frame_pool_free(FramePool *pool);
+
+#if LIBAVCODEC_VERSION_MAJOR >= 55
+/*
+ * Makes decoder allocate pictures from the pool, has to be called before
+ * avcodec_open2. Decoders without CODEC_CAP_DR1 are left with default
+ * buffers.
+ */
+void frame_pool_attach(FramePool *pool, AVCodecContext *ctx,
+		AVCodec *codec);
+#endif
+
+void frame_pool_get_stats(FramePool *pool, FramePoolStats *stats);
+
+#endif /* FRAME_POOL_H_ */
@@ -16,6 +16,9 @@
  *
  */
 
+#include <limits.h>
+#include <stdio.h>
+
 #include <android/log.h>
 #include <jni.h>
 
@@ -34,3 +37,27 @@ jfieldID java_get_field(JNIEnv *env, char * class_name, JavaField field) {
 jmethodID java_get_method(JNIEnv *env, jclass class, JavaMethod method) {
 	return (*env)->GetMethodID(env, class, method.name, method.signature);
 }
+
+int file_write_atomic(const char *path, file_write_func write_func,
+		void *data) {
+	char tmp_path[PATH_MAX];
+	FILE *file;
+	int ret;
+	int len = snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+	if (len < 0 || len >= sizeof(tmp_path)) {
+		LOGE(1, "file_write_atomic path too long: %s", path);
+		return -1;
+	}
+
+	file = fopen(tmp_path, "wb");
+	if (file == NULL)
+		return -1;
+	ret = write_func(file, data);
+	if (fclose(file) != 0)
+		ret = -1;
+	if (ret == 0 && rename(tmp_path, path) != 0)
+		ret = -1;
+	if (ret < 0)
+		remove(tmp_path);
+	return ret;
+}
@@ -19,6 +19,8 @@
 #ifndef HELPERS_H_
 #define HELPERS_H_
 
+#include <stdio.h>
+
 #define LOGI(level, ...) if (level <= LOG_LEVEL) {__android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__);}
 #define LOGE(level, ...) if (level <= LOG_LEVEL) {__android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__);}
 #define LOGW(level, ...) if (level <= LOG_LEVEL) {__android_log_print(ANDROID_LOG_WARN, LOG_TAG, __VA_ARGS__);}
@@ -43,4 +45,17 @@ typedef struct {
 jfieldID java_get_field(JNIEnv *env, char * class_name, JavaField field);
 jmethodID java_get_method(JNIEnv *env, jclass class, JavaMethod method);
 
+/*
+ * Writes data to file, returns 0 on success or -1.
+ */
+typedef int (*file_write_func)(FILE *file, void *data);
+
+/*
+ * Write file by write_func to "path.tmp" and rename it over path so
+ * readers never see partially written file. Temporary file is removed on
+ * failure. Returns 0 on success or -1.
+ */
+int file_write_atomic(const char *path, file_write_func write_func,
+		void *data);
+
 #endif /* HELPERS_H_ */
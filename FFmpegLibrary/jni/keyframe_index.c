@@ -0,0 +1,300 @@
+/*
+ * keyframe_index.c
+ * Copyright (c) 2026 FFmpegAndroid contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <jni.h>
+
+#include "helpers.h"
+#include "keyframe_index.h"
+
+#define KEYFRAME_INDEX_INITIAL_SIZE 256
+/*
+ * 16k entries (384 KiB) is over 4 hours of 1 second GOPs, longer
+ * recordings drop every other keyframe instead of growing
+ */
+#define KEYFRAME_INDEX_MAX_SIZE (16 * 1024)
+
+#define KEYFRAME_INDEX_FILE_MAGIC 0x4b465849 // "KFXI"
+#define KEYFRAME_INDEX_FILE_VERSION 1
+#define KEYFRAME_INDEX_MAX_KEY_LENGTH 4096
+
+/*
+ * Byte position is shifted left by one, lowest bit tells that range from
+ * previous entry to this one was demuxed without gaps.
+ */
+typedef struct KeyframeIndexEntry {
+	int64_t pts;
+	int64_t pos_covered;
+	int size;
+} KeyframeIndexEntry;
+
+struct _KeyframeIndex {
+	KeyframeIndexEntry *entries;
+	int size;
+	int allocated;
+	// index of last added keyframe or -1 after break
+	int last;
+	// changed since loaded or saved
+	int modified;
+};
+
+typedef struct KeyframeIndexFileHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t key_length;
+	uint32_t size;
+} KeyframeIndexFileHeader;
+
+typedef struct KeyframeIndexWrite {
+	KeyframeIndex *index;
+	const char *key;
+} KeyframeIndexWrite;
+
+#define ENTRY_POS(entry) ((entry)->pos_covered >> 1)
+#define ENTRY_COVERED(entry) ((entry)->pos_covered & 1)
+
+KeyframeIndex *keyframe_index_init() {
+	KeyframeIndex *index = malloc(sizeof(KeyframeIndex));
+	if (index == NULL)
+		return NULL;
+	index->entries = malloc(
+			sizeof(KeyframeIndexEntry) * KEYFRAME_INDEX_INITIAL_SIZE);
+	if (index->entries == NULL) {
+		free(index);
+		return NULL;
+	}
+	index->size = 0;
+	index->allocated = KEYFRAME_INDEX_INITIAL_SIZE;
+	index->last = -1;
+	index->modified = 0;
+	return index;
+}
+
+void keyframe_index_free(KeyframeIndex *index) {
+	free(index->entries);
+	free(index);
+}
+
+// first entry with pts >= given pts
+static int keyframe_index_search(KeyframeIndex *index, int64_t pts) {
+	int lo = 0, hi = index->size;
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		if (index->entries[mid].pts < pts)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static void keyframe_index_decimate(KeyframeIndex *index) {
+	int i, size = 0;
+	for (i = 0; i < index->size; ++i) {
+		KeyframeIndexEntry *entry = &index->entries[i];
+		// keep even entries, odd ones only merge into next one
+		if (i % 2 == 1 && i + 1 < index->size) {
+			KeyframeIndexEntry *next = &index->entries[i + 1];
+			if (!ENTRY_COVERED(entry))
+				next->pos_covered &= ~(int64_t) 1;
+			// previous kept entry is followed by last one only if there
+			// was no gap in between
+			if (index->last == i)
+				index->last = ENTRY_COVERED(entry) ? size - 1 : -1;
+			continue;
+		}
+		if (index->last == i)
+			index->last = size;
+		index->entries[size++] = *entry;
+	}
+	index->size = size;
+}
+
+static int keyframe_index_insert(KeyframeIndex *index, int i, int64_t pts,
+		int64_t pos, int size) {
+	if (index->size == index->allocated) {
+		if (index->allocated < KEYFRAME_INDEX_MAX_SIZE) {
+			int allocated = index->allocated * 2;
+			KeyframeIndexEntry *entries = realloc(index->entries,
+					sizeof(KeyframeIndexEntry) * allocated);
+			if (entries == NULL)
+				return -1;
+			index->entries = entries;
+			index->allocated = allocated;
+		} else {
+			keyframe_index_decimate(index);
+			i = keyframe_index_search(index, pts);
+		}
+	}
+	memmove(&index->entries[i + 1], &index->entries[i],
+			sizeof(KeyframeIndexEntry) * (index->size - i));
+	index->entries[i].pts = pts;
+	index->entries[i].pos_covered = pos << 1;
+	index->entries[i].size = size;
+	index->size += 1;
+	index->modified = 1;
+	if (index->last >= i)
+		index->last += 1;
+	return i;
+}
+
+void keyframe_index_add(KeyframeIndex *index, int64_t pts, int64_t pos,
+		int size) {
+	int i = keyframe_index_search(index, pts);
+	int j;
+	if (i == index->size || index->entries[i].pts != pts) {
+		i = keyframe_index_insert(index, i, pts, pos, size);
+		if (i < 0)
+			return;
+	}
+	if (index->last >= 0 && index->last < i) {
+		for (j = index->last + 1; j <= i; ++j) {
+			if (!ENTRY_COVERED(&index->entries[j])) {
+				index->entries[j].pos_covered |= 1;
+				index->modified = 1;
+			}
+		}
+	}
+	index->last = i;
+}
+
+void keyframe_index_break(KeyframeIndex *index) {
+	index->last = -1;
+}
+
+int keyframe_index_lookup(KeyframeIndex *index, int64_t target,
+		int64_t *pts, int64_t *pos, int *size) {
+	int i = keyframe_index_search(index, target);
+	KeyframeIndexEntry *entry;
+	if (i < index->size && index->entries[i].pts == target) {
+		entry = &index->entries[i];
+	} else {
+		// target lies between entries i - 1 and i
+		if (i == 0 || i == index->size)
+			return -1;
+		if (!ENTRY_COVERED(&index->entries[i]))
+			return -1;
+		entry = &index->entries[i - 1];
+	}
+	*pts = entry->pts;
+	*pos = ENTRY_POS(entry);
+	if (size != NULL)
+		*size = entry->size;
+	return 0;
+}
+
+int keyframe_index_size(KeyframeIndex *index) {
+	return index->size;
+}
+
+int keyframe_index_modified(KeyframeIndex *index) {
+	return index->modified;
+}
+
+KeyframeIndex *keyframe_index_load(const char *path, const char *key) {
+	KeyframeIndexFileHeader header;
+	KeyframeIndex *index = NULL;
+	char *file_key = NULL;
+	int allocated, i;
+	FILE *file = fopen(path, "rb");
+	if (file == NULL)
+		return NULL;
+
+	if (fread(&header, sizeof(header), 1, file) != 1)
+		goto error;
+	if (header.magic != KEYFRAME_INDEX_FILE_MAGIC
+			|| header.version != KEYFRAME_INDEX_FILE_VERSION
+			|| header.key_length != strlen(key)
+			|| header.size > KEYFRAME_INDEX_MAX_SIZE)
+		goto error;
+	file_key = malloc(header.key_length);
+	if (file_key == NULL)
+		goto error;
+	if (fread(file_key, 1, header.key_length, file) != header.key_length)
+		goto error;
+	if (memcmp(file_key, key, header.key_length) != 0)
+		goto error;
+
+	index = keyframe_index_init();
+	if (index == NULL)
+		goto error;
+	allocated = index->allocated;
+	while (allocated < header.size)
+		allocated *= 2;
+	if (allocated != index->allocated) {
+		KeyframeIndexEntry *entries = realloc(index->entries,
+				sizeof(KeyframeIndexEntry) * allocated);
+		if (entries == NULL)
+			goto error;
+		index->entries = entries;
+		index->allocated = allocated;
+	}
+	if (fread(index->entries, sizeof(KeyframeIndexEntry), header.size, file)
+			!= header.size)
+		goto error;
+	for (i = 1; i < header.size; ++i) {
+		if (index->entries[i - 1].pts >= index->entries[i].pts)
+			goto error;
+	}
+	index->size = header.size;
+
+	free(file_key);
+	fclose(file);
+	return index;
+
+error:
+	if (index != NULL)
+		keyframe_index_free(index);
+	free(file_key);
+	fclose(file);
+	return NULL;
+}
+
+static int keyframe_index_write(FILE *file, KeyframeIndexWrite *save) {
+	KeyframeIndex *index = save->index;
+	KeyframeIndexFileHeader header;
+
+	header.magic = KEYFRAME_INDEX_FILE_MAGIC;
+	header.version = KEYFRAME_INDEX_FILE_VERSION;
+	header.key_length = strlen(save->key);
+	header.size = index->size;
+	if (fwrite(&header, sizeof(header), 1, file) != 1)
+		return -1;
+	if (fwrite(save->key, 1, header.key_length, file) != header.key_length)
+		return -1;
+	if (fwrite(index->entries, sizeof(KeyframeIndexEntry), index->size, file)
+			!= index->size)
+		return -1;
+	return 0;
+}
+
+int keyframe_index_save(KeyframeIndex *index, const char *path,
+		const char *key) {
+	KeyframeIndexWrite save = { index, key };
+
+	if (strlen(key) > KEYFRAME_INDEX_MAX_KEY_LENGTH)
+		return -1;
+	if (file_write_atomic(path, (file_write_func) keyframe_index_write,
+			&save) < 0)
+		return -1;
+	index->modified = 0;
+	return 0;
+}
@@ -0,0 +1,66 @@
+/*
+ * keyframe_index.h
+ * Copyright (c) 2026 FFmpegAndroid contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef KEYFRAME_INDEX_H_
+#define KEYFRAME_INDEX_H_
+
+#include <stdint.h>
+
+typedef struct _KeyframeIndex KeyframeIndex;
+
+/*
+ * Keyframes pts -> byte position sorted by pts, filled while demuxing.
+ * Range between two neighbouring keyframes is known to have no other
+ * keyframes only if both were demuxed one after another, so parts of file
+ * skipped by seeks are not covered until they are read. Not thread safe.
+ */
+KeyframeIndex *keyframe_index_init();
+void keyframe_index_free(KeyframeIndex *index);
+
+/*
+ * Records keyframe read right after the previously added one, unless
+ * keyframe_index_break was called in between.
+ */
+void keyframe_index_add(KeyframeIndex *index, int64_t pts, int64_t pos,
+		int size);
+
+/*
+ * Next added keyframe does not follow previous one (demuxer was seeked).
+ */
+void keyframe_index_break(KeyframeIndex *index);
+
+/*
+ * Finds last keyframe with pts <= target when target lies in a covered
+ * range. Returns 0 on success, -1 when target is not covered. size could be
+ * NULL.
+ */
+int keyframe_index_lookup(KeyframeIndex *index, int64_t target,
+		int64_t *pts, int64_t *pos, int *size);
+
+int keyframe_index_size(KeyframeIndex *index);
+int keyframe_index_modified(KeyframeIndex *index);
+
+/*
+ * Index file keeps key describing indexed media, load returns NULL when file
+ * does not exist, is corrupted or was written for different key.
+ */
+KeyframeIndex *keyframe_index_load(const char *path, const char *key);
+int keyframe_index_save(KeyframeIndex *index, const char *path,
+		const char *key);
+
+#endif /* KEYFRAME_INDEX_H_ */
@@ -54,3 +54,8 @@ jboolean jni_nativetester_is_neon(JNIEnv *env, jobject thiz) {
 #endif
 }
 
+jint jni_nativetester_get_cpu_count(JNIEnv *env, jobject thiz) {
+	int count = android_getCpuCount();
+	LOGI(5, "CPU count: %d\n", count);
+	return count > 0 ? count : 1;
+}
@@ -22,10 +22,12 @@
 static const char *nativetester_class_path_name = "net/uplayer/ffmpeg/NativeTester";
 
 jboolean jni_nativetester_is_neon(JNIEnv *env, jobject thiz);
+jint jni_nativetester_get_cpu_count(JNIEnv *env, jobject thiz);
 
 
 static JNINativeMethod nativetester_methods[] = {
 		{"isNeon", "()Z", (void*) jni_nativetester_is_neon},
+		{"getCpuCount", "()I", (void*) jni_nativetester_get_cpu_count},
 };
 
 #endif /* NATIVETESTER_H_ */
@@ -0,0 +1,145 @@
+/*
+ * packet_pool.c
+ * Copyright (c) 2026 FFmpegAndroid contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <libavutil/mem.h>
+
+#include <android/log.h>
+#include <jni.h>
+
+#include "helpers.h"
+#include "packet_pool.h"
+
+#define LOG_LEVEL 1
+#define LOG_TAG "AVEngine:packet_pool.c"
+
+/*
+ * Size class i holds buffers of (1 << (PACKET_POOL_MIN_SHIFT + i)) bytes.
+ * Every buffer starts with PACKET_POOL_HEADER_SIZE bytes of header so data
+ * keeps av_malloc alignment. Free buffers above PACKET_POOL_MAX_CACHED_BYTES
+ * are given back to the heap, packets queues are bounded by bytes so in
+ * steady state the pool does not grow over it.
+ */
+#define PACKET_POOL_MIN_SHIFT 10
+#define PACKET_POOL_CLASSES 12
+#define PACKET_POOL_HEADER_SIZE 16
+#define PACKET_POOL_MAX_CACHED_BYTES (8 * 1024 * 1024)
+
+typedef struct PacketPoolBuffer {
+	struct PacketPoolBuffer *next;
+	int size_class;
+} PacketPoolBuffer;
+
+struct _PacketPool {
+	pthread_mutex_t mutex;
+	PacketPoolBuffer *free_buffers[PACKET_POOL_CLASSES];
+	PacketPoolStats stats;
+};
+
+static int packet_pool_class_size(int size_class) {
+	return 1 << (PACKET_POOL_MIN_SHIFT + size_class);
+}
+
+static int packet_pool_size_class(int size) {
+	int size_class = 0;
+	while (size_class < PACKET_POOL_CLASSES
+			&& packet_pool_class_size(size_class) < size)
+		size_class += 1;
+	return size_class;
+}
+
+PacketPool *packet_pool_init() {
+	PacketPool *pool = malloc(sizeof(PacketPool));
+	if (pool == NULL)
+		return NULL;
+	memset(pool, 0, sizeof(PacketPool));
+	pthread_mutex_init(&pool->mutex, NULL);
+	return pool;
+}
+
+void packet_pool_free(PacketPool *pool) {
+	int i;
+	for (i = 0; i < PACKET_POOL_CLASSES; ++i) {
+		PacketPoolBuffer *buffer = pool->free_buffers[i];
+		while (buffer != NULL) {
+			PacketPoolBuffer *next = buffer->next;
+			av_free(buffer);
+			buffer = next;
+		}
+	}
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool);
+}
+
+uint8_t *packet_pool_get(PacketPool *pool, int size) {
+	int size_class = packet_pool_size_class(size);
+	PacketPoolBuffer *buffer;
+
+	pthread_mutex_lock(&pool->mutex);
+	if (size_class >= PACKET_POOL_CLASSES) {
+		pool->stats.oversized += 1;
+		pthread_mutex_unlock(&pool->mutex);
+		return NULL;
+	}
+	buffer = pool->free_buffers[size_class];
+	if (buffer != NULL) {
+		pool->free_buffers[size_class] = buffer->next;
+		pool->stats.reuses += 1;
+		pool->stats.cached_bytes -= packet_pool_class_size(size_class);
+		pthread_mutex_unlock(&pool->mutex);
+		return (uint8_t *) buffer + PACKET_POOL_HEADER_SIZE;
+	}
+	pool->stats.mallocs += 1;
+	pthread_mutex_unlock(&pool->mutex);
+
+	buffer = av_malloc(PACKET_POOL_HEADER_SIZE
+			+ packet_pool_class_size(size_class));
+	if (buffer == NULL) {
+		LOGE(1, "packet_pool_get could not allocate %d bytes", size);
+		return NULL;
+	}
+	buffer->size_class = size_class;
+	return (uint8_t *) buffer + PACKET_POOL_HEADER_SIZE;
+}
+
+void packet_pool_put(PacketPool *pool, uint8_t *data) {
+	PacketPoolBuffer *buffer =
+			(PacketPoolBuffer *) (data - PACKET_POOL_HEADER_SIZE);
+	int class_size = packet_pool_class_size(buffer->size_class);
+
+	pthread_mutex_lock(&pool->mutex);
+	if (pool->stats.cached_bytes + class_size > PACKET_POOL_MAX_CACHED_BYTES) {
+		pool->stats.frees += 1;
+		pthread_mutex_unlock(&pool->mutex);
+		av_free(buffer);
+		return;
+	}
+	buffer->next = pool->free_buffers[buffer->size_class];
+	pool->free_buffers[buffer->size_class] = buffer;
+	pool->stats.cached_bytes += class_size;
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+void packet_pool_get_stats(PacketPool *pool, PacketPoolStats *stats) {
+	pthread_mutex_lock(&pool->mutex);
+	*stats = pool->stats;
+	pthread_mutex_unlock(&pool->mutex);
+}
@@ -0,0 +1,54 @@
+/*
+ * packet_pool.h
+ * Copyright (c) 2026 FFmpegAndroid contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef PACKET_POOL_H_
+#define PACKET_POOL_H_
+
+#include <stdint.h>
+
+typedef struct _PacketPool PacketPool;
+
+typedef struct PacketPoolStats {
+	// buffers taken from the heap and given back to it
+	int mallocs;
+	int frees;
+	// buffers served from the pool
+	int reuses;
+	// requests too big for the pool
+	int oversized;
+	// bytes held by free buffers
+	int cached_bytes;
+} PacketPoolStats;
+
+/*
+ * Size-classed pool of packet payload buffers. Buffers could be taken and
+ * given back from any thread.
+ */
+PacketPool *packet_pool_init();
+void packet_pool_free(PacketPool *pool);
+
+/*
+ * Returns buffer of at least size bytes or NULL when size is bigger than
+ * the biggest size class or memory could not be allocated.
+ */
+uint8_t *packet_pool_get(PacketPool *pool, int size);
+void packet_pool_put(PacketPool *pool, uint8_t *data);
+
+void packet_pool_get_stats(PacketPool *pool, PacketPoolStats *stats);
+
+#endif /* PACKET_POOL_H_ */
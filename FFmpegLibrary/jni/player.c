@@ -20,6 +20,7 @@
 #include <stdio.h>
 #include <assert.h>
 #include <unistd.h>
+#include <sys/stat.h>
 
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
@@ -53,9 +54,15 @@
 /*local headers*/
 #include "helpers.h"
 #include "queue.h"
+#include "packet_pool.h"
+#include "frame_pool.h"
+#include "keyframe_index.h"
+#include "stream_info_cache.h"
+#include "decode_governor.h"
 #include "player.h"
 #include "jni-protocol.h"
 #include "aes-protocol.h"
+#include "cache-protocol.h"
 
 #include "player_static.h"
 
@@ -63,6 +70,8 @@
 #define LOG_TAG "AVEngine:player.c"
 
 #define DO_NOT_SEEK (0xdeadbeef)
+// seek_position requesting read thread to switch to prepared next input
+#define SEEK_TO_NEXT_INPUT (0xdeadbeee)
 
 #ifndef AVCODEC_MAX_AUDIO_FRAME_SIZE
 #	define AVCODEC_MAX_AUDIO_FRAME_SIZE 96000 // 0.5 second of 48khz 32bit audio
@@ -72,6 +81,157 @@
 #define MIN_SLEEP_TIME_US 10000
 #define EXTERNAL_CLOCK_SPEED_STEP 0.001
 
+// av_read_frame returning EAGAIN is retried after backoff doubled from min
+// to max, demuxer does not tell when data will be ready
+#define READ_EAGAIN_MIN_BACKOFF_MS 1
+#define READ_EAGAIN_MAX_BACKOFF_MS 100
+
+// packets queues are bounded by bytes and buffered duration, the number of
+// slots is only an upper bound for very small packets
+#define PACKETS_QUEUE_SIZE 1000
+#define AUDIO_PACKETS_QUEUE_MAX_BYTES (1024 * 1024)
+#define VIDEO_PACKETS_QUEUE_MAX_BYTES (8 * 1024 * 1024)
+#define PACKETS_QUEUE_MAX_DURATION_MS 5000
+
+// playback is stopped when all packets queues fall below low watermark
+// and resumed when any of them reaches high watermark
+#define BUFFERING_LOW_WATERMARK_MS 100
+#define BUFFERING_HIGH_WATERMARK_MS 2000
+
+// fast_start probe limits, full probe is done when they are not enough
+#define FAST_START_PROBESIZE (64 * 1024)
+#define FAST_START_MAX_ANALYZE_DURATION (AV_TIME_BASE / 2)
+
+// frame threading delays output by one frame per thread, more threads do
+// not pay off
+#define MAX_DECODER_THREADS 4
+
+// decoded frames waiting for renderer absorb decode time spikes (e.g. on
+// keyframes), one slot of the queue is always free
+#define VIDEO_FRAMES_QUEUE_SIZE (12 + 1)
+
+// frame later than that is dropped by renderer when a newer one is ready,
+// kept below DECODE_GOVERNOR_LATE_US so dropping comes before degradation
+#define LATE_FRAME_THRESHOLD_MS 50
+
+// packets pushed/popped with a single queue transition
+#define PACKETS_BATCH_SIZE 8
+
+// layout of array returned by jni_player_get_stats, has to be kept in sync
+// with FFmpegStats.java
+enum PlayerStatsQueue {
+	PLAYER_STATS_QUEUE_VIDEO_PACKETS = 0,
+	PLAYER_STATS_QUEUE_AUDIO_PACKETS,
+	PLAYER_STATS_QUEUE_VIDEO_FRAMES,
+	PLAYER_STATS_QUEUE_NB,
+};
+
+enum PlayerStatsQueueField {
+	QUEUE_STATS_SIZE = 0,
+	QUEUE_STATS_COUNT,
+	QUEUE_STATS_BYTES,
+	QUEUE_STATS_DURATION_MS,
+	QUEUE_STATS_HIGH_WATER,
+	QUEUE_STATS_PUSH_WAITS,
+	QUEUE_STATS_PUSH_WAIT_US,
+	QUEUE_STATS_POP_WAITS,
+	QUEUE_STATS_POP_WAIT_US,
+	QUEUE_STATS_WAKEUPS,
+	QUEUE_STATS_SPURIOUS_WAKEUPS,
+	QUEUE_STATS_FLUSHES,
+	QUEUE_STATS_FLUSHED,
+	QUEUE_STATS_ALLOCATED,
+	QUEUE_STATS_HISTOGRAM,
+	QUEUE_STATS_NB = QUEUE_STATS_HISTOGRAM + QUEUE_HISTOGRAM_BUCKETS,
+};
+
+enum PlayerStatsPacketPoolField {
+	PACKET_POOL_STATS_MALLOCS = 0,
+	PACKET_POOL_STATS_FREES,
+	PACKET_POOL_STATS_REUSES,
+	PACKET_POOL_STATS_OVERSIZED,
+	PACKET_POOL_STATS_CACHED_BYTES,
+	PACKET_POOL_STATS_NB,
+};
+
+enum PlayerStats {
+	PLAYER_STATS_QUEUES = 0,
+	PLAYER_STATS_PACKET_POOL = PLAYER_STATS_QUEUES
+			+ PLAYER_STATS_QUEUE_NB * QUEUE_STATS_NB,
+	PLAYER_STATS_PACKETS_BYTES_MOVED = PLAYER_STATS_PACKET_POOL
+			+ PACKET_POOL_STATS_NB,
+	PLAYER_STATS_PACKETS_BYTES_COPIED,
+	PLAYER_STATS_KEYFRAME_INDEX_ENTRIES,
+	PLAYER_STATS_KEYFRAME_INDEX_SEEKS,
+	PLAYER_STATS_READ_EAGAINS,
+	PLAYER_STATS_PROBE_US,
+	PLAYER_STATS_PROBE_FALLBACK,
+	PLAYER_STATS_PROBE_CACHED,
+	PLAYER_STATS_TIME_TO_FIRST_FRAME_US,
+	PLAYER_STATS_DECODER_THREADS,
+	PLAYER_STATS_DEGRADATION_LEVEL,
+	PLAYER_STATS_DEGRADATION_ESCALATIONS,
+	PLAYER_STATS_DEGRADATION_DEESCALATIONS,
+	PLAYER_STATS_DEGRADED_US,
+	PLAYER_STATS_FRAMES_LATE,
+	PLAYER_STATS_FRAMES_DROPPED,
+	PLAYER_STATS_FRAME_POOL_HITS,
+	PLAYER_STATS_FRAME_POOL_MISSES,
+	PLAYER_STATS_FRAME_POOL_RESIDENT_BYTES,
+	PLAYER_STATS_NB,
+};
+
+/*
+ * Everything that belongs to one opened media. Player plays its input,
+ * next input could be prepared in the background and swapped with it.
+ */
+typedef struct PlayerInput {
+	AVFormatContext *format_ctx;
+	int64_t probe_time_us;
+	int probe_fallback;
+	int stream_info_cached;
+	// keyframes of seek stream seen by read thread, NULL when demuxer
+	// has its own index or could not seek by bytes
+	KeyframeIndex *keyframe_index;
+	int keyframe_index_stream;
+	// identifies media in cache_dir, NULL when it is not cached
+	char *cache_key;
+	// where keyframe_index is kept between opens, NULL when not persisted
+	char *keyframe_index_path;
+	char *keyframe_index_key;
+	int keyframe_index_entries;
+	int keyframe_index_seeks;
+
+	int video_index;
+	int audio_index;
+	AVStream *input_streams[AVMEDIA_TYPE_NB];
+	AVCodecContext *input_codec_ctxs[AVMEDIA_TYPE_NB];
+	int stream_indexs[AVMEDIA_TYPE_NB];
+	AVFrame *input_frames[AVMEDIA_TYPE_NB];
+	// threads video decoder really uses
+	int decoder_threads;
+
+	struct SwrContext *swr_context;
+
+	long video_duration;
+	int streaming_type;
+
+	Queue *packets_queue[AVMEDIA_TYPE_NB];
+	// serial of packets queued by player_prepare_next
+	int serial;
+	// prepared next input plays with current threads, audio track and
+	// bitmaps
+	int gapless;
+} PlayerInput;
+
+// Bitmap returned to Java with frame wrapping its pixels
+typedef struct VideoRGBFrameElem {
+	AVFrame *frame;
+	jobject jbitmap;
+	int width;
+	int height;
+} VideoRGBFrameElem;
+
 typedef struct Player {
 	JavaVM *get_javavm;
 	jobject thiz;
@@ -90,48 +250,93 @@ typedef struct Player {
 	jmethodID prepareFrame;
 	jmethodID onUpdateTime;
 	jmethodID prepareAudioTrack;
+	jmethodID onBuffering;
+	jmethodID onNextDataSourceStarted;
+	jmethodID onDegradation;
 
 	pthread_mutex_t mutex_operation;
 
-	AVFormatContext *format_ctx;
+	PlayerInput input;
 	int64_t open_time;
-
-	int video_index;
-	int audio_index;
-	AVStream *input_streams[AVMEDIA_TYPE_NB];
-	AVCodecContext *input_codec_ctxs[AVMEDIA_TYPE_NB];
-	int stream_indexs[AVMEDIA_TYPE_NB];
-	AVFrame *input_frames[AVMEDIA_TYPE_NB];
+	// time of last player_set_data_source call and what it took to show
+	// first frame (0 until shown)
+	int64_t open_start_time;
+	int64_t time_to_first_frame_us;
+
+	// prepared by player_prepare_next, taken by read thread when input
+	// ends or by jni_player_play_next, guarded by mutex_queue
+	PlayerInput *next_input;
+	int next_preparing;
+	int next_abort;
+	int64_t next_open_time;
+	// decoders waiting for read thread to swap inputs and number of swaps
+	int next_waiting;
+	int input_generation;
 
 	enum PixelFormat out_format;
 
 	jobject audio_track;
 	enum AVSampleFormat audio_track_format;
 	int audio_track_channel_count;
+	int audio_track_sample_rate;
 
-	struct SwsContext *sws_context;
-	struct SwrContext *swr_context;
 	DECLARE_ALIGNED(16,uint8_t,audio_buf2)[AVCODEC_MAX_AUDIO_FRAME_SIZE * 4];
 
-	long video_duration;
 	int last_updated_time;
 
 	int playing;
-	int streaming_type;
 
 	pthread_mutex_t mutex_queue;
 	pthread_cond_t cond_queue;
-	Queue *packets_queue[AVMEDIA_TYPE_NB];
-	Queue *rgb_video_queue;
+	int packets_queue_max_bytes[AVMEDIA_TYPE_NB];
+	int packets_queue_max_duration[AVMEDIA_TYPE_NB];
+	int buffering_low_ms;
+	int buffering_high_ms;
+	int pause_buffer_bytes;
+	int fast_start;
+	// video decoder threads, 0 - one per core
+	int decoder_threads;
+	// cores reported by NativeTester
+	int cpu_count;
+	// video decoding is degraded under load, 0 - never
+	int decoder_degradation;
+	DecodeGovernor *decode_governor;
+	// frame later than late_frame_ms is dropped when newer one is ready,
+	// late_frame_drop 0 - frames are never dropped
+	int late_frame_drop;
+	int late_frame_ms;
+	// shown after their time and dropped by renderer, guarded by
+	// mutex_queue
+	int64_t frames_late;
+	int64_t frames_dropped;
+	char *cache_dir;
+	Queue *video_frames_queue;
+	// bitmap and conversion of frame being shown, used only by renderer
+	VideoRGBFrameElem *rgb_frame;
+	struct SwsContext *sws_context;
+	// time renderer spent on last conversion, it wakes up that earlier
+	int64_t convert_us;
+	// payload of queued packets
+	PacketPool *packet_pool;
+	// decoded pictures, 0 - decoder allocates them itself
+	int video_frame_pool;
+	FramePool *frame_pool;
+	// bytes of packets handed over to decoders without and with copying
+	int64_t packets_bytes_moved;
+	int64_t packets_bytes_copied;
+	// av_read_frame calls that returned EAGAIN
+	int64_t read_eagains;
 
 	int interrupt_renderer;
 	int pause;
+	int buffering;
 	int stop;
 	int seek_position;
-	int flush_streams[AVMEDIA_TYPE_NB];
-	int flush_video_play;
-
-	int stop_streams[AVMEDIA_TYPE_NB];
+	// changed by every successful seek and input swap, entries queued
+	// with other serial are stale
+	int serial;
+	// serials are taken from this counter and never reused
+	int last_serial;
 
 	int rendering;
 
@@ -177,22 +382,67 @@ typedef struct DecoderState {
 typedef struct DecoderData {
 	struct Player *player;
 	enum AVMediaType media_type;
+	// serial of last flush handled by decoder
+	int serial;
 } DecoderData;
 
-typedef struct VideoRGBFrameElem {
+/*
+ * Packets and frames queues carry control entries in stream order
+ * together with data. FLUSH is queued by seek before first packet read at
+ * new position, EOS after last packet and STOP when reading thread exits
+ * without player being stopped. NEXT replaces EOS when playback continues
+ * with prepared next input, decoders switch to its packets queues.
+ */
+typedef enum QueueEntryType {
+	QUEUE_ENTRY_DATA = 0,
+	QUEUE_ENTRY_FLUSH,
+	QUEUE_ENTRY_EOS,
+	QUEUE_ENTRY_STOP,
+	QUEUE_ENTRY_NEXT,
+} QueueEntryType;
+
+/*
+ * Decoded frame, referenced when libavcodec counts references of its
+ * frames and copied otherwise.
+ */
+typedef struct VideoFrameElem {
 	AVFrame *frame;
-	jobject jbitmap;
+	int width;
+	int height;
+	enum AVPixelFormat format;
 	double time;
-	int end_of_stream;
-} VideoRGBFrameElem;
+	QueueEntryType type;
+	int serial;
+#if LIBAVCODEC_VERSION_MAJOR < 55
+	// frame data is allocated for width x height picture of format
+	int allocated;
+#endif
+} VideoFrameElem;
 
 typedef struct PacketData {
-	int end_of_stream;
+	QueueEntryType type;
+	int serial;
+	// packet data is taken from player->packet_pool
+	int pooled;
 	AVPacket *packet;
 } PacketData;
 
+typedef struct PacketsBatch {
+	PacketData *packets[PACKETS_BATCH_SIZE];
+	int to_write;
+	int reserved;
+	int written;
+} PacketsBatch;
+
 static void player_update_current_time(State *state, int is_finished);
+static void player_flush_packet(Player *player, PacketData *packet_data);
+static int player_take_packet(Player *player, PacketData *packet_data,
+		AVPacket *pkt);
 static void player_update_time(State *state, double time);
+static void player_measure_packet(AVFormatContext *ic,
+		PacketData *packet_data, int *bytes, int *duration);
+static void player_free_prepared_input(Player *player, PlayerInput *input);
+static int decoder_interrupt_cb(void *ctx);
 
 static void throw_exception(JNIEnv *env, const char * exception_class_path,
 		const char *msg) {
@@ -210,7 +460,7 @@ static void throw_interrupted_exception(JNIEnv *env, const char * msg) {
 
 /* get the current video clock value */
 static double get_video_clock(Player *player) {
-	if (player->pause) {
+	if (player->pause || player->buffering) {
 		return player->video_current_pts;
 	} else {
 		return player->video_current_pts_drift + av_gettime() / 1000000.0;
@@ -219,7 +469,7 @@ static double get_video_clock(Player *player) {
 
 /* get the current external clock value */
 static double get_external_clock(Player *player) {
-	if (player->pause) {
+	if (player->pause || player->buffering) {
 		return player->external_clock;
 	} else {
 		double time = av_gettime() / 1000000.0;
@@ -245,13 +495,69 @@ static void update_video_pts(Player *player, double pts) {
 	player->video_current_pts_drift = player->video_current_pts - time;
 }
 
+/*
+ * Playback is stopped by user pause or by buffering. Clocks and audio track
+ * are stopped before first of them is set and started after last of them
+ * is cleared. Have to be called with mutex_queue held.
+ */
+static void player_clocks_stop(Player *player, JNIEnv *env) {
+	update_external_clock_pts(player, get_external_clock(player));
+
+	if (player->audio_track) {
+		(*env)->CallVoidMethod(env, player->audio_track, player->audio_track_pause);
+	}
+
+	player->audio_pause_time = av_gettime();
+}
+
+static void player_clocks_start(Player *player, JNIEnv *env) {
+	if (player->audio_track) {
+		(*env)->CallVoidMethod(env, player->audio_track, player->audio_track_play);
+	}
+
+	player->audio_resume_time = av_gettime();
+	if (player->audio_write_time < player->audio_pause_time) {
+		player->audio_write_time = player->audio_resume_time;
+	} else if (player->audio_write_time < player->audio_resume_time) {
+		player->audio_write_time += player->audio_resume_time - player->audio_pause_time;
+	}
+	player->video_current_pts_drift = player->video_current_pts - av_gettime() / 1000000.0;
+	update_external_clock_pts(player, get_external_clock(player));
+}
+
+/*
+ * Wake every thread waiting for a change of the flags checked by
+ * QueueCheckFunc (stop, pause, seek, flush...). Has to be called with
+ * mutex_queue held.
+ */
+static void player_signal_control(Player *player) {
+	int i;
+	pthread_cond_broadcast(&player->cond_queue);
+	for (i = 0; i < AVMEDIA_TYPE_NB; ++i) {
+		if (player->input.packets_queue[i] != NULL)
+			queue_wake_all(player->input.packets_queue[i]);
+	}
+	if (player->video_frames_queue != NULL)
+		queue_wake_all(player->video_frames_queue);
+}
+
+static void player_first_frame_shown(Player *player) {
+	if (player->time_to_first_frame_us != 0)
+		return;
+	player->time_to_first_frame_us = av_gettime() - player->open_start_time;
+	LOGI(2, "player_first_frame_shown time to first frame: %lldus, probe: %lldus%s",
+			player->time_to_first_frame_us, player->input.probe_time_us,
+			player->input.stream_info_cached ? " (cached)" :
+			player->input.probe_fallback ? " (fast start fallback)" : "");
+}
+
 static int player_write_audio(DecoderData *decoder_data, JNIEnv *env,
 	int64_t pts, uint8_t *data, int data_size, int original_data_size) {
 	Player *player = decoder_data->player;
 	int err = ERROR_NO_ERROR;
 	int ret;
-	AVCodecContext *ctx = player->input_codec_ctxs[AVMEDIA_TYPE_AUDIO];
-	AVStream *stream = player->input_streams[AVMEDIA_TYPE_AUDIO];
+	AVCodecContext *ctx = player->input.input_codec_ctxs[AVMEDIA_TYPE_AUDIO];
+	AVStream *stream = player->input.input_streams[AVMEDIA_TYPE_AUDIO];
 	LOGI(10, "player_write_audio Writing audio frame")
 
 	jbyteArray samples_byte_array = (*env)->NewByteArray(env, data_size);
@@ -289,6 +595,8 @@ static int player_write_audio(DecoderData *decoder_data, JNIEnv *env,
 				"Could not write audio track: reason: %d look in AudioTrack.write()", ret);
 		goto free_local_ref;
 	}
+	if (player->input.input_codec_ctxs[AVMEDIA_TYPE_VIDEO] == NULL)
+		player_first_frame_shown(player);
 
 free_local_ref:
 	LOGI(10, "player_write_audio releasing local ref");
@@ -300,11 +608,25 @@ end:
 static QueueCheckFuncRet player_decode_queue_check(Queue *queue, DecoderData *decoderData, int *ret) {
 	Player *player = decoderData->player;
 
-	if (player->stop_streams[decoderData->media_type]) {
+	if (player->stop) {
+		*ret = DECODE_CHECK_MSG_STOP;
+		return QUEUE_CHECK_FUNC_RET_SKIP;
+	}
+	return QUEUE_CHECK_FUNC_RET_TEST;
+}
+
+/*
+ * Used while pushing decoded frames, frame decoded before seek is not
+ * worth waiting for renderer.
+ */
+static QueueCheckFuncRet player_decode_frame_check(Queue *queue, DecoderData *decoderData, int *ret) {
+	Player *player = decoderData->player;
+
+	if (player->stop) {
 		*ret = DECODE_CHECK_MSG_STOP;
 		return QUEUE_CHECK_FUNC_RET_SKIP;
 	}
-	if (player->flush_streams[decoderData->media_type]) {
+	if (decoderData->serial != player->serial) {
 		*ret = DECODE_CHECK_MSG_FLUSH;
 		return QUEUE_CHECK_FUNC_RET_SKIP;
 	}
@@ -314,14 +636,14 @@ static QueueCheckFuncRet player_decode_queue_check(Queue *queue, DecoderData *de
 static int player_decode_audio(DecoderData *decoder_data, JNIEnv *env, PacketData *packet_data) {
 	int got_frame_ptr = 0;
 	Player *player = decoder_data->player;
-	AVCodecContext *ctx = player->input_codec_ctxs[AVMEDIA_TYPE_AUDIO];
-	AVFrame *frame = player->input_frames[AVMEDIA_TYPE_AUDIO];
+	AVCodecContext *ctx = player->input.input_codec_ctxs[AVMEDIA_TYPE_AUDIO];
+	AVFrame *frame = player->input.input_frames[AVMEDIA_TYPE_AUDIO];
 
-	if (player->video_index < 0) {
+	if (player->input.video_index < 0) {
 		State state = { player, env, player->thiz };
 
 		// notify the outer_app the progress indicator in audio-only mode.
-		if (packet_data->end_of_stream) {
+		if (packet_data->type == QUEUE_ENTRY_EOS) {
 			LOGI(2, "player_decode_audio end of stream");
 			player_update_current_time(&state, TRUE);
 			return 0;
@@ -351,11 +673,11 @@ static int player_decode_audio(DecoderData *decoder_data, JNIEnv *env, PacketDat
 	uint8_t *audio_buf;
 	int data_size;
 
-	if (player->swr_context != NULL) {
+	if (player->input.swr_context != NULL) {
 		uint8_t *out[] = { player->audio_buf2 };
 		int sample_per_buffer_divider = player->audio_track_channel_count
 				* av_get_bytes_per_sample(player->audio_track_format);
-		int len2 = swr_convert(player->swr_context, out,
+		int len2 = swr_convert(player->input.swr_context, out,
 				sizeof(player->audio_buf2) / sample_per_buffer_divider,
 				(uint8_t const **)frame->data, frame->nb_samples);
 		if (len2 < 0) {
@@ -364,7 +686,7 @@ static int player_decode_audio(DecoderData *decoder_data, JNIEnv *env, PacketDat
 		}
 		if (len2 == sizeof(player->audio_buf2) / sample_per_buffer_divider) {
 			LOGI(1, "warning: audio buffer is probably too small\n");
-			swr_init(player->swr_context);
+			swr_init(player->input.swr_context);
 		}
 		audio_buf = player->audio_buf2;
 		data_size = len2 * sample_per_buffer_divider;
@@ -384,21 +706,199 @@ static int player_decode_audio(DecoderData *decoder_data, JNIEnv *env, PacketDat
 	return 0;
 }
 
+static double player_video_frame_time(AVStream *stream, AVFrame *frame) {
+	int64_t pts = av_frame_get_best_effort_timestamp(frame);
+	if (pts == AV_NOPTS_VALUE) {
+		pts = 0;
+	}
+	return (double) pts * av_q2d(stream->time_base);
+}
+
+/*
+ * How late frame with given time is against the clock it is synchronized
+ * to. Returns DECODE_GOVERNOR_NO_LATENESS when the clock is stopped.
+ */
+static int64_t player_video_frame_lateness_us(Player *player, double time) {
+	double clock;
+	if (player->pause || player->buffering)
+		return DECODE_GOVERNOR_NO_LATENESS;
+	if (player->audio_track)
+		clock = player->audio_clock
+				+ (av_gettime() - player->audio_write_time) / 1000000.0;
+	else
+		clock = get_video_clock(player);
+	return (int64_t) ((clock - time) * 1000000.0);
+}
+
+/*
+ * Takes decoded frame over to elem, frame is left empty.
+ */
+static int player_video_frame_set(VideoFrameElem *elem, AVCodecContext *ctx,
+		AVFrame *frame) {
+#if LIBAVCODEC_VERSION_MAJOR >= 55
+	av_frame_unref(elem->frame);
+	av_frame_move_ref(elem->frame, frame);
+#else
+	if (elem->allocated && (elem->width != ctx->width
+			|| elem->height != ctx->height || elem->format != ctx->pix_fmt)) {
+		avpicture_free((AVPicture *) elem->frame);
+		elem->allocated = FALSE;
+	}
+	if (!elem->allocated) {
+		if (avpicture_alloc((AVPicture *) elem->frame, ctx->pix_fmt,
+				ctx->width, ctx->height) < 0)
+			return -ERROR_COULD_NOT_ALLOCATE_MEMORY;
+		elem->allocated = TRUE;
+	}
+	av_picture_copy((AVPicture *) elem->frame, (const AVPicture *) frame,
+			ctx->pix_fmt, ctx->width, ctx->height);
+#endif
+	elem->width = ctx->width;
+	elem->height = ctx->height;
+	elem->format = ctx->pix_fmt;
+	return 0;
+}
+
+/*
+ * Gives decoder buffers held by elem back, used also as flush func of
+ * video_frames_queue.
+ */
+static void player_video_frame_unref(Player *player, VideoFrameElem *elem) {
+#if LIBAVCODEC_VERSION_MAJOR >= 55
+	av_frame_unref(elem->frame);
+#endif
+}
+
+/*
+ * Queue decoded frame for renderer. Conversion to bitmap is left to it so
+ * frames it skips are never converted.
+ */
+static int player_push_video_frame(DecoderData *decoder_data, AVFrame *frame,
+		double time) {
+	Player *player = decoder_data->player;
+	AVCodecContext *ctx = player->input.input_codec_ctxs[AVMEDIA_TYPE_VIDEO];
+	int interrupt_ret;
+	int to_write;
+	int err;
+	VideoFrameElem *elem;
+
+	LOGI(10,
+			"player_decode_video Decoded video frame: %f", time);
+
+	LOGI(7, "player_decode_video push wait");
+
+	pthread_mutex_lock(&player->mutex_queue);
+	elem = queue_push_start_impl(player->video_frames_queue,
+		&player->mutex_queue, &to_write,
+		(QueueCheckFunc) player_decode_frame_check, decoder_data,
+		(void **) &interrupt_ret);
+	if (elem == NULL) {
+		if (interrupt_ret == DECODE_CHECK_MSG_STOP) {
+			LOGI(2, "player_decode_video push stop");
+		} else if (interrupt_ret == DECODE_CHECK_MSG_FLUSH) {
+			LOGI(2, "player_decode_video push flush");
+		} else {
+			assert(FALSE);
+		}
+		pthread_mutex_unlock(&player->mutex_queue);
+#if LIBAVCODEC_VERSION_MAJOR >= 55
+		av_frame_unref(frame);
+#endif
+		return 0;
+	}
+	pthread_mutex_unlock(&player->mutex_queue);
+
+	err = player_video_frame_set(elem, ctx, frame);
+	if (err < 0) {
+		LOGE(1, "player_decode_video could not queue frame");
+		queue_push_finish_many(player->video_frames_queue,
+				&player->mutex_queue, to_write, 1, 0);
+		return err;
+	}
+	elem->time = time;
+	elem->type = QUEUE_ENTRY_DATA;
+	elem->serial = decoder_data->serial;
+	queue_push_finish(player->video_frames_queue, &player->mutex_queue,
+			to_write);
+	return 0;
+}
+
+/*
+ * Frame threads keep up to thread_count - 1 frames inside decoder, they
+ * are taken out by empty packets when nothing more will be sent to it.
+ */
+static void player_decode_video_drain(DecoderData *decoder_data, JNIEnv *env) {
+	Player *player = decoder_data->player;
+	AVCodecContext *ctx = player->input.input_codec_ctxs[AVMEDIA_TYPE_VIDEO];
+	AVFrame *frame = player->input.input_frames[AVMEDIA_TYPE_VIDEO];
+	AVStream *stream = player->input.input_streams[AVMEDIA_TYPE_VIDEO];
+	AVPacket packet;
+	int got_frame;
+
+	if (!(ctx->codec->capabilities & CODEC_CAP_DELAY))
+		return;
+	av_init_packet(&packet);
+	packet.data = NULL;
+	packet.size = 0;
+	while (!player->stop && decoder_data->serial == player->serial) {
+		got_frame = 0;
+		if (avcodec_decode_video2(ctx, frame, &got_frame, &packet) < 0
+				|| !got_frame)
+			break;
+		if (player_push_video_frame(decoder_data, frame,
+				player_video_frame_time(stream, frame)) < 0)
+			break;
+	}
+	LOGI(3, "player_decode_video_drain drained");
+}
+
+static void player_apply_degradation(AVCodecContext *ctx,
+		DecodeGovernorLevel level) {
+	ctx->skip_loop_filter = level >= DECODE_GOVERNOR_LEVEL_SKIP_LOOP_FILTER ?
+			AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+	if (level >= DECODE_GOVERNOR_LEVEL_SKIP_NONKEY)
+		ctx->skip_frame = AVDISCARD_NONKEY;
+	else if (level >= DECODE_GOVERNOR_LEVEL_SKIP_NONREF)
+		ctx->skip_frame = AVDISCARD_NONREF;
+	else
+		ctx->skip_frame = AVDISCARD_DEFAULT;
+}
+
+/*
+ * Feed decode governor with time spent on packet and report level change.
+ */
+static void player_govern_decoding(DecoderData *decoder_data, JNIEnv *env,
+		PacketData *packet_data, int64_t decode_us, int64_t late_us) {
+	Player *player = decoder_data->player;
+	int bytes, duration, level;
+
+	player_measure_packet(player->input.format_ctx, packet_data, &bytes,
+			&duration);
+	level = decode_governor_update(player->decode_governor, av_gettime(),
+			decode_us, duration * 1000LL, late_us);
+	if (level < 0)
+		return;
+	LOGI(2, "player_govern_decoding degradation level: %d, late: %lldus",
+			level, late_us);
+	(*env)->CallVoidMethod(env, player->thiz, player->onDegradation, level);
+}
+
 static int player_decode_video(DecoderData * decoder_data, JNIEnv * env, PacketData *packet_data) {
 	Player *player = decoder_data->player;
-	AVCodecContext *ctx = player->input_codec_ctxs[AVMEDIA_TYPE_VIDEO];
-	AVFrame *frame = player->input_frames[AVMEDIA_TYPE_VIDEO];
-	AVStream *stream = player->input_streams[AVMEDIA_TYPE_VIDEO];
+	AVCodecContext *ctx = player->input.input_codec_ctxs[AVMEDIA_TYPE_VIDEO];
+	AVFrame *frame = player->input.input_frames[AVMEDIA_TYPE_VIDEO];
+	AVStream *stream = player->input.input_streams[AVMEDIA_TYPE_VIDEO];
 	int interrupt_ret;
 	int to_write;
-	VideoRGBFrameElem *elem;
+	VideoFrameElem *elem;
 
-	if (packet_data->end_of_stream) {
+	if (packet_data->type == QUEUE_ENTRY_EOS) {
+		player_decode_video_drain(decoder_data, env);
 		LOGI(2, "player_decode_video waiting for queue to end of stream");
 		pthread_mutex_lock(&player->mutex_queue);
-		elem = queue_push_start_impl(player->rgb_video_queue,
-			&player->mutex_queue, &player->cond_queue, &to_write,
-			(QueueCheckFunc) player_decode_queue_check, decoder_data,
+		elem = queue_push_start_impl(player->video_frames_queue,
+			&player->mutex_queue, &to_write,
+			(QueueCheckFunc) player_decode_frame_check, decoder_data,
 			(void **) &interrupt_ret);
 		if (elem == NULL) {
 			if (interrupt_ret == DECODE_CHECK_MSG_STOP) {
@@ -411,111 +911,113 @@ static int player_decode_video(DecoderData * decoder_data, JNIEnv * env, PacketD
 			pthread_mutex_unlock(&player->mutex_queue);
 			return 0;
 		}
-		elem->end_of_stream = TRUE;
+		elem->type = QUEUE_ENTRY_EOS;
+		elem->serial = decoder_data->serial;
 		LOGI(2, "player_decode_video sending end of stream");
-		queue_push_finish_impl(player->rgb_video_queue,
-			&player->mutex_queue, &player->cond_queue, to_write);
+		queue_push_finish_impl(player->video_frames_queue,
+			&player->mutex_queue, to_write);
 		pthread_mutex_unlock(&player->mutex_queue);
 		return 0;
 	}
 
 	LOGI(10, "player_decode_video decoding");
+	if (player->decoder_degradation)
+		player_apply_degradation(ctx,
+				decode_governor_level(player->decode_governor));
+	int64_t start = av_gettime();
 	int frameFinished = 0;
 	int ret = avcodec_decode_video2(ctx, frame, &frameFinished, packet_data->packet);
+	int64_t decode_us = av_gettime() - start;
 	if (ret < 0) {
 		LOGE(1, "player_decode_video Fail decoding video %d\n", ret);
 		return -ERROR_WHILE_DECODING_VIDEO;
 	}
 	if (!frameFinished) {
 		LOGI(10, "player_decode_video Video frame not finished\n");
+		if (player->decoder_degradation)
+			player_govern_decoding(decoder_data, env, packet_data,
+					decode_us, DECODE_GOVERNOR_NO_LATENESS);
 		return 0;
 	}
+	double time = player_video_frame_time(stream, frame);
+	// measured before waiting for renderer, waiting frame is not late
+	int64_t late_us = player_video_frame_lateness_us(player, time);
+	ret = player_push_video_frame(decoder_data, frame, time);
+	if (player->decoder_degradation)
+		player_govern_decoding(decoder_data, env, packet_data,
+				decode_us, late_us);
+	return ret;
+}
 
-	int64_t pts = av_frame_get_best_effort_timestamp(frame);
-	if (pts == AV_NOPTS_VALUE) {
-		pts = 0;
-	}
-
-	double time = (double) pts * av_q2d(stream->time_base);
-	LOGI(10,
-			"player_decode_video Decoded video frame: %f, time_base: %lld", time, pts);
+/*
+ * Handle FLUSH entry. Packets queued before it were already dropped so
+ * only decoder state and its output have to be cleared.
+ */
+static void player_decode_flush(DecoderData *decoder_data, JNIEnv *env,
+		int serial) {
+	Player *player = decoder_data->player;
+	AVCodecContext *ctx = player->input.input_codec_ctxs[decoder_data->media_type];
 
-	LOGI(7, "player_decode_video copy wait");
+	LOGI(2, "player_decode[%d] flush serial: %d", decoder_data->media_type, serial);
+	avcodec_flush_buffers(ctx);
+	// lateness measured around seek says nothing about load
+	if (decoder_data->media_type == AVMEDIA_TYPE_VIDEO)
+		decode_governor_reset(player->decode_governor, av_gettime(), TRUE);
+	if (decoder_data->media_type == AVMEDIA_TYPE_AUDIO) {
+		(*env)->CallVoidMethod(env, player->audio_track, player->audio_track_flush);
+	}
 
 	pthread_mutex_lock(&player->mutex_queue);
-	elem = queue_push_start_impl(player->rgb_video_queue,
-		&player->mutex_queue, &player->cond_queue, &to_write,
-		(QueueCheckFunc) player_decode_queue_check, decoder_data,
-		(void **) &interrupt_ret);
-	if (elem == NULL) {
-		if (interrupt_ret == DECODE_CHECK_MSG_STOP) {
-			LOGI(2, "player_decode_video push stop");
-		} else if (interrupt_ret == DECODE_CHECK_MSG_FLUSH) {
-			LOGI(2, "player_decode_video push flush");
-		} else {
-			assert(FALSE);
-		}
-		pthread_mutex_unlock(&player->mutex_queue);
-		return 0;
+	decoder_data->serial = serial;
+	if (decoder_data->media_type == AVMEDIA_TYPE_VIDEO && !player->rendering) {
+		// renderer drops stale frames itself but now there is nobody
+		// to do it
+		LOGI(2, "player_decode_video not rendering flushing video_frames_queue");
+		queue_flush_impl(player->video_frames_queue, &player->mutex_queue,
+				(queue_flush_func) player_video_frame_unref, player);
 	}
-
 	pthread_mutex_unlock(&player->mutex_queue);
-	elem->time = time;
-	elem->end_of_stream = FALSE;
-	AVFrame *rgbFrame = elem->frame;
-	void *buffer;
-	int destWidth = ctx->width;
-	int destHeight = ctx->height;
-	int err = 0;
-
-	if ((ret = AndroidBitmap_lockPixels(env, elem->jbitmap, &buffer)) < 0) {
-		LOGE(1, "AndroidBitmap_lockPixels() failed ! error=%d", ret);
-		err = -ERROR_WHILE_LOCING_BITMAP;
-		goto fail_lock_bitmap;
-	}
-
-	avpicture_fill((AVPicture *) elem->frame, buffer, player->out_format,
-			destWidth, destHeight);
-
-	LOGI(7, "player_decode_video copying...");
-#ifdef YUV2RGB
-	if (ctx->pix_fmt == AV_PIX_FMT_YUV420P) {
-		LOGI(9, "Using yuv420_2_rgb565");
-		yuv420_2_rgb565(rgbFrame->data[0], frame->data[0], frame->data[1],
-			frame->data[2], destWidth, destHeight, frame->linesize[0],
-			frame->linesize[1], destWidth << 1, yuv2rgb565_table,
-			player->dither++);
-	} else if (ctx->pix_fmt == AV_PIX_FMT_NV12) {
-		LOGI(9, "Using nv12_2_rgb565");
-		nv12_2_rgb565(rgbFrame->data[0], frame->data[0], frame->data[1],
-			frame->data[1]+1, destWidth, destHeight, frame->linesize[0],
-			frame->linesize[1], destWidth << 1, yuv2rgb565_table,
-			player->dither++);
-	} else
-#endif
-	{
-		LOGI(9, "Using sws_scale");
-		sws_scale(player->sws_context,
-				(const uint8_t * const *) frame->data,
-				frame->linesize, 0, ctx->height,
-				rgbFrame->data, rgbFrame->linesize);
-	}
+}
 
-	AndroidBitmap_unlockPixels(env, elem->jbitmap);
+/*
+ * Handle NEXT entry, has to be called with mutex_queue held. Read thread
+ * swaps inputs when every decoder got here, decoder continues with packets
+ * queue of the new input. Seek cancels the switch, decoder then continues
+ * with its queue where FLUSH of the seek follows. Returns FALSE when
+ * player was stopped instead.
+ */
+static int player_decode_next_impl(DecoderData *decoder_data, Queue **queue) {
+	Player *player = decoder_data->player;
+	int generation = player->input_generation;
 
-fail_lock_bitmap:
-	queue_push_finish(player->rgb_video_queue, &player->mutex_queue,
-		&player->cond_queue, to_write);
-	return err;
+	LOGI(2, "player_decode[%d] waiting for next input", decoder_data->media_type);
+	player->next_waiting += 1;
+	pthread_cond_broadcast(&player->cond_queue);
+	while (!player->stop && generation == player->input_generation
+			&& decoder_data->serial == player->serial)
+		pthread_cond_wait(&player->cond_queue, &player->mutex_queue);
+	if (player->stop)
+		return FALSE;
+	if (generation == player->input_generation) {
+		LOGI(2, "player_decode[%d] switch to next input cancelled by seek",
+				decoder_data->media_type);
+		player->next_waiting -= 1;
+		return TRUE;
+	}
+	*queue = player->input.packets_queue[decoder_data->media_type];
+	decoder_data->serial = player->serial;
+	LOGI(2, "player_decode[%d] switched to next input", decoder_data->media_type);
+	return TRUE;
 }
 
 static void *player_decode(void *data) {
 	int err = ERROR_NO_ERROR;
 	DecoderData *decoder_data = data;
 	Player *player = decoder_data->player;
-	Queue *queue = player->packets_queue[decoder_data->media_type];
-	AVCodecContext *ctx = player->input_codec_ctxs[decoder_data->media_type];
+	Queue *queue = player->input.packets_queue[decoder_data->media_type];
+	AVCodecContext *ctx = player->input.input_codec_ctxs[decoder_data->media_type];
 	enum AVMediaType codec_type = ctx->codec_type;
+	int batch_size = codec_type == AVMEDIA_TYPE_AUDIO ? PACKETS_BATCH_SIZE : 1;
 
 	int stop = FALSE;
 	JNIEnv *env;
@@ -533,65 +1035,96 @@ static void *player_decode(void *data) {
 
 	for (;;) {
 		int interrupt_ret;
-		PacketData *packet_data;
-		int has_sleep;
+		PacketData *packets[PACKETS_BATCH_SIZE];
+		int count, decoded, next = FALSE;
 
 		LOGI(10, "player_decode[%d] waiting for frame", decoder_data->media_type);
-		pthread_mutex_lock(&player->mutex_queue);
-pop:
-		has_sleep = 0;
 		interrupt_ret = -1;
-		while (player->pause && !player->stop) {
-			// we try to sleep 10ms
-			if (!has_sleep) {
-				LOGI(3, "player_decode[%d] enter sleep...", decoder_data->media_type);
-				has_sleep = 1;
+		if (player->pause || player->buffering) {
+			int has_sleep = 0;
+			pthread_mutex_lock(&player->mutex_queue);
+			// MUST wake up from PAUSE --> SEEK/STOP, packets read before seek
+			// are dropped even when paused
+			// every change of these flags is followed by
+			// player_signal_control
+			while ((player->pause || player->buffering) && !player->stop
+					&& decoder_data->serial == player->serial) {
+				if (!has_sleep) {
+					LOGI(3, "player_decode[%d] enter sleep...", decoder_data->media_type);
+					has_sleep = 1;
+				}
+				pthread_cond_wait(&player->cond_queue, &player->mutex_queue);
 			}
-			player_decode_queue_check(queue, decoder_data, &interrupt_ret);
-			// MUST wake up from PAUSE --> SEEK/STOP
-			if (interrupt_ret == DECODE_CHECK_MSG_FLUSH) {
-				LOGI(2, "player_decode[%d] interrupted by FLUSH from PAUSE", decoder_data->media_type);
-				goto flush;
-			} else if (interrupt_ret == DECODE_CHECK_MSG_STOP) {
+			if (player->stop) {
 				LOGI(2, "player_decode[%d] interrupted by STOP from PAUSE", decoder_data->media_type);
 				goto stop;
 			}
-			pthread_cond_timeout_np(&player->cond_queue, &player->mutex_queue, 10);
+			pthread_mutex_unlock(&player->mutex_queue);
+			if (has_sleep)
+				LOGI(3, "player_decode[%d] wake up...", decoder_data->media_type);
 		}
-		if (has_sleep)
-			LOGI(3, "player_decode[%d] wake up...", decoder_data->media_type);
 
-		packet_data = queue_pop_start_impl(&queue,
-			&player->mutex_queue, &player->cond_queue,
+		// packets queue is single producer/single consumer so we do not
+		// take mutex_queue here unless we have to wait for a packet.
+		// Audio packets are small so we drain several of them at once.
+		count = queue_pop_start_many(&queue,
+			&player->mutex_queue, (void **) packets, batch_size,
 			(QueueCheckFunc) player_decode_queue_check, decoder_data,
 			(void **) &interrupt_ret);
-		if (packet_data == NULL) {
-			if (interrupt_ret == DECODE_CHECK_MSG_FLUSH) {
-				LOGI(3, "player_decode[%d] interrupted by FLUSH", decoder_data->media_type);
-				goto flush;
-			} else if (interrupt_ret == DECODE_CHECK_MSG_STOP) {
-				LOGI(3, "player_decode[%d] interrupted by STOP", decoder_data->media_type);
-				goto stop;
-			} else {
-				assert(FALSE);
-			}
-		}
-		pthread_mutex_unlock(&player->mutex_queue);
-		LOGI(10, "player_decode[%d] decoding frame", decoder_data->media_type);
-		if (packet_data->end_of_stream) {
-			LOGI(10, "player_decode[%d] read end of stream", decoder_data->media_type);
+		if (count == 0) {
+			pthread_mutex_lock(&player->mutex_queue);
+			assert(interrupt_ret == DECODE_CHECK_MSG_STOP);
+			LOGI(3, "player_decode[%d] interrupted by STOP", decoder_data->media_type);
+			goto stop;
 		}
+		for (decoded = 0; decoded < count;) {
+			PacketData *packet_data = packets[decoded];
+			// entries queued before last seek are dropped without decoding
+			int stale = packet_data->serial != player->serial;
+			LOGI(10, "player_decode[%d] decoding frame", decoder_data->media_type);
+			decoded += 1;
+
+			if (packet_data->type == QUEUE_ENTRY_STOP) {
+				LOGI(2, "player_decode[%d] read stop", decoder_data->media_type);
+				stop = TRUE;
+				break;
+			} else if (stale) {
+				// NEXT queued before seek too, seek cancelled that switch
+				LOGI(10, "player_decode[%d] dropping stale packet", decoder_data->media_type);
+			} else if (packet_data->type == QUEUE_ENTRY_NEXT) {
+				// nothing follows it in this queue
+				if (codec_type == AVMEDIA_TYPE_VIDEO)
+					player_decode_video_drain(decoder_data, env);
+				next = TRUE;
+				break;
+			} else if (packet_data->type == QUEUE_ENTRY_FLUSH) {
+				player_decode_flush(decoder_data, env, packet_data->serial);
+			} else if (codec_type == AVMEDIA_TYPE_AUDIO) {
+				err = player_decode_audio(decoder_data, env, packet_data);
+			} else if (codec_type == AVMEDIA_TYPE_VIDEO) {
+				err = player_decode_video(decoder_data, env, packet_data);
+			}
 
-		if (codec_type == AVMEDIA_TYPE_AUDIO) {
-			err = player_decode_audio(decoder_data, env, packet_data);
-		} else if (codec_type == AVMEDIA_TYPE_VIDEO) {
-			err = player_decode_video(decoder_data, env, packet_data);
+			player_flush_packet(player, packet_data);
+			if (err < 0 && err != (-ERROR_WHILE_DECODING_VIDEO)
+					&& err != (-ERROR_WHILE_DECODING_AUDIO_FRAME))
+				break;
+			// rest of the batch is rolled back
+			if (!stale && (player->pause || player->buffering))
+				break;
 		}
-
-		if (!packet_data->end_of_stream) {
-			av_free_packet(packet_data->packet);
+		queue_pop_finish_many(queue, &player->mutex_queue, decoded);
+		if (stop) {
+			pthread_mutex_lock(&player->mutex_queue);
+			goto stop;
+		}
+		if (next) {
+			pthread_mutex_lock(&player->mutex_queue);
+			if (!player_decode_next_impl(decoder_data, &queue))
+				goto stop;
+			pthread_mutex_unlock(&player->mutex_queue);
+			continue;
 		}
-		queue_pop_finish(queue, &player->mutex_queue, &player->cond_queue);
 		if (err < 0) {
 			if (err == (-ERROR_WHILE_DECODING_VIDEO      ) ||
 			    err == (-ERROR_WHILE_DECODING_AUDIO_FRAME) ) {
@@ -605,58 +1138,22 @@ pop:
 		continue;
 stop:
 		LOGI(2, "player_decode[%d] stop", decoder_data->media_type);
-		stop = TRUE;
-flush:
-		LOGI(2, "player_decode[%d] flush", decoder_data->media_type);
-		PacketData *to_free; // FIXME move to PacketData
-		while ((to_free = queue_pop_start_impl_non_block(queue))
-				!= NULL) {
-			if (!to_free->end_of_stream) {
-				av_free_packet(to_free->packet);
-			}
-			queue_pop_finish_impl(queue, &player->mutex_queue, &player->cond_queue);
-		}
-		LOGI(2, "player_decode[%d] flushing", decoder_data->media_type);
+		queue_flush_impl(queue, &player->mutex_queue,
+				(queue_flush_func) player_flush_packet, player);
 
 		if (codec_type == AVMEDIA_TYPE_AUDIO) {
+			LOGI(1,"player_decoder[%d], try to stop and release audio_track", decoder_data->media_type);
 			(*env)->CallVoidMethod(env, player->audio_track, player->audio_track_flush);
-			if (stop) {
-				LOGI(1,"player_decoder[%d], try to stop and release audio_track", decoder_data->media_type);
-				(*env)->CallVoidMethod(env, player->audio_track, player->audio_track_stop);
-				(*env)->CallVoidMethod(env, player->audio_track, player->audio_track_release);
-			}
-		} else if (codec_type == AVMEDIA_TYPE_VIDEO) {
-			if (!player->rendering) {
-				LOGI(2, "player_decode_video not rendering flushing rgb_video_queue");
-				VideoRGBFrameElem *elem;
-				while ((elem = queue_pop_start_impl_non_block(
-						player->rgb_video_queue)) != NULL) {
-					queue_pop_finish_impl(player->rgb_video_queue, &player->mutex_queue, &player->cond_queue);
-				}
-			} else {
-				LOGI(2,
-						"player_decode_video rendering sending rgb_video_queue flush request");
-				player->flush_video_play = TRUE;
-				pthread_cond_broadcast(&player->cond_queue);
-				LOGI(2, "player_decode_video waiting for rgb_video_queue flush");
-				while (player->flush_video_play)
-					pthread_cond_wait(&player->cond_queue, &player->mutex_queue);
-			}
-		}
-		LOGI(2, "player_decode[%d] flushed", decoder_data->media_type);
-
-		if (stop) {
-			LOGI(2, "player_decode[%d] signal stop", decoder_data->media_type);
-			player->stop_streams[decoder_data->media_type] = FALSE;
-			pthread_cond_broadcast(&player->cond_queue);
-			pthread_mutex_unlock(&player->mutex_queue);
-			goto detach_current_thread;
-		} else {
-			LOGI(2, "player_decode[%d] signal flush", decoder_data->media_type);
-			player->flush_streams[decoder_data->media_type] = FALSE;
-			pthread_cond_broadcast(&player->cond_queue);
-			goto pop;
+			(*env)->CallVoidMethod(env, player->audio_track, player->audio_track_stop);
+			(*env)->CallVoidMethod(env, player->audio_track, player->audio_track_release);
+		} else if (codec_type == AVMEDIA_TYPE_VIDEO && !player->rendering) {
+			LOGI(2, "player_decode_video not rendering flushing video_frames_queue");
+			queue_flush_impl(player->video_frames_queue, &player->mutex_queue,
+					(queue_flush_func) player_video_frame_unref, player);
 		}
+		LOGI(2, "player_decode[%d] stopped", decoder_data->media_type);
+		pthread_mutex_unlock(&player->mutex_queue);
+		goto detach_current_thread;
 	}
 
 detach_current_thread:
@@ -683,20 +1180,215 @@ static QueueCheckFuncRet player_read_stream_check(Queue *queue, Player *player,
 	return QUEUE_CHECK_FUNC_RET_TEST;
 }
 
-static void player_assign_to_no_boolean_array(Player *player, int* array, int value) {
+static QueueCheckFuncRet player_read_stream_stop_check(Queue *queue, Player *player, int *ret) {
+	if (player->stop) {
+		*ret = READ_FROM_STREAM_CHECK_MSG_STOP;
+		return QUEUE_CHECK_FUNC_RET_SKIP;
+	}
+	return QUEUE_CHECK_FUNC_RET_TEST;
+}
+
+/*
+ * Seek (but not skip to next input) cancels switch to next input.
+ */
+static int player_read_stream_next_cancelled(Player *player) {
+	return player->seek_position != DO_NOT_SEEK
+			&& player->seek_position != SEEK_TO_NEXT_INPUT;
+}
+
+static QueueCheckFuncRet player_read_stream_next_check(Queue *queue, Player *player, int *ret) {
+	if (player->stop) {
+		*ret = READ_FROM_STREAM_CHECK_MSG_STOP;
+		return QUEUE_CHECK_FUNC_RET_SKIP;
+	}
+	if (player_read_stream_next_cancelled(player)) {
+		*ret = READ_FROM_STREAM_CHECK_MSG_SEEK;
+		return QUEUE_CHECK_FUNC_RET_SKIP;
+	}
+	return QUEUE_CHECK_FUNC_RET_TEST;
+}
+
+/*
+ * Queue control entry with current serial to every packets queue. Has to
+ * be called with mutex_queue held and without reserved batches. Returns
+ * FALSE when interrupted by check func.
+ */
+static int player_read_stream_push_control(Player *player,
+		QueueEntryType type, QueueCheckFunc func, int *interrupt_ret) {
+	int i, to_write;
+	for (i = 0; i < AVMEDIA_TYPE_NB; ++i) {
+		Queue *queue = player->input.packets_queue[i];
+		PacketData *packet_data;
+		if (queue == NULL)
+			continue;
+		packet_data = queue_push_start_impl(queue, &player->mutex_queue,
+				&to_write, func, player, interrupt_ret);
+		if (packet_data == NULL)
+			return FALSE;
+		packet_data->type = type;
+		packet_data->serial = player->serial;
+		queue_push_finish_impl(queue, &player->mutex_queue, to_write);
+	}
+	return TRUE;
+}
+
+/*
+ * Has to be called with mutex_queue held.
+ */
+static void player_set_buffering_impl(Player *player, JNIEnv *env,
+		int buffering) {
+	if (player->buffering == buffering)
+		return;
+	LOGI(3, "player_set_buffering %s", buffering ? "start" : "end");
+	if (buffering && !player->pause)
+		player_clocks_stop(player, env);
+	player->buffering = buffering;
+	if (!buffering && !player->pause)
+		player_clocks_start(player, env);
+	player_signal_control(player);
+
+	(*env)->CallVoidMethod(env, player->thiz, player->onBuffering,
+			(jboolean) buffering);
+}
+
+/*
+ * Enter buffering when every packets queue fell below low watermark and
+ * leave it when any of them reached high watermark (or could not grow any
+ * more). Requiring all queues to be low avoids buffering when one stream
+ * simply ended earlier than the other.
+ */
+static void player_update_buffering(Player *player, JNIEnv *env) {
+	int i, queues = 0, below_low = 0, above_high = 0;
+	if (player->buffering_high_ms <= 0)
+		return;
+	for (i = 0; i < AVMEDIA_TYPE_NB; ++i) {
+		Queue *queue = player->input.packets_queue[i];
+		if (queue == NULL)
+			continue;
+		queues += 1;
+		switch (queue_get_watermark(queue)) {
+		case QUEUE_WATERMARK_BELOW_LOW:
+			below_low += 1;
+			break;
+		case QUEUE_WATERMARK_ABOVE_HIGH:
+			above_high += 1;
+			break;
+		default:
+			break;
+		}
+	}
+	if (player->buffering) {
+		if (above_high == 0)
+			return;
+	} else {
+		if (queues == 0 || below_low < queues)
+			return;
+	}
+
+	pthread_mutex_lock(&player->mutex_queue);
+	player_set_buffering_impl(player, env, !player->buffering);
+	pthread_mutex_unlock(&player->mutex_queue);
+}
+
+/*
+ * Publish packets reserved by player_read_stream. With starving TRUE only
+ * batches of queues that have less than PACKETS_BATCH_SIZE packets ready
+ * are published so decoder does not wait for demuxer to fill the batch.
+ * Has to be called without mutex_queue.
+ */
+static void player_read_stream_publish(Player *player, PacketsBatch *batches,
+		int starving) {
 	int i;
 	for (i = 0; i < AVMEDIA_TYPE_NB; ++i) {
-		if (player->input_codec_ctxs[i])
-			array[i] = value;
+		PacketsBatch *batch = &batches[i];
+		Queue *queue = player->input.packets_queue[i];
+		int count, bytes, duration;
+		if (batch->reserved == 0)
+			continue;
+		if (starving) {
+			queue_get_usage(queue, &count, &bytes, &duration);
+			if (count >= PACKETS_BATCH_SIZE)
+				continue;
+		}
+		queue_push_finish_many(queue, &player->mutex_queue, batch->to_write,
+				batch->reserved, batch->written);
+		batch->reserved = batch->written = 0;
 	}
 }
-static int player_if_all_no_array_elements_has_value(Player *player, int *array, int value) {
+
+/*
+ * Same as player_read_stream_publish(player, batches, FALSE) but with
+ * mutex_queue held.
+ */
+static void player_read_stream_publish_impl(Player *player,
+		PacketsBatch *batches) {
 	int i;
 	for (i = 0; i < AVMEDIA_TYPE_NB; ++i) {
-		if (player->input_codec_ctxs[i] && array[i] != value)
-			return FALSE;
+		PacketsBatch *batch = &batches[i];
+		if (batch->reserved == 0)
+			continue;
+		queue_push_finish_many_impl(player->input.packets_queue[i],
+				&player->mutex_queue, batch->to_write, batch->reserved,
+				batch->written);
+		batch->reserved = batch->written = 0;
 	}
-	return TRUE;
+}
+
+static void player_index_keyframe(PlayerInput *input, AVPacket *pkt) {
+	int64_t pts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+	if (!(pkt->flags & AV_PKT_FLAG_KEY) || pkt->pos < 0
+			|| pts == AV_NOPTS_VALUE)
+		return;
+	keyframe_index_add(input->keyframe_index, pts, pkt->pos, pkt->size);
+	input->keyframe_index_entries = keyframe_index_size(input->keyframe_index);
+}
+
+/*
+ * Seeks by bytes to last indexed keyframe before seek_target (in time base
+ * of keyframe_index_stream) so demuxer does not have to look for it.
+ * Returns negative value when target is outside of indexed ranges.
+ */
+static int player_seek_keyframe_index(Player *player, int64_t seek_target) {
+	int64_t pts, pos;
+	int ret;
+	if (player->input.keyframe_index == NULL)
+		return -1;
+	if (keyframe_index_lookup(player->input.keyframe_index, seek_target, &pts,
+			&pos, NULL) < 0)
+		return -1;
+	ret = av_seek_frame(player->input.format_ctx, -1, pos, AVSEEK_FLAG_BYTE);
+	if (ret < 0) {
+		LOGE(2, "player_seek_keyframe_index could not seek to: %"PRId64, pos);
+		return ret;
+	}
+	LOGI(3, "player_seek_keyframe_index seeked to keyframe: %"PRId64" at: %"PRId64,
+			pts, pos);
+	player->input.keyframe_index_seeks += 1;
+	return 0;
+}
+
+/*
+ * While paused reading goes on until packets queues hold pause_buffer_bytes
+ * together, so resume does not wait for network. Has to be called with
+ * mutex_queue held.
+ */
+static int player_read_stream_pause_buffer_full_impl(Player *player) {
+	int i, count, bytes, duration, total = 0;
+	for (i = 0; i < AVMEDIA_TYPE_NB; ++i) {
+		if (player->input.packets_queue[i] == NULL)
+			continue;
+		queue_get_usage(player->input.packets_queue[i], &count, &bytes, &duration);
+		total += bytes;
+	}
+	return total >= player->pause_buffer_bytes;
+}
+
+/*
+ * Next input is taken when it is prepared and can be played by running
+ * threads. Has to be called with mutex_queue held.
+ */
+static int player_read_stream_next_ready_impl(Player *player) {
+	return player->next_input != NULL && player->next_input->gapless;
 }
 
 static void * player_read_stream(void *data) {
@@ -709,10 +1401,19 @@ static void * player_read_stream(void *data) {
 	int seek_stream_index;
 	AVStream *seek_stream;
 	PacketData *packet_data;
+	PacketsBatch batches[AVMEDIA_TYPE_NB], *batch;
 	int to_write;
 	int interrupt_ret;
+	int eagain_backoff_ms = READ_EAGAIN_MIN_BACKOFF_MS;
+	// pkt holds packet read in this iteration that was not queued yet
+	int packet_pending;
+	// taken from player when swapping inputs, freed by this thread
+	PlayerInput *next_input = NULL;
+	int decoders;
 	JavaVMAttachArgs thread_spec = { JNI_VERSION_1_4, "FFmpegReadStream", NULL };
 
+	memset(batches, 0, sizeof(batches));
+
 	jint ret = (*player->get_javavm)->AttachCurrentThread(player->get_javavm, &env, &thread_spec);
 	if (ret) {
 		err = ERROR_COULD_NOT_ATTACH_THREAD;
@@ -722,27 +1423,63 @@ static void * player_read_stream(void *data) {
 	// MUST initialize it
 	av_init_packet(pkt);
 	for (;;) {
-		while (player->pause && !player->stop) {
-			usleep(MIN_SLEEP_TIME_US);
+		packet_pending = FALSE;
+		if (player->pause) {
+			pthread_mutex_lock(&player->mutex_queue);
 			// MUST wake up from PAUSE --> SEEK/STOP
+			while (player->pause && !player->stop
+					&& player->seek_position == DO_NOT_SEEK
+					&& player_read_stream_pause_buffer_full_impl(player))
+				pthread_cond_wait(&player->cond_queue, &player->mutex_queue);
+			if (player->stop) {
+				av_init_packet(pkt);
+				goto exit_loop;
+			}
 			if (player->seek_position != DO_NOT_SEEK) {
 				av_init_packet(pkt);
 				goto seek_loop;
 			}
+			pthread_mutex_unlock(&player->mutex_queue);
 		}
-		int ret = av_read_frame(player->format_ctx, pkt);
+		// do not keep packets from decoders that are running out of them
+		// while av_read_frame could block
+		player_read_stream_publish(player, batches, TRUE);
+		player_update_buffering(player, env);
+		int ret = av_read_frame(player->input.format_ctx, pkt);
 		if (ret < 0) {
-			// Seek to the first FLV packet could cause EAGAIN
+			// Seek to the first FLV packet could cause EAGAIN, so does live
+			// stream waiting for next chunk
 			if (ret == AVERROR(EAGAIN)) {
-				LOGI(2, "player_read_stream stream av_read_frame() returns EGAIN");
+				LOGI(5, "player_read_stream stream av_read_frame() returns EGAIN, backoff: %dms",
+						eagain_backoff_ms);
+				av_init_packet(pkt);
+				pthread_mutex_lock(&player->mutex_queue);
+				player->read_eagains += 1;
+				// seek and stop do not wait for backoff
+				if (!player->stop && player->seek_position == DO_NOT_SEEK)
+					pthread_cond_timeout_np(&player->cond_queue,
+							&player->mutex_queue, eagain_backoff_ms);
+				if (player->stop)
+					goto exit_loop;
+				if (player->seek_position != DO_NOT_SEEK)
+					goto seek_loop;
+				pthread_mutex_unlock(&player->mutex_queue);
+				eagain_backoff_ms = FFMIN(eagain_backoff_ms * 2,
+						READ_EAGAIN_MAX_BACKOFF_MS);
 				continue;
 			}
 			pthread_mutex_lock(&player->mutex_queue);
 			LOGI(3, "player_read_stream stream end");
-			queue = player->packets_queue[AVMEDIA_TYPE_VIDEO];
+			// end_of_stream has to be queued after all packets
+			player_read_stream_publish_impl(player, batches);
+			// nothing more will come so play what we have
+			player_set_buffering_impl(player, env, FALSE);
+			if (player_read_stream_next_ready_impl(player))
+				goto next_input;
+			queue = player->input.packets_queue[AVMEDIA_TYPE_VIDEO];
 			LOGI(3, "player_read_stream use video queue");
 			if (!queue) {
-				queue = player->packets_queue[AVMEDIA_TYPE_AUDIO];
+				queue = player->input.packets_queue[AVMEDIA_TYPE_AUDIO];
 				LOGI(3, "player_read_stream use audio queue");
 			}
 			if (!queue) {
@@ -750,7 +1487,7 @@ static void * player_read_stream(void *data) {
 				goto exit_loop;
 			}
 			packet_data = queue_push_start_impl(queue,
-				&player->mutex_queue, &player->cond_queue, &to_write,
+				&player->mutex_queue, &to_write,
 				(QueueCheckFunc) player_read_stream_check, player,
 				(void **)&interrupt_ret);
 			if (packet_data == NULL) {
@@ -767,9 +1504,10 @@ static void * player_read_stream(void *data) {
 				}
 			}
 			//TODO: fix EOF and CODEC_CAP_DELAY, ouput the cached decoder's data?
-			packet_data->end_of_stream = TRUE;
+			packet_data->type = QUEUE_ENTRY_EOS;
+			packet_data->serial = player->serial;
 			LOGI(3, "player_read_stream sending end_of_stream packet");
-			queue_push_finish_impl(queue, &player->mutex_queue, &player->cond_queue, to_write);
+			queue_push_finish_impl(queue, &player->mutex_queue, to_write);
 			for (;;) {
 				if (player->stop) {
 					av_init_packet(pkt);
@@ -779,17 +1517,28 @@ static void * player_read_stream(void *data) {
 					av_init_packet(pkt);
 					goto seek_loop;
 				}
+				// next input prepared too late is played after this one
+				// ended
+				if (player_read_stream_next_ready_impl(player)) {
+					av_init_packet(pkt);
+					goto next_input;
+				}
 				pthread_cond_wait(&player->cond_queue, &player->mutex_queue);
 			}
 			pthread_mutex_unlock(&player->mutex_queue);
 		}
+		eagain_backoff_ms = READ_EAGAIN_MIN_BACKOFF_MS;
+		packet_pending = TRUE;
 
-		pthread_mutex_lock(&player->mutex_queue);
+		// packets queues are single producer/single consumer so we do not
+		// take mutex_queue for every packet
 		if (player->stop) {
 			LOGI(4, "player_read_stream stopping");
+			pthread_mutex_lock(&player->mutex_queue);
 			goto exit_loop;
 		}
 		if (player->seek_position != DO_NOT_SEEK) {
+			pthread_mutex_lock(&player->mutex_queue);
 			goto seek_loop;
 		}
 
@@ -797,8 +1546,8 @@ parse_frame:
 		queue = NULL;
 		LOGI(10, "player_read_stream looking for stream")
 		for (i = 0; i < AVMEDIA_TYPE_NB; ++i) {
-			if (packet.stream_index == player->stream_indexs[i]) {
-				queue = player->packets_queue[i];
+			if (packet.stream_index == player->input.stream_indexs[i]) {
+				queue = player->input.packets_queue[i];
 				LOGI(10, "player_read_stream stream found [%d]", i);
 				break;
 			}
@@ -806,121 +1555,226 @@ parse_frame:
 
 		if (queue == NULL) {
 			LOGI(2, "player_read_stream stream not found");
-			goto skip_loop;
+			av_free_packet(pkt);
+			continue;
 		}
 
-		LOGI(10, "player_read_stream waiting for queue");
-		packet_data = queue_push_start_impl(queue,
-			&player->mutex_queue, &player->cond_queue, &to_write,
-			(QueueCheckFunc) player_read_stream_check, player,
-			(void **)&interrupt_ret);
-		if (packet_data == NULL) {
-			if (interrupt_ret == READ_FROM_STREAM_CHECK_MSG_STOP) {
-				LOGI(2, "player_read_stream queue interrupt stop");
-				goto exit_loop;
-			} else if (interrupt_ret == READ_FROM_STREAM_CHECK_MSG_SEEK) {
-				LOGI(2, "player_read_stream queue interrupt seek");
-				goto seek_loop;
-			} else {
-				assert(FALSE);
+		if (player->input.keyframe_index != NULL
+				&& packet.stream_index == player->input.keyframe_index_stream)
+			player_index_keyframe(&player->input, pkt);
+
+		batch = &batches[i];
+		if (batch->reserved == 0) {
+			int count, bytes, duration, max = 1;
+			// reserve whole batch only when decoder has enough packets
+			// to work on until the batch is filled
+			queue_get_usage(queue, &count, &bytes, &duration);
+			if (count >= PACKETS_BATCH_SIZE)
+				max = PACKETS_BATCH_SIZE;
+			LOGI(10, "player_read_stream waiting for queue");
+			batch->reserved = queue_push_start_many(queue,
+				&player->mutex_queue, (void **) batch->packets, max,
+				&batch->to_write,
+				(QueueCheckFunc) player_read_stream_check, player,
+				(void **)&interrupt_ret);
+			if (batch->reserved == 0) {
+				pthread_mutex_lock(&player->mutex_queue);
+				if (interrupt_ret == READ_FROM_STREAM_CHECK_MSG_STOP) {
+					LOGI(2, "player_read_stream queue interrupt stop");
+					goto exit_loop;
+				} else if (interrupt_ret == READ_FROM_STREAM_CHECK_MSG_SEEK) {
+					LOGI(2, "player_read_stream queue interrupt seek");
+					goto seek_loop;
+				} else {
+					assert(FALSE);
+				}
 			}
 		}
 
-		pthread_mutex_unlock(&player->mutex_queue);
-		packet_data->end_of_stream = FALSE;
-		*packet_data->packet = packet;
+		packet_data = batch->packets[batch->written];
+		packet_data->type = QUEUE_ENTRY_DATA;
+		packet_data->serial = player->serial;
 
-		if (av_dup_packet(packet_data->packet) < 0) {
+		if (player_take_packet(player, packet_data, pkt) < 0) {
 			err = ERROR_WHILE_DUPLICATING_FRAME;
 			pthread_mutex_lock(&player->mutex_queue);
 			goto exit_loop;
 		}
+		batch->written += 1;
 
-		queue_push_finish(queue, &player->mutex_queue, &player->cond_queue, to_write);
+		if (batch->written == batch->reserved) {
+			queue_push_finish_many(queue, &player->mutex_queue,
+					batch->to_write, batch->reserved, batch->written);
+			batch->reserved = batch->written = 0;
+		}
 		continue;
 
 exit_loop:
 		LOGI(3, "player_read_stream stop");
 		av_free_packet(pkt);
+		player_read_stream_publish_impl(player, batches);
 
 		// flush audio buffer
 		if (player->audio_track) {
 			(*env)->CallVoidMethod(env, player->audio_track, player->audio_track_flush);
 		}
 
-		//request stream to stop
-		player_assign_to_no_boolean_array(player, player->stop_streams, TRUE);
-		pthread_cond_broadcast(&player->cond_queue);
-
-		// wait for all stream stop
-		while (!player_if_all_no_array_elements_has_value(player,
-				player->stop_streams, FALSE))
-			pthread_cond_wait(&player->cond_queue, &player->mutex_queue);
+		// decoders notice player->stop by themselves, otherwise (error)
+		// they have to be told that nothing more will come
+		player_read_stream_push_control(player, QUEUE_ENTRY_STOP,
+				(QueueCheckFunc) player_read_stream_stop_check, &interrupt_ret);
 		LOGI(3, "player_read_stream stopped");
 
-		for (i = 0; i < AVMEDIA_TYPE_NB; ++i) {
-			if (player->input_codec_ctxs[i])
-				avcodec_flush_buffers(player->input_codec_ctxs[i]);
-		}
-
 		pthread_mutex_unlock(&player->mutex_queue);
+		if (next_input != NULL)
+			player_free_prepared_input(player, next_input);
 		goto detach_current_thread;
 
 seek_loop:
-		if (player->input_codec_ctxs[AVMEDIA_TYPE_VIDEO]) {
-			seek_stream_index = player->stream_indexs[AVMEDIA_TYPE_VIDEO];
-			seek_stream = player->input_streams[AVMEDIA_TYPE_VIDEO];
+		// decoders will drop queued packets while flushing
+		player_read_stream_publish_impl(player, batches);
+		if (player->seek_position == SEEK_TO_NEXT_INPUT)
+			goto next_input;
+		if (player->input.input_codec_ctxs[AVMEDIA_TYPE_VIDEO]) {
+			seek_stream_index = player->input.stream_indexs[AVMEDIA_TYPE_VIDEO];
+			seek_stream = player->input.input_streams[AVMEDIA_TYPE_VIDEO];
 		} else {
-			seek_stream_index = player->stream_indexs[AVMEDIA_TYPE_AUDIO];
-			seek_stream = player->input_streams[AVMEDIA_TYPE_AUDIO];
+			seek_stream_index = player->input.stream_indexs[AVMEDIA_TYPE_AUDIO];
+			seek_stream = player->input.input_streams[AVMEDIA_TYPE_AUDIO];
 		}
 		// getting seek target time in time_base value
 		seek_target = av_rescale_q(AV_TIME_BASE * (int64_t) player->seek_position, AV_TIME_BASE_Q,
 			seek_stream->time_base);
 		LOGI(3, "player_read_stream seeking to: %ds, time_base: %lld", player->seek_position, seek_target);
 
-		if (av_seek_frame(player->format_ctx, seek_stream_index, seek_target, 0) < 0) {
+		ret = player_seek_keyframe_index(player, seek_target);
+		if (ret < 0)
+			ret = av_seek_frame(player->input.format_ctx, seek_stream_index, seek_target, 0);
+		if (player->input.keyframe_index != NULL)
+			keyframe_index_break(player->input.keyframe_index);
+		if (ret < 0) {
 			// seeking error - trying to play movie without it
 			LOGE(1, "Error while seeking");
 			player->seek_position = DO_NOT_SEEK;
 			pthread_cond_broadcast(&player->cond_queue);
-			goto parse_frame;
+			pthread_mutex_unlock(&player->mutex_queue);
+			// pkt is empty when seek interrupted pause, backoff or end
+			// of stream
+			if (packet_pending)
+				goto parse_frame;
+			continue;
 		}
 
 		LOGI(3, "player_read_stream seeking success");
 
-		// request stream to flush
-		player_assign_to_no_boolean_array(player, player->flush_streams, TRUE);
+		// from now on every queued packet is stale, decoders drop them
+		// without decoding until they reach FLUSH with new serial so we do
+		// not wait for them here
+		player->serial = ++player->last_serial;
+		player->seek_position = DO_NOT_SEEK;
+		player->last_audio_clock = 0;
+		update_external_clock_pts(player, seek_target / (double)AV_TIME_BASE);
 		LOGI(3, "player_read_stream flushing audio")
 		// flush audio buffer
 		if (player->audio_track) {
 			(*env)->CallVoidMethod(env, player->audio_track, player->audio_track_flush);
 		}
 		LOGI(3, "player_read_stream flushed audio");
-		pthread_cond_broadcast(&player->cond_queue);
+		player_signal_control(player);
 
-		LOGI(3, "player_read_stream waiting for flush");
+		av_free_packet(pkt);
+		packet_pending = FALSE;
+		if (!player_read_stream_push_control(player, QUEUE_ENTRY_FLUSH,
+				(QueueCheckFunc) player_read_stream_check, &interrupt_ret)) {
+			if (interrupt_ret == READ_FROM_STREAM_CHECK_MSG_STOP) {
+				LOGI(2, "player_read_stream flush interrupt stop");
+				goto exit_loop;
+			} else if (interrupt_ret == READ_FROM_STREAM_CHECK_MSG_SEEK) {
+				// stale serial is dropped anyway, next flush is enough
+				LOGI(2, "player_read_stream flush interrupt seek");
+				goto seek_loop;
+			} else {
+				assert(FALSE);
+			}
+		}
+		LOGI(3, "player_read_stream ending seek");
 
-		// waiting for all stream flush
-		while (!player_if_all_no_array_elements_has_value(player,
-				player->flush_streams, FALSE))
-			pthread_cond_wait(&player->cond_queue, &player->mutex_queue);
+		pthread_mutex_unlock(&player->mutex_queue);
+		continue;
 
-		LOGI(3, "player_read_stream flushing internal codec buffers");
+next_input:
+		// prepared input is compatible with current threads and output,
+		// it is swapped in when decoders have taken everything queued
+		// before NEXT
+		av_free_packet(pkt);
+		next_input = player->next_input;
+		player->next_input = NULL;
+		if (player->seek_position == SEEK_TO_NEXT_INPUT) {
+			LOGI(3, "player_read_stream skipping to next input");
+			// rest of current input is dropped as stale
+			player->serial = next_input->serial;
+			if (player->audio_track) {
+				(*env)->CallVoidMethod(env, player->audio_track, player->audio_track_flush);
+			}
+			player_signal_control(player);
+		}
+		// decoders left waiting by switch cancelled with failed seek
+		// are counted in next_waiting already
+		if (!player_read_stream_push_control(player, QUEUE_ENTRY_NEXT,
+				(QueueCheckFunc) player_read_stream_next_check,
+				&interrupt_ret)) {
+			if (interrupt_ret == READ_FROM_STREAM_CHECK_MSG_STOP)
+				goto exit_loop;
+			goto cancel_next_input;
+		}
+		decoders = 0;
 		for (i = 0; i < AVMEDIA_TYPE_NB; ++i) {
-			if (player->input_codec_ctxs[i])
-				avcodec_flush_buffers(player->input_codec_ctxs[i]);
+			if (player->input.packets_queue[i] != NULL)
+				decoders += 1;
 		}
-
-		player->seek_position = DO_NOT_SEEK;
+		// decoders could be paused before reaching NEXT, seek must not
+		// wait for them
+		while (!player->stop && player->next_waiting < decoders
+				&& !player_read_stream_next_cancelled(player))
+			pthread_cond_wait(&player->cond_queue, &player->mutex_queue);
+		if (player->stop)
+			goto exit_loop;
+		if (player_read_stream_next_cancelled(player))
+			goto cancel_next_input;
+
+		FFSWAP(PlayerInput, player->input, *next_input);
+		player->input.format_ctx->interrupt_callback.callback = decoder_interrupt_cb;
+		player->serial = player->input.serial;
+		player->input_generation += 1;
+		player->next_waiting = 0;
+		// releases jni_player_play_next, seek could not be requested
+		// while it waits
+		if (player->seek_position == SEEK_TO_NEXT_INPUT)
+			player->seek_position = DO_NOT_SEEK;
 		player->last_audio_clock = 0;
-		update_external_clock_pts(player, seek_target / (double)AV_TIME_BASE);
-		pthread_cond_broadcast(&player->cond_queue);
-		LOGI(3, "player_read_stream ending seek");
-
-skip_loop:
-		av_free_packet(pkt);
+		player->last_updated_time = -1;
+		player_signal_control(player);
 		pthread_mutex_unlock(&player->mutex_queue);
+		LOGI(3, "player_read_stream switched to next input");
+
+		player_free_prepared_input(player, next_input);
+		next_input = NULL;
+		{
+			State state = { player, env, player->thiz };
+			player_update_time(&state, 0.0);
+		}
+		(*env)->CallVoidMethod(env, player->thiz,
+				player->onNextDataSourceStarted);
+		eagain_backoff_ms = READ_EAGAIN_MIN_BACKOFF_MS;
+		continue;
+
+cancel_next_input:
+		// seek position belongs to current input, switch is tried again
+		// when it reaches end of stream again
+		LOGI(3, "player_read_stream next input cancelled by seek");
+		player->next_input = next_input;
+		next_input = NULL;
+		goto seek_loop;
 	}
 
 detach_current_thread:
@@ -940,59 +1794,176 @@ Player * player_get_player_field(JNIEnv *env, jobject thiz) {
 	return player;
 }
 
-static void * player_fill_packet(State *state) {
-	PacketData *packet_data = malloc(sizeof(PacketData) + sizeof(AVPacket));
-	if (packet_data == NULL) {
-		return NULL;
+static void * player_fill_packet(Player *player) {
+	PacketData *packet_data = malloc(sizeof(PacketData) + sizeof(AVPacket));
+	if (packet_data == NULL) {
+		return NULL;
+	}
+	packet_data->packet = (AVPacket*)(packet_data + 1);
+	return packet_data;
+}
+
+static void player_free_packet(Player *player, PacketData *elem) {
+	free(elem);
+}
+
+static void player_flush_packet(Player *player, PacketData *packet_data) {
+	if (packet_data->type != QUEUE_ENTRY_DATA)
+		return;
+	if (packet_data->pooled) {
+		packet_pool_put(player->packet_pool, packet_data->packet->data);
+	} else {
+		av_free_packet(packet_data->packet);
+	}
+}
+
+/*
+ * TRUE when packet data was allocated for this packet by demuxer (and not
+ * borrowed from demuxer or parser internal buffer) so it could be handed
+ * over without copying.
+ */
+static int player_packet_owns_data(AVPacket *pkt) {
+#if LIBAVCODEC_VERSION_MAJOR >= 55
+	return pkt->buf != NULL;
+#else
+	return pkt->destruct == av_destruct_packet;
+#endif
+}
+
+/*
+ * Move packet returned by av_read_frame to packet_data. When packet owns
+ * its data the data is handed over as is. Otherwise it has to be copied
+ * (as av_dup_packet would do) and it is copied to buffer from
+ * player->packet_pool. Packets with side data or too big for the pool are
+ * duplicated with av_dup_packet.
+ */
+static int player_take_packet(Player *player, PacketData *packet_data,
+		AVPacket *pkt) {
+	AVPacket *packet = packet_data->packet;
+	uint8_t *data = NULL;
+
+	if (player_packet_owns_data(pkt)) {
+		packet_data->pooled = FALSE;
+		*packet = *pkt;
+		player->packets_bytes_moved += pkt->size;
+		// data belongs to packet now, pkt must not free it again
+		av_init_packet(pkt);
+		pkt->data = NULL;
+		pkt->size = 0;
+		return 0;
+	}
+
+	player->packets_bytes_copied += pkt->size;
+	if (pkt->side_data_elems == 0)
+		data = packet_pool_get(player->packet_pool,
+				pkt->size + FF_INPUT_BUFFER_PADDING_SIZE);
+	if (data == NULL) {
+		packet_data->pooled = FALSE;
+		*packet = *pkt;
+		return av_dup_packet(packet);
+	}
+
+	memcpy(data, pkt->data, pkt->size);
+	memset(data + pkt->size, 0, FF_INPUT_BUFFER_PADDING_SIZE);
+	// fresh packet so nothing refers to pkt buffer
+	av_init_packet(packet);
+	packet->data = data;
+	packet->size = pkt->size;
+	packet->pts = pkt->pts;
+	packet->dts = pkt->dts;
+	packet->stream_index = pkt->stream_index;
+	packet->flags = pkt->flags;
+	packet->duration = pkt->duration;
+	packet->pos = pkt->pos;
+	packet->convergence_duration = pkt->convergence_duration;
+	packet_data->pooled = TRUE;
+	av_free_packet(pkt);
+	return 0;
+}
+
+/*
+ * Report packet size in bytes and duration in milliseconds. When demuxer
+ * does not know packet duration it is estimated from frame rate or audio
+ * frame size.
+ */
+static void player_measure_packet(AVFormatContext *ic,
+		PacketData *packet_data, int *bytes, int *duration) {
+	AVPacket *packet = packet_data->packet;
+	AVStream *stream;
+	AVCodecContext *ctx;
+
+	*bytes = 0;
+	*duration = 0;
+	if (packet_data->type != QUEUE_ENTRY_DATA)
+		return;
+
+	*bytes = packet->size;
+	stream = ic->streams[packet->stream_index];
+	ctx = stream->codec;
+	if (packet->duration > 0) {
+		*duration = packet->duration * av_q2d(stream->time_base) * 1000.0;
+	} else if (ctx->codec_type == AVMEDIA_TYPE_VIDEO
+			&& stream->avg_frame_rate.num > 0
+			&& stream->avg_frame_rate.den > 0) {
+		*duration = 1000.0 / av_q2d(stream->avg_frame_rate);
+	} else if (ctx->codec_type == AVMEDIA_TYPE_AUDIO && ctx->frame_size > 0
+			&& ctx->sample_rate > 0) {
+		*duration = ctx->frame_size * 1000LL / ctx->sample_rate;
 	}
-	packet_data->packet = (AVPacket*)(packet_data + 1);
-	return packet_data;
 }
 
-static void player_free_packet(State *player, PacketData *elem) {
-	free(elem);
+/*
+ * Queue elements are created and freed on whatever thread uses the queue,
+ * every such thread is attached to the VM.
+ */
+static JNIEnv *player_get_env(Player *player) {
+	JNIEnv *env = NULL;
+	if ((*player->get_javavm)->GetEnv(player->get_javavm, (void **) &env,
+			JNI_VERSION_1_4) != JNI_OK)
+		return NULL;
+	return env;
 }
 
-static void player_free_video_rgb_frame(State *state, VideoRGBFrameElem *elem) {
-	JNIEnv *env = state->env;
+static void player_free_video_rgb_frame(Player *player, VideoRGBFrameElem *elem) {
+	JNIEnv *env = player_get_env(player);
+	assert(env != NULL);
 	(*env)->DeleteGlobalRef(env, elem->jbitmap);
 	avcodec_free_frame(&elem->frame);
 	free(elem);
 }
 
-static void *player_fill_video_rgb_frame(DecoderState *decoder_state) {
-	Player *player = decoder_state->player;
-	JNIEnv *env = decoder_state->env;
-	jobject thiz = decoder_state->thiz;
-	AVCodecContext *ctx = player->input_codec_ctxs[AVMEDIA_TYPE_VIDEO];
+static VideoRGBFrameElem *player_alloc_video_rgb_frame(Player *player,
+		JNIEnv *env, int width, int height) {
+	jobject thiz = player->thiz;
 
 	VideoRGBFrameElem *elem = malloc(sizeof(VideoRGBFrameElem));
 	if (elem == NULL) {
 		LOGE(1,
-				"player_fill_video_rgb_frame could no allocate VideoRGBFrameEelem");
+				"player_alloc_video_rgb_frame could no allocate VideoRGBFrameEelem");
 		goto error;
 	}
 
 	elem->frame = avcodec_alloc_frame();
 	if (elem->frame == NULL) {
-		LOGE(1, "player_fill_video_rgb_frame could not create frame")
+		LOGE(1, "player_alloc_video_rgb_frame could not create frame")
 		goto free_elem;
 	}
 
-	int destWidth = ctx->width;
-	int destHeight = ctx->height;
+	elem->width = width;
+	elem->height = height;
 
-	LOGI(10, "player_fill_video_rgb_frame prepareFrame(%d, %d)", destWidth, destHeight);
+	LOGI(10, "player_alloc_video_rgb_frame prepareFrame(%d, %d)", width, height);
 	jobject jbitmap = (*env)->CallObjectMethod(env, thiz,
-			player->prepareFrame, destWidth, destHeight);
+			player->prepareFrame, width, height);
 
 	jthrowable exc = (*env)->ExceptionOccurred(env);
 	if (exc) {
-		LOGE(1, "player_fill_video_rgb_frame could not create jbitmap - exception occure");
+		LOGE(1, "player_alloc_video_rgb_frame could not create jbitmap - exception occure");
+		(*env)->ExceptionClear(env);
 		goto free_frame;
 	}
 	if (jbitmap == NULL) {
-		LOGE(1, "player_fill_video_rgb_frame could not create jbitmap");
+		LOGE(1, "player_alloc_video_rgb_frame could not create jbitmap");
 		goto free_frame;
 	}
 
@@ -1019,13 +1990,40 @@ end:
 	return elem;
 }
 
+static void player_free_video_frame(Player *player, VideoFrameElem *elem) {
+#if LIBAVCODEC_VERSION_MAJOR >= 55
+	av_frame_unref(elem->frame);
+#else
+	if (elem->allocated)
+		avpicture_free((AVPicture *) elem->frame);
+#endif
+	avcodec_free_frame(&elem->frame);
+	free(elem);
+}
+
+static void *player_fill_video_frame(Player *player) {
+	VideoFrameElem *elem = malloc(sizeof(VideoFrameElem));
+	if (elem == NULL) {
+		LOGE(1, "player_fill_video_frame could no allocate VideoFrameElem");
+		return NULL;
+	}
+	memset(elem, 0, sizeof(VideoFrameElem));
+	elem->frame = avcodec_alloc_frame();
+	if (elem->frame == NULL) {
+		LOGE(1, "player_fill_video_frame could not create frame");
+		free(elem);
+		return NULL;
+	}
+	return elem;
+}
+
 static void player_update_current_time(State *state, int is_finished) {
 	Player *player = state->player;
 	jboolean jis_finished = is_finished ? JNI_TRUE : JNI_FALSE;
 
 	(*state->env)->CallVoidMethod(state->env, state->thiz,
 		player->onUpdateTime, player->last_updated_time,
-		player->video_duration, jis_finished);
+		player->input.video_duration, jis_finished);
 }
 
 static void player_update_time(State *state, double time) {
@@ -1040,25 +2038,26 @@ static void player_update_time(State *state, double time) {
 	// because video duration can be estimate
 	// we have to ensure that it will not be smaller
 	// than current time
-	if (time_int > player->video_duration)
-		player->video_duration = time_int;
+	if (time_int > player->input.video_duration)
+		player->input.video_duration = time_int;
 
 	player_update_current_time(state, FALSE);
 }
 
-static void player_free_streams(Player *player) {
+static void player_free_streams(PlayerInput *input) {
 	int i;
 	for (i = 0; i < AVMEDIA_TYPE_NB; ++i) {
-		if (player->input_codec_ctxs[i]) {
-			avcodec_close(player->input_codec_ctxs[i]);
-			player->input_codec_ctxs[i] = NULL;
+		if (input->input_codec_ctxs[i]) {
+			avcodec_close(input->input_codec_ctxs[i]);
+			input->input_codec_ctxs[i] = NULL;
 		}
-		player->input_streams[i] = NULL;
-		player->input_frames[i] = NULL;
-		player->stream_indexs[i] = -1;
+		input->input_streams[i] = NULL;
+		input->input_frames[i] = NULL;
+		input->stream_indexs[i] = -1;
 	}
-	player->video_index = -1;
-	player->audio_index = -1;
+	input->video_index = -1;
+	input->audio_index = -1;
+	input->decoder_threads = 0;
 }
 
 static uint64_t player_find_layout_from_channels(int nb_channels) {
@@ -1069,22 +2068,22 @@ static uint64_t player_find_layout_from_channels(int nb_channels) {
 	return (uint64_t) 0;
 }
 
-static int player_free_frames(Player *player) {
+static int player_free_frames(PlayerInput *input) {
 	int i;
 	for (i = 0; i < AVMEDIA_TYPE_NB; ++i) {
-		if (player->input_frames[i] != NULL) {
-			av_freep(&player->input_frames[i]);
+		if (input->input_frames[i] != NULL) {
+			av_freep(&input->input_frames[i]);
 		}
 	}
 	return 0;
 }
 
-static int player_alloc_frames(Player *player) {
+static int player_alloc_frames(PlayerInput *input) {
 	int i;
 	for (i = 0; i < AVMEDIA_TYPE_NB; ++i) {
-		if (player->input_codec_ctxs[i]) {
-			player->input_frames[i] = avcodec_alloc_frame();
-			if (player->input_frames[i] == NULL) {
+		if (input->input_codec_ctxs[i]) {
+			input->input_frames[i] = avcodec_alloc_frame();
+			if (input->input_frames[i] == NULL) {
 				return -ERROR_COULD_NOT_ALLOC_FRAME;
 			}
 		}
@@ -1092,83 +2091,82 @@ static int player_alloc_frames(Player *player) {
 	return 0;
 }
 
-static int player_alloc_queues(State *state) {
-	Player *player = state->player;
+static int player_alloc_queues(Player *player, PlayerInput *input) {
 	int i;
 	for (i = 0; i < AVMEDIA_TYPE_NB; ++i) {
-		if (player->input_codec_ctxs[i]) {
-			player->packets_queue[i] = queue_init_with_custom_lock(100,
+		if (input->input_codec_ctxs[i]) {
+			input->packets_queue[i] = queue_init_with_custom_lock(
+				PACKETS_QUEUE_SIZE, QUEUE_MODE_SPSC,
 				(queue_fill_func) player_fill_packet,
-				(queue_free_func) player_free_packet, state, state,
-				&player->mutex_queue, &player->cond_queue);
-			if (player->packets_queue[i] == NULL) {
+				(queue_free_func) player_free_packet, player, player,
+				&player->mutex_queue);
+			if (input->packets_queue[i] == NULL) {
 				return -ERROR_COULD_NOT_PREPARE_PACKETS_QUEUE;
 			}
+			// queue moves together with its input
+			queue_set_limits(input->packets_queue[i],
+				(queue_measure_func) player_measure_packet, input->format_ctx,
+				player->packets_queue_max_bytes[i],
+				player->packets_queue_max_duration[i]);
+			queue_set_watermarks(input->packets_queue[i],
+				player->buffering_low_ms, player->buffering_high_ms);
 		}
 	}
 	return 0;
 }
 
-static void player_free_queues(State *state) {
-	Player *player = state->player;
+static void player_free_queues(Player *player, PlayerInput *input) {
 	int i;
 	for (i = 0; i < AVMEDIA_TYPE_NB; ++i) {
-		if (player->packets_queue[i] != NULL) {
-			queue_free(player->packets_queue[i], &player->mutex_queue, &player->cond_queue, state);
-			player->packets_queue[i] = NULL;
+		Queue *queue = input->packets_queue[i];
+		if (queue != NULL) {
+			QueueStats stats;
+			// player_signal_control could be called by the renderer
+			pthread_mutex_lock(&player->mutex_queue);
+			input->packets_queue[i] = NULL;
+			pthread_mutex_unlock(&player->mutex_queue);
+
+			queue_get_stats(queue, &stats);
+			LOGI(3, "player_free_queues packets_queue[%d] wakeups: %d, spurious: %d, "
+				"push waits: %d (%lld us), pop waits: %d (%lld us), high water: %d",
+				i, stats.wakeups, stats.spurious_wakeups,
+				stats.push_waits, stats.push_wait_us,
+				stats.pop_waits, stats.pop_wait_us, stats.high_water);
+			queue_free(queue, &player->mutex_queue, player);
 		}
 	}
 }
 
-static int player_prepare_rgb_frames(DecoderState *decoder_state, State *state) {
-	Player *player = decoder_state->player;
-
-	player->rgb_video_queue = queue_init_with_custom_lock(2,
-		(queue_fill_func) player_fill_video_rgb_frame,
-		(queue_free_func) player_free_video_rgb_frame, decoder_state,
-		state, &player->mutex_queue, &player->cond_queue);
-	if (player->rgb_video_queue == NULL) {
+/*
+ * Bitmap is allocated by the renderer when first frame is shown, not here.
+ */
+static int player_prepare_video_frames(Player *player) {
+	// frames carry their own geometry so queue is kept for next inputs
+	if (player->video_frames_queue != NULL)
+		return 0;
+	player->video_frames_queue = queue_init_with_custom_lock(
+		VIDEO_FRAMES_QUEUE_SIZE, QUEUE_MODE_LOCKED,
+		(queue_fill_func) player_fill_video_frame,
+		(queue_free_func) player_free_video_frame, player,
+		player, &player->mutex_queue);
+	if (player->video_frames_queue == NULL) {
 		return -ERROR_COULD_NOT_PREPARE_RGB_QUEUE;
 	}
 	return 0;
 }
 
-static int player_preapre_sws_context(Player *player) {
-	AVCodecContext *ctx = player->input_codec_ctxs[AVMEDIA_TYPE_VIDEO];
-	int destWidth = ctx->width;
-	int destHeight = ctx->height;
-
-	player->sws_context = sws_getContext(ctx->width, ctx->height, ctx->pix_fmt,
-			destWidth, destHeight, player->out_format, SWS_BICUBIC, NULL, NULL,
-			NULL);
-	if (player->sws_context == NULL) {
-		LOGE(1, "could not initialize conversion context from: %d"
-				", to :%d\n", ctx->pix_fmt, player->out_format);
-		return -ERROR_COULD_NOT_GET_SWS_CONTEXT;
-	}
-	return 0;
-}
-
-static void player_free_sws_context(Player *player) {
-	if (player->sws_context != NULL) {
-		LOGI(7, "player_set_data_source free_sws_context");
-		sws_freeContext(player->sws_context);
-		player->sws_context = NULL;
-	}
-}
-
 static void player_free_audio_track(Player *player, State *state) {
-	if (player->swr_context != NULL) {
-		swr_free(&player->swr_context);
-		player->swr_context = NULL;
+	if (player->input.swr_context != NULL) {
+		swr_free(&player->input.swr_context);
+		player->input.swr_context = NULL;
 	}
 	if (player->audio_track != NULL) {
 		LOGI(7, "player_set_data_source free_audio_track_ref");
 		(*state->env)->DeleteGlobalRef(state->env, player->audio_track);
 		player->audio_track = NULL;
 	}
-	if (player->audio_index >= 0) {
-		AVCodecContext **ctx = &player->input_codec_ctxs[AVMEDIA_TYPE_AUDIO];
+	if (player->input.audio_index >= 0) {
+		AVCodecContext **ctx = &player->input.input_codec_ctxs[AVMEDIA_TYPE_AUDIO];
 		if (*ctx != NULL) {
 			LOGI(7, "player_set_data_sourceclose_audio_codec");
 			avcodec_close(*ctx);
@@ -1177,9 +2175,49 @@ static void player_free_audio_track(Player *player, State *state) {
 	}
 }
 
+/*
+ * Conversion from input audio decoder output to already created audio
+ * track.
+ */
+static int player_alloc_swr_context(Player *player, PlayerInput *input) {
+	AVCodecContext *ctx = input->input_codec_ctxs[AVMEDIA_TYPE_AUDIO];
+	int64_t audio_track_layout = player_find_layout_from_channels(
+		player->audio_track_channel_count);
+
+	int64_t dec_channel_layout = (ctx->channel_layout &&
+		ctx->channels == av_get_channel_layout_nb_channels(ctx->channel_layout)) ?
+		ctx->channel_layout : av_get_default_channel_layout(ctx->channels);
+
+	input->swr_context = NULL;
+	if (ctx->sample_fmt != player->audio_track_format
+		|| dec_channel_layout != audio_track_layout
+		|| ctx->sample_rate != player->audio_track_sample_rate) {
+		LOGI(3,
+				"player_set_data_sourcd preparing conversion of %d Hz %s %d channels to %d Hz %s %d channels",
+				ctx->sample_rate, av_get_sample_fmt_name(ctx->sample_fmt), ctx->channels,
+				player->audio_track_sample_rate, av_get_sample_fmt_name(player->audio_track_format),
+				player->audio_track_channel_count);
+		input->swr_context = (struct SwrContext *) swr_alloc_set_opts(NULL,
+			audio_track_layout, player->audio_track_format,
+			player->audio_track_sample_rate, dec_channel_layout, ctx->sample_fmt,
+			ctx->sample_rate, 0, NULL);
+
+		if (!input->swr_context || swr_init(input->swr_context) < 0) {
+			LOGE(1,
+					"Cannot create sample rate converter for conversion of %d Hz %s %d "
+					"channels to %d Hz %s %d channels!", ctx->sample_rate,
+					av_get_sample_fmt_name(ctx->sample_fmt), ctx->channels,
+					player->audio_track_sample_rate, av_get_sample_fmt_name(player->audio_track_format),
+					player->audio_track_channel_count);
+			return -ERROR_COULD_NOT_INIT_SWR_CONTEXT;
+		}
+	}
+	return 0;
+}
+
 static int player_create_audio_track(Player *player, State *state) {
 	JNIEnv *env = state->env;
-	AVCodecContext *ctx = player->input_codec_ctxs[AVMEDIA_TYPE_AUDIO];
+	AVCodecContext *ctx = player->input.input_codec_ctxs[AVMEDIA_TYPE_AUDIO];
 	int sample_rate = ctx->sample_rate;
 	int channels = ctx->channels;
 
@@ -1202,70 +2240,38 @@ static int player_create_audio_track(Player *player, State *state) {
 
 	player->audio_track_channel_count = (*env)->CallIntMethod(env,
 		player->audio_track, player->audio_track_getChannelCount);
-	int audio_track_sample_rate = (*env)->CallIntMethod(env,
+	player->audio_track_sample_rate = (*env)->CallIntMethod(env,
 		player->audio_track, player->audio_track_getSampleRate);
 	player->audio_track_format = AV_SAMPLE_FMT_S16;
 
-	int64_t audio_track_layout = player_find_layout_from_channels(
-		player->audio_track_channel_count);
-
-	int64_t dec_channel_layout = (ctx->channel_layout &&
-		ctx->channels == av_get_channel_layout_nb_channels(ctx->channel_layout)) ?
-		ctx->channel_layout : av_get_default_channel_layout(ctx->channels);
-
-	player->swr_context = NULL;
-	if (ctx->sample_fmt != player->audio_track_format
-		|| dec_channel_layout != audio_track_layout
-		|| ctx->sample_rate != audio_track_sample_rate) {
-		LOGI(3,
-				"player_set_data_sourcd preparing conversion of %d Hz %s %d channels to %d Hz %s %d channels",
-				ctx->sample_rate, av_get_sample_fmt_name(ctx->sample_fmt), ctx->channels,
-				audio_track_sample_rate, av_get_sample_fmt_name(player->audio_track_format),
-				player->audio_track_channel_count);
-		player->swr_context = (struct SwrContext *) swr_alloc_set_opts(NULL,
-			audio_track_layout, player->audio_track_format,
-			audio_track_sample_rate, dec_channel_layout, ctx->sample_fmt,
-			ctx->sample_rate, 0, NULL);
-
-		if (!player->swr_context || swr_init(player->swr_context) < 0) {
-			LOGE(1,
-					"Cannot create sample rate converter for conversion of %d Hz %s %d "
-					"channels to %d Hz %s %d channels!", ctx->sample_rate,
-					av_get_sample_fmt_name(ctx->sample_fmt), ctx->channels,
-					audio_track_sample_rate, av_get_sample_fmt_name(player->audio_track_format),
-					player->audio_track_channel_count);
-			return -ERROR_COULD_NOT_INIT_SWR_CONTEXT;
-		}
-	}
-	return 0;
+	return player_alloc_swr_context(player, &player->input);
 }
 
-static void player_get_video_duration(Player *player) {
-	player->last_updated_time = -1;
-	player->video_duration = 0;
+static void player_get_video_duration(PlayerInput *input) {
+	input->video_duration = 0;
 	int i;
 
 	for (i = 0; i < AVMEDIA_TYPE_NB; ++i) {
-		AVStream *stream = player->input_streams[i];
+		AVStream *stream = input->input_streams[i];
 		if (stream && stream->duration > 0) {
-			player->video_duration = round(stream->duration * av_q2d(stream->time_base));
+			input->video_duration = round(stream->duration * av_q2d(stream->time_base));
 			LOGI(3,
 					"player_set_data_source stream[%d] duration: %lld", i, stream->duration);
 			return;
 		}
 	}
-	if (player->format_ctx->duration != 0) {
-		player->video_duration = round(
-				player->format_ctx->duration * av_q2d(AV_TIME_BASE_Q));
+	if (input->format_ctx->duration != 0) {
+		input->video_duration = round(
+				input->format_ctx->duration * av_q2d(AV_TIME_BASE_Q));
 		LOGI(3,
-				"player_set_data_source video duration: %lld", player->format_ctx->duration)
+				"player_set_data_source video duration: %lld", input->format_ctx->duration)
 		return;
 	}
 
-	for (i = 0; i < player->format_ctx->nb_streams; i++) {
-		AVStream *stream = player->format_ctx->streams[i];
+	for (i = 0; i < input->format_ctx->nb_streams; i++) {
+		AVStream *stream = input->format_ctx->streams[i];
 		if (stream->duration > 0) {
-			player->video_duration = round(
+			input->video_duration = round(
 					stream->duration * av_q2d(stream->time_base));
 			LOGI(3,
 					"player_set_data_source stream[%d] duration: %lld", i, stream->duration);
@@ -1286,9 +2292,10 @@ static int player_create_decoding_threads(Player *player) {
 		goto end;
 	}
 	for (i = 0; i < AVMEDIA_TYPE_NB; ++i) {
-		if (player->input_codec_ctxs[i]) {
+		if (player->input.input_codec_ctxs[i]) {
 			DecoderData *decoder_data = malloc(sizeof(DecoderData));
-			*decoder_data = (DecoderData) {player, (enum AVMediaType)i};
+			*decoder_data = (DecoderData) {player, (enum AVMediaType)i,
+				player->serial};
 			ret = pthread_create(&player->decode_threads[i], &attr, player_decode,
 				decoder_data);
 			if (ret) {
@@ -1344,10 +2351,125 @@ static int player_free_decoding_threads(Player *player) {
 	return err;
 }
 
-static void player_free_input(Player *player) {
-	if (player->format_ctx) {
+/*
+ * Media cached in cache_dir are told apart by key: url, size and for local
+ * files mtime (remote ones only by size because response headers are not
+ * available here). Leaves cache_key NULL when nothing should be cached.
+ */
+static int player_alloc_cache_key(Player *player, PlayerInput *input,
+		const char *file_path) {
+	AVFormatContext *ic = input->format_ctx;
+	const char *local_path = file_path;
+	struct stat file_stat;
+	int64_t mtime = 0;
+	int64_t size;
+
+	if (player->cache_dir == NULL || ic->pb == NULL)
+		return ERROR_NO_ERROR;
+	size = avio_size(ic->pb);
+	// live streams are never the same twice
+	if (size <= 0)
+		return ERROR_NO_ERROR;
+	av_strstart(file_path, "file:", &local_path);
+	if (local_path[0] == '/' && stat(local_path, &file_stat) == 0)
+		mtime = file_stat.st_mtime;
+
+	input->cache_key = av_asprintf("%s\nsize:%"PRId64"\nmtime:%"PRId64,
+			file_path, size, mtime);
+	if (input->cache_key == NULL)
+		return -ERROR_COULD_NOT_ALLOCATE_MEMORY;
+	return ERROR_NO_ERROR;
+}
+
+/*
+ * Cache files are named after hash of their key, key is stored in file and
+ * compared on load.
+ */
+static char *player_cache_path(Player *player, const char *name,
+		const char *key) {
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	const char *c;
+	// FNV-1a
+	for (c = key; *c; ++c) {
+		hash ^= (unsigned char) *c;
+		hash *= 0x100000001b3ULL;
+	}
+	return av_asprintf("%s/%s-%016"PRIx64".idx", player->cache_dir, name,
+			hash);
+}
+
+static int player_keyframe_index_file(Player *player, PlayerInput *input,
+		AVStream *st) {
+	if (input->cache_key == NULL)
+		return ERROR_NO_ERROR;
+	input->keyframe_index_key = av_asprintf("%s\nstream:%d\ntime_base:%d/%d",
+			input->cache_key, st->index, st->time_base.num,
+			st->time_base.den);
+	if (input->keyframe_index_key == NULL)
+		return -ERROR_COULD_NOT_ALLOCATE_MEMORY;
+	input->keyframe_index_path = player_cache_path(player, "keyframes",
+			input->keyframe_index_key);
+	if (input->keyframe_index_path == NULL)
+		return -ERROR_COULD_NOT_ALLOCATE_MEMORY;
+	return ERROR_NO_ERROR;
+}
+
+static int player_alloc_keyframe_index(Player *player, PlayerInput *input) {
+	AVFormatContext *ic = input->format_ctx;
+	AVStream *st;
+	int err;
+	// the same stream as seek in player_read_stream uses
+	if (input->input_codec_ctxs[AVMEDIA_TYPE_VIDEO])
+		input->keyframe_index_stream = input->stream_indexs[AVMEDIA_TYPE_VIDEO];
+	else
+		input->keyframe_index_stream = input->stream_indexs[AVMEDIA_TYPE_AUDIO];
+	input->keyframe_index_entries = 0;
+	input->keyframe_index_seeks = 0;
+	if (input->keyframe_index_stream < 0)
+		return ERROR_NO_ERROR;
+	st = ic->streams[input->keyframe_index_stream];
+	// demuxers with index (mp4, mkv, flv with keyframes metadata) seek
+	// fast by themselves, ts and plain flv bisect or scan
+	if (st->nb_index_entries > 0 || (ic->iformat->flags & AVFMT_NO_BYTE_SEEK))
+		return ERROR_NO_ERROR;
+
+	if ((err = player_keyframe_index_file(player, input, st)) < 0)
+		return err;
+	if (input->keyframe_index_path != NULL) {
+		input->keyframe_index = keyframe_index_load(
+				input->keyframe_index_path, input->keyframe_index_key);
+		if (input->keyframe_index != NULL) {
+			input->keyframe_index_entries =
+					keyframe_index_size(input->keyframe_index);
+			LOGI(3, "player_alloc_keyframe_index loaded %d keyframes from: %s",
+					input->keyframe_index_entries, input->keyframe_index_path);
+			return ERROR_NO_ERROR;
+		}
+	}
+	input->keyframe_index = keyframe_index_init();
+	if (input->keyframe_index == NULL)
+		return -ERROR_COULD_NOT_ALLOCATE_MEMORY;
+	return ERROR_NO_ERROR;
+}
+
+static void player_free_input(PlayerInput *input) {
+	if (input->keyframe_index) {
+		if (input->keyframe_index_path != NULL
+				&& keyframe_index_modified(input->keyframe_index)
+				&& keyframe_index_save(input->keyframe_index,
+						input->keyframe_index_path,
+						input->keyframe_index_key) < 0)
+			LOGE(2, "player_free_input could not save keyframe index: %s",
+					input->keyframe_index_path);
+		keyframe_index_free(input->keyframe_index);
+		input->keyframe_index = NULL;
+	}
+	av_freep(&input->keyframe_index_path);
+	av_freep(&input->keyframe_index_key);
+	av_freep(&input->cache_key);
+	if (input->format_ctx) {
 		LOGI(7, "player_set_data_source close_file");
-		avformat_close_input(&player->format_ctx);
+		avformat_close_input(&input->format_ctx);
 	}
 }
 
@@ -1357,15 +2479,26 @@ static int decoder_interrupt_cb(void *ctx) {
 	return (player->stop) || (player->open_time && (av_gettime() - player->open_time) > 7LL*AV_TIME_BASE);
 }
 
-static int player_open_input(Player *player, const char *file_path, AVDictionary *dictionary) {
+/* the same for input opened by player_prepare_next */
+static int player_next_interrupt_cb(void *ctx) {
+	Player *player = ctx;
+	return player->stop || player->next_abort || (player->next_open_time
+			&& (av_gettime() - player->next_open_time) > 7LL*AV_TIME_BASE);
+}
+
+/*
+ * interrupt_cb decides by open_time whether opening takes too long.
+ */
+static int player_open_input(PlayerInput *input, const char *file_path,
+		AVDictionary *dictionary, AVIOInterruptCB *interrupt_cb,
+		int64_t *open_time) {
 	AVFormatContext *ic = NULL;
 	int ret;
 
 	ic = avformat_alloc_context();
-	ic->interrupt_callback.callback = decoder_interrupt_cb;
-	ic->interrupt_callback.opaque   = player;
+	ic->interrupt_callback = *interrupt_cb;
 
-	player->open_time = av_gettime();
+	*open_time = av_gettime();
 	if ((ret = avformat_open_input(&ic, file_path, NULL, &dictionary)) < 0) {
 		char errbuf[128];
 		const char *errbuf_ptr = errbuf;
@@ -1374,23 +2507,20 @@ static int player_open_input(Player *player, const char *file_path, AVDictionary
 		if (av_strerror(ret, errbuf, sizeof(errbuf)) < 0)
 			errbuf_ptr = strerror(AVUNERROR(ret));
 
+		*open_time = 0;
 		LOGE(1,
 				"player_set_data_source Could not open video file: %s (%d: %s)\n", file_path, ret, errbuf_ptr);
 		return -ERROR_COULD_NOT_OPEN_VIDEO_FILE;
 	}
-	player->format_ctx = ic;
-	player->open_time = 0;
-	update_external_clock_pts(player, av_gettime()/(double)AV_NOPTS_VALUE);
-	update_external_clock_speed(player, 1.0);
-	player->video_current_pts_drift = -av_gettime() / 1000000.0;
-
+	input->format_ctx = ic;
+	*open_time = 0;
 	return ERROR_NO_ERROR;
 }
 
 static void player_signal_stop(Player *player) {
 	pthread_mutex_lock(&player->mutex_queue);
 	player->stop = TRUE;
-	pthread_cond_broadcast(&player->cond_queue);
+	player_signal_control(player);
 	pthread_mutex_unlock(&player->mutex_queue);
 }
 
@@ -1398,12 +2528,49 @@ static void player_play_prepare(Player *player) {
 	LOGI(3, "player_set_data_source 16");
 	pthread_mutex_lock(&player->mutex_queue);
 	player->stop = FALSE;
+	player->buffering = FALSE;
 	player->seek_position = DO_NOT_SEEK;
-	player_assign_to_no_boolean_array(player, player->flush_streams, FALSE);
-	player_assign_to_no_boolean_array(player, player->stop_streams, FALSE);
 
-	pthread_cond_broadcast(&player->cond_queue);
+	player_signal_control(player);
+	pthread_mutex_unlock(&player->mutex_queue);
+}
+
+/*
+ * Stop preparing next input and free the prepared one. Has to be called
+ * with mutex_operation held.
+ */
+static void player_abort_next(Player *player) {
+	PlayerInput *next_input;
+	pthread_mutex_lock(&player->mutex_queue);
+	player->next_abort = TRUE;
+	while (player->next_preparing)
+		pthread_cond_wait(&player->cond_queue, &player->mutex_queue);
+	next_input = player->next_input;
+	player->next_input = NULL;
 	pthread_mutex_unlock(&player->mutex_queue);
+	if (next_input != NULL)
+		player_free_prepared_input(player, next_input);
+}
+
+/*
+ * Stop threads and free everything allocated for playback of current
+ * input.
+ */
+static void player_free_playback(State *state) {
+	Player *player = state->player;
+	player_signal_stop(player);
+	player_abort_next(player);
+	player_free_decoding_threads(player);
+	// queue is kept for next data source, frames left in it would hold
+	// decoder and pool buffers until then
+	if (player->video_frames_queue != NULL)
+		queue_flush(player->video_frames_queue, &player->mutex_queue,
+				(queue_flush_func) player_video_frame_unref, player);
+	player_free_audio_track(player, state);
+	player_free_queues(player, &player->input);
+	player_free_frames(&player->input);
+	player_free_streams(&player->input);
+	player_free_input(&player->input);
 }
 
 static void player_stop(State * state) {
@@ -1422,21 +2589,21 @@ static void player_stop(State * state) {
 	player->playing = FALSE;
 
 	LOGI(3, "player_stop stopping...");
-	player_signal_stop(player);
-	player_free_decoding_threads(player);
-	player_free_audio_track(player, state);
-	player_free_sws_context(player);
-	player_free_queues(state);
-	player_free_frames(player);
-	player_free_streams(player);
-	player_free_input(player);
+	player_free_playback(state);
 	LOGI(3, "player_stop stopped...");
 
 	pthread_mutex_unlock(&player->mutex_operation);
 }
 
-static int stream_component_open(Player *player, int stream_index) {
-	AVFormatContext *ic = player->format_ctx;
+static int player_decoder_threads(Player *player) {
+	if (player->decoder_threads > 0)
+		return player->decoder_threads;
+	return av_clip(player->cpu_count, 1, MAX_DECODER_THREADS);
+}
+
+static int stream_component_open(Player *player, PlayerInput *input,
+		int stream_index) {
+	AVFormatContext *ic = input->format_ctx;
 	AVStream *st;
 	AVCodecContext *avctx;
 	AVCodec *codec;
@@ -1456,19 +2623,27 @@ static int stream_component_open(Player *player, int stream_index) {
 	st->discard = AVDISCARD_DEFAULT;
 	switch(avctx->codec_type) {
 	case AVMEDIA_TYPE_AUDIO:
-		player->audio_index = stream_index;
-		player->input_streams[AVMEDIA_TYPE_AUDIO] = st;
-		player->input_codec_ctxs[AVMEDIA_TYPE_AUDIO] = avctx;
-		player->stream_indexs[AVMEDIA_TYPE_AUDIO] = stream_index;
+		input->audio_index = stream_index;
+		input->input_streams[AVMEDIA_TYPE_AUDIO] = st;
+		input->input_codec_ctxs[AVMEDIA_TYPE_AUDIO] = avctx;
+		input->stream_indexs[AVMEDIA_TYPE_AUDIO] = stream_index;
 		channels    = avctx->channels;
 		sample_rate = avctx->sample_rate;
 		frame_size  = avctx->frame_size;
 		break;
 	case AVMEDIA_TYPE_VIDEO:
-		player->video_index = stream_index;
-		player->input_streams[AVMEDIA_TYPE_VIDEO] = st;
-		player->input_codec_ctxs[AVMEDIA_TYPE_VIDEO] = avctx;
-		player->stream_indexs[AVMEDIA_TYPE_VIDEO] = stream_index;
+		input->video_index = stream_index;
+		input->input_streams[AVMEDIA_TYPE_VIDEO] = st;
+		input->input_codec_ctxs[AVMEDIA_TYPE_VIDEO] = avctx;
+		input->stream_indexs[AVMEDIA_TYPE_VIDEO] = stream_index;
+		avctx->thread_count = player_decoder_threads(player);
+		avctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+#if LIBAVCODEC_VERSION_MAJOR >= 55
+		// decoded frames are queued without copying
+		avctx->refcounted_frames = 1;
+		if (player->video_frame_pool)
+			frame_pool_attach(player->frame_pool, avctx, codec);
+#endif
 		break;
 	default:
 		break;
@@ -1481,6 +2656,13 @@ static int stream_component_open(Player *player, int stream_index) {
 		avctx->flags |= CODEC_FLAG_EMU_EDGE;
 	if (avcodec_open2(avctx, codec, NULL) < 0)
 		return -1;
+	if (avctx->codec_type == AVMEDIA_TYPE_VIDEO) {
+		// decoders without threads support fall back to one
+		input->decoder_threads = avctx->active_thread_type ?
+				avctx->thread_count : 1;
+		LOGI(3, "stream_component_open video threads: %d, type: %d",
+				avctx->thread_count, avctx->active_thread_type);
+	}
 	if (avctx->codec_type == AVMEDIA_TYPE_AUDIO) {
 		/* |avcodec_open2()| could break audio codec settings */
 		if (avctx->channels <= 0)
@@ -1493,13 +2675,244 @@ static int stream_component_open(Player *player, int stream_index) {
 	return 0;
 }
 
+/*
+ * Read player option from setDataSource dictionary and remove it so it is
+ * not passed to avformat_open_input.
+ */
+static int player_take_int_option(AVDictionary **dictionary, const char *key,
+		int default_value) {
+	AVDictionaryEntry *entry = av_dict_get(*dictionary, key, NULL, 0);
+	int value;
+	if (entry == NULL)
+		return default_value;
+	value = atoi(entry->value);
+	av_dict_set(dictionary, key, NULL, 0);
+	LOGI(3, "player_set_data_source option %s: %d", key, value);
+	return value;
+}
+
+static void player_read_options(Player *player, AVDictionary **dictionary) {
+	AVDictionaryEntry *entry;
+	player->packets_queue_max_bytes[AVMEDIA_TYPE_AUDIO] = player_take_int_option(
+		dictionary, "audio_queue_max_bytes", AUDIO_PACKETS_QUEUE_MAX_BYTES);
+	player->packets_queue_max_duration[AVMEDIA_TYPE_AUDIO] = player_take_int_option(
+		dictionary, "audio_queue_max_duration_ms", PACKETS_QUEUE_MAX_DURATION_MS);
+	player->packets_queue_max_bytes[AVMEDIA_TYPE_VIDEO] = player_take_int_option(
+		dictionary, "video_queue_max_bytes", VIDEO_PACKETS_QUEUE_MAX_BYTES);
+	player->packets_queue_max_duration[AVMEDIA_TYPE_VIDEO] = player_take_int_option(
+		dictionary, "video_queue_max_duration_ms", PACKETS_QUEUE_MAX_DURATION_MS);
+	player->buffering_low_ms = player_take_int_option(
+		dictionary, "buffering_low_ms", BUFFERING_LOW_WATERMARK_MS);
+	player->buffering_high_ms = player_take_int_option(
+		dictionary, "buffering_high_ms", BUFFERING_HIGH_WATERMARK_MS);
+	if (player->buffering_low_ms > player->buffering_high_ms)
+		player->buffering_low_ms = player->buffering_high_ms;
+	player->pause_buffer_bytes = player_take_int_option(
+		dictionary, "pause_buffer_bytes", 0);
+	player->fast_start = player_take_int_option(dictionary, "fast_start", 0);
+	player->decoder_threads = player_take_int_option(dictionary,
+		"decoder_threads", 0);
+	player->decoder_degradation = player_take_int_option(dictionary,
+		"decoder_degradation", 1);
+	player->late_frame_drop = player_take_int_option(dictionary,
+		"late_frame_drop", 1);
+	player->late_frame_ms = player_take_int_option(dictionary,
+		"late_frame_ms", LATE_FRAME_THRESHOLD_MS);
+	player->video_frame_pool = player_take_int_option(dictionary,
+		"video_frame_pool", 1);
+
+	// left in dictionary for cache protocol
+	entry = av_dict_get(*dictionary, "cache_dir", NULL, 0);
+	av_freep(&player->cache_dir);
+	if (entry != NULL)
+		player->cache_dir = av_strdup(entry->value);
+}
+
+/*
+ * Parameters needed to open decoders, audio track and sws context are
+ * known for streams that would be played.
+ */
+static int player_stream_info_complete(PlayerInput *input) {
+	AVFormatContext *ic = input->format_ctx;
+	AVCodecContext *ctx;
+	int video = av_find_best_stream(ic, AVMEDIA_TYPE_VIDEO,
+		input->stream_indexs[AVMEDIA_TYPE_VIDEO], -1, NULL, 0);
+	int audio = av_find_best_stream(ic, AVMEDIA_TYPE_AUDIO,
+		input->stream_indexs[AVMEDIA_TYPE_AUDIO], -1, NULL, 0);
+	if (video < 0 && audio < 0)
+		return FALSE;
+	if (video >= 0) {
+		ctx = ic->streams[video]->codec;
+		if (ctx->width <= 0 || ctx->height <= 0
+				|| ctx->pix_fmt == AV_PIX_FMT_NONE)
+			return FALSE;
+	}
+	if (audio >= 0) {
+		ctx = ic->streams[audio]->codec;
+		if (ctx->sample_rate <= 0 || ctx->channels <= 0
+				|| ctx->sample_fmt == AV_SAMPLE_FMT_NONE)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ * fast_start probes with tight limits and without counting frames for frame
+ * rate, probing continues with default limits when it was not enough.
+ */
+static int player_find_stream_info(Player *player, PlayerInput *input) {
+	AVFormatContext *ic = input->format_ctx;
+	unsigned int probesize = ic->probesize;
+	int max_analyze_duration = ic->max_analyze_duration;
+	int fps_probe_size = ic->fps_probe_size;
+	int64_t start = av_gettime();
+	char *stream_info_path = NULL;
+	int err;
+
+	if (input->cache_key != NULL) {
+		stream_info_path = player_cache_path(player, "streaminfo",
+				input->cache_key);
+		if (stream_info_path == NULL)
+			return AVERROR(ENOMEM);
+		if (stream_info_cache_load(ic, stream_info_path,
+				input->cache_key) >= 0) {
+			LOGI(3, "player_find_stream_info loaded from: %s", stream_info_path);
+			input->stream_info_cached = TRUE;
+			err = 0;
+			goto end;
+		}
+	}
+
+	if (player->fast_start) {
+		ic->probesize = FAST_START_PROBESIZE;
+		ic->max_analyze_duration = FAST_START_MAX_ANALYZE_DURATION;
+		ic->fps_probe_size = 0;
+		err = avformat_find_stream_info(ic, NULL);
+		ic->probesize = probesize;
+		ic->max_analyze_duration = max_analyze_duration;
+		ic->fps_probe_size = fps_probe_size;
+		if (err >= 0 && player_stream_info_complete(input))
+			goto save;
+		LOGI(2, "player_find_stream_info fast start incomplete, probing fully");
+		input->probe_fallback = TRUE;
+	}
+	err = avformat_find_stream_info(ic, NULL);
+save:
+	// incomplete info would be incomplete on every open
+	if (err >= 0 && stream_info_path != NULL
+			&& player_stream_info_complete(input))
+		stream_info_cache_save(ic, stream_info_path, input->cache_key);
+end:
+	av_free(stream_info_path);
+	input->probe_time_us = av_gettime() - start;
+	return err;
+}
+
+/*
+ * Opens input and everything needed to demux and decode it, output (audio
+ * track, rgb frames, threads) is not touched.
+ */
+static int player_open_source(Player *player, PlayerInput *input,
+		const char *file_path, AVDictionary *dictionary,
+		AVIOInterruptCB *interrupt_cb, int64_t *open_time) {
+	AVFormatContext *ic;
+	int st_index[AVMEDIA_TYPE_NB];
+	int i, err;
+
+	memset(st_index, -1, sizeof(st_index));
+	input->probe_time_us = 0;
+	input->probe_fallback = FALSE;
+	input->stream_info_cached = FALSE;
+
+	if ((err = player_open_input(input, file_path, dictionary, interrupt_cb,
+			open_time)) < 0)
+		return err;
+
+	if ((err = player_alloc_cache_key(player, input, file_path)) < 0)
+		return err;
+
+	err = player_find_stream_info(player, input);
+	if (err < 0) {
+		LOGE(1, "Could not open stream\n");
+		return -ERROR_COULD_NOT_OPEN_STREAM;
+	}
+
+	ic = input->format_ctx;
+
+	//TODO: check more AVIO_SEEKABLE_XXX
+	if (ic->pb)
+		input->streaming_type = !!(ic->pb->seekable & AVIO_SEEKABLE_NORMAL);
+
+	for (i=0; i<ic->nb_streams; i++) {
+		ic->streams[i]->discard = AVDISCARD_ALL;
+	}
+	st_index[AVMEDIA_TYPE_VIDEO] = av_find_best_stream(ic, AVMEDIA_TYPE_VIDEO,
+		input->stream_indexs[AVMEDIA_TYPE_VIDEO], -1, NULL, 0);
+	st_index[AVMEDIA_TYPE_AUDIO] = av_find_best_stream(ic, AVMEDIA_TYPE_AUDIO,
+		input->stream_indexs[AVMEDIA_TYPE_AUDIO], -1, NULL, 0);
+
+	if (st_index[AVMEDIA_TYPE_AUDIO] >= 0) {
+        AVCodecContext *avctx = ic->streams[st_index[AVMEDIA_TYPE_AUDIO]]->codec;
+        if (avctx->sample_rate > 0 && avctx->channels > 0) {
+	        LOGI(3, "player_open_source open audio");
+		    err = stream_component_open(player, input, st_index[AVMEDIA_TYPE_AUDIO]);
+		    if (err < 0)
+			    return err;
+        } else {
+	        LOGI(3, "player_open_source: audio sample rate or channels are not recognized");
+            // Note: we try to ignore the un-recognized audio stream
+            input->stream_indexs[AVMEDIA_TYPE_AUDIO] = -1;
+        }
+	}
+	if (st_index[AVMEDIA_TYPE_VIDEO] >= 0) {
+		err = stream_component_open(player, input, st_index[AVMEDIA_TYPE_VIDEO]);
+		if (err < 0)
+			return err;
+	}
+
+	if ((err = player_alloc_frames(input)) < 0)
+		return err;
+
+	if ((err = player_alloc_keyframe_index(player, input)) < 0)
+		return err;
+
+	if ((err = player_alloc_queues(player, input)) < 0)
+		return err;
+
+	player_get_video_duration(input);
+	return ERROR_NO_ERROR;
+}
+
+/*
+ * Creates output for player->input and starts threads.
+ */
+static int player_start_output(State *state) {
+	Player *player = state->player;
+	int err;
+
+	if (player->input.input_codec_ctxs[AVMEDIA_TYPE_AUDIO]) {
+		if ((err = player_create_audio_track(player, state)) < 0)
+			return err;
+	}
+	if (player->input.input_codec_ctxs[AVMEDIA_TYPE_VIDEO]) {
+		if ((err = player_prepare_video_frames(player)) < 0)
+			return err;
+	}
+
+	player->last_updated_time = -1;
+	player_update_time(state, 0.0);
+
+	player_play_prepare(player);
+
+	return player_create_decoding_threads(player);
+}
+
 static int player_set_data_source(State *state, const char *file_path,
 		AVDictionary *dictionary, int video_index, int audio_index,
 		int subtitle_index) {
 	Player *player = state->player;
-	AVFormatContext *ic;
-	int st_index[AVMEDIA_TYPE_NB];
-	int i, err = ERROR_NO_ERROR;
+	AVIOInterruptCB interrupt_cb = { decoder_interrupt_cb, player };
+	int err = ERROR_NO_ERROR;
 
 	pthread_mutex_lock(&player->mutex_operation);
 
@@ -1511,112 +2924,235 @@ static int player_set_data_source(State *state, const char *file_path,
 	player->out_format = AV_PIX_FMT_RGB565;
 	player->pause = TRUE;
 	player->audio_pause_time = player->audio_resume_time = av_gettime();
-	memset(player->stream_indexs, -1, sizeof(player->stream_indexs));
+	memset(player->input.stream_indexs, -1, sizeof(player->input.stream_indexs));
+
+	player->input.stream_indexs[AVMEDIA_TYPE_VIDEO   ] = video_index;
+	player->input.stream_indexs[AVMEDIA_TYPE_AUDIO   ] = audio_index;
+	player->input.stream_indexs[AVMEDIA_TYPE_SUBTITLE] = subtitle_index;
+	player->open_start_time = av_gettime();
+	player->time_to_first_frame_us = 0;
+	decode_governor_reset(player->decode_governor, av_gettime(), FALSE);
+
+	player_read_options(player, &dictionary);
+
+	// video_frames_queue is kept between data sources, frames of the
+	// previous one become stale and renderer drops them
+	pthread_mutex_lock(&player->mutex_queue);
+	player->serial = ++player->last_serial;
+	player_signal_control(player);
+	pthread_mutex_unlock(&player->mutex_queue);
+
+	if ((err = player_open_source(player, &player->input, file_path,
+			dictionary, &interrupt_cb, &player->open_time)) < 0)
+		goto error;
+	player->input.serial = player->serial;
+
+	update_external_clock_pts(player, av_gettime() / (double) AV_NOPTS_VALUE);
+	update_external_clock_speed(player, 1.0);
+	player->video_current_pts_drift = -av_gettime() / 1000000.0;
+
+	if ((err = player_start_output(state)) < 0)
+		goto error;
+
+	player->playing = TRUE;
+	LOGI(3, "player_set_data_source success");
+	pthread_mutex_unlock(&player->mutex_operation);
+	return err;
 
-	player->stream_indexs[AVMEDIA_TYPE_VIDEO   ] = video_index;
-	player->stream_indexs[AVMEDIA_TYPE_AUDIO   ] = audio_index;
-	player->stream_indexs[AVMEDIA_TYPE_SUBTITLE] = subtitle_index;
-	memset(st_index, -1, sizeof(st_index));
+error:
+	LOGI(3, "player_set_data_source error");
 
-	if ((err = player_open_input(player, file_path, dictionary)) < 0)
-		goto error;
+	player_free_playback(state);
+	pthread_mutex_unlock(&player->mutex_operation);
+	return err;
+}
 
-	err = avformat_find_stream_info(player->format_ctx, NULL);
-	if (err < 0) {
-		LOGE(1, "Could not open stream\n");
-		err = -ERROR_COULD_NOT_OPEN_STREAM;
-		goto error;
+/*
+ * Next input can be played by running threads and output when it has the
+ * same kinds of streams with the same frame size and audio format.
+ */
+static int player_input_gapless(Player *player, PlayerInput *input) {
+	AVCodecContext *ctx, *next_ctx;
+	int i;
+	for (i = 0; i < AVMEDIA_TYPE_NB; ++i) {
+		if (!player->input.input_codec_ctxs[i] != !input->input_codec_ctxs[i])
+			return FALSE;
 	}
+	ctx = player->input.input_codec_ctxs[AVMEDIA_TYPE_VIDEO];
+	next_ctx = input->input_codec_ctxs[AVMEDIA_TYPE_VIDEO];
+	if (ctx != NULL && (ctx->width != next_ctx->width
+			|| ctx->height != next_ctx->height))
+		return FALSE;
+	ctx = player->input.input_codec_ctxs[AVMEDIA_TYPE_AUDIO];
+	next_ctx = input->input_codec_ctxs[AVMEDIA_TYPE_AUDIO];
+	if (ctx != NULL && (ctx->sample_rate != next_ctx->sample_rate
+			|| ctx->channels != next_ctx->channels))
+		return FALSE;
+	return TRUE;
+}
 
-	ic = player->format_ctx;
+static QueueCheckFuncRet player_prefill_next_check(Queue *queue,
+		Player *player, int *ret) {
+	if (player->stop || player->next_abort)
+		return QUEUE_CHECK_FUNC_RET_SKIP;
+	return QUEUE_CHECK_FUNC_RET_TEST;
+}
 
-	//TODO: check more AVIO_SEEKABLE_XXX
-	if (ic->pb)
-		player->streaming_type = !!(ic->pb->seekable & AVIO_SEEKABLE_NORMAL);
+/*
+ * Reads packets of next input until any of its queues gets above
+ * buffering_high_ms, so the switch does not wait for network.
+ */
+static int player_prefill_next(Player *player, PlayerInput *input) {
+	AVPacket packet, *pkt = &packet;
+	PacketData *packet_data;
+	Queue *queue;
+	int i, to_write, interrupt_ret, ret;
 
-	for (i=0; i<ic->nb_streams; i++) {
-		ic->streams[i]->discard = AVDISCARD_ALL;
+	for (;;) {
+		for (i = 0; i < AVMEDIA_TYPE_NB; ++i) {
+			if (input->packets_queue[i] != NULL
+					&& queue_get_watermark(input->packets_queue[i])
+							== QUEUE_WATERMARK_ABOVE_HIGH)
+				return ERROR_NO_ERROR;
+		}
+		if (player->next_abort)
+			return ERROR_NO_ERROR;
+		ret = av_read_frame(input->format_ctx, pkt);
+		// current input is playing so there is no hurry
+		if (ret == AVERROR(EAGAIN)) {
+			usleep(READ_EAGAIN_MAX_BACKOFF_MS * 1000);
+			continue;
+		}
+		// the rest is read by read thread
+		if (ret < 0)
+			return ERROR_NO_ERROR;
+
+		queue = NULL;
+		for (i = 0; i < AVMEDIA_TYPE_NB; ++i) {
+			if (pkt->stream_index == input->stream_indexs[i]) {
+				queue = input->packets_queue[i];
+				break;
+			}
+		}
+		if (queue == NULL) {
+			av_free_packet(pkt);
+			continue;
+		}
+		if (input->keyframe_index != NULL
+				&& pkt->stream_index == input->keyframe_index_stream)
+			player_index_keyframe(input, pkt);
+
+		if (queue_push_start_many(queue, &player->mutex_queue,
+				(void **) &packet_data, 1, &to_write,
+				(QueueCheckFunc) player_prefill_next_check, player,
+				(void **) &interrupt_ret) == 0) {
+			av_free_packet(pkt);
+			return ERROR_NO_ERROR;
+		}
+		packet_data->type = QUEUE_ENTRY_DATA;
+		packet_data->serial = input->serial;
+		if (player_take_packet(player, packet_data, pkt) < 0) {
+			queue_push_finish_many(queue, &player->mutex_queue, to_write, 1, 0);
+			return -ERROR_WHILE_DUPLICATING_FRAME;
+		}
+		queue_push_finish_many(queue, &player->mutex_queue, to_write, 1, 1);
 	}
-	st_index[AVMEDIA_TYPE_VIDEO] = av_find_best_stream(ic, AVMEDIA_TYPE_VIDEO,
-		player->stream_indexs[AVMEDIA_TYPE_VIDEO], -1, NULL, 0);
-	st_index[AVMEDIA_TYPE_AUDIO] = av_find_best_stream(ic, AVMEDIA_TYPE_AUDIO,
-		player->stream_indexs[AVMEDIA_TYPE_AUDIO], -1, NULL, 0);
+}
 
-	if (st_index[AVMEDIA_TYPE_AUDIO] >= 0) {
-        AVCodecContext *avctx = ic->streams[st_index[AVMEDIA_TYPE_AUDIO]]->codec;
-        if (avctx->sample_rate > 0 && avctx->channels > 0) {
-	        LOGI(3, "player_set_data_source open audio");
-		    err = stream_component_open(player, st_index[AVMEDIA_TYPE_AUDIO]);
-		    if (err < 0)
-			    goto error;
+/*
+ * Opens file_path while current input plays, every playback option of
+ * setDataSource is reused. Prepared input replaces previously prepared one.
+ */
+static int player_prepare_next(State *state, const char *file_path,
+		AVDictionary *dictionary) {
+	Player *player = state->player;
+	AVIOInterruptCB interrupt_cb = { player_next_interrupt_cb, player };
+	PlayerInput *input = NULL, *old_input;
+	int err;
 
-		    err = player_create_audio_track(player, state);
-		    if (err < 0)
-			   goto error;
-        } else {
-	        LOGI(3, "player_set_data_source: audio sample rate or channels are not recognized");
-            // Note: we try to ignore the un-recognized audio stream
-            player->stream_indexs[AVMEDIA_TYPE_AUDIO] = -1;
-        }
+	pthread_mutex_lock(&player->mutex_operation);
+	if (!player->playing) {
+		pthread_mutex_unlock(&player->mutex_operation);
+		return -ERROR_NOT_PLAYING;
 	}
-	if (st_index[AVMEDIA_TYPE_VIDEO] >= 0) {
-		err = stream_component_open(player, st_index[AVMEDIA_TYPE_VIDEO]);
-		if (err < 0)
-			goto error;
-		DecoderState video_decoder_state = { player->video_index, AVMEDIA_TYPE_VIDEO, player, state->env, state->thiz };
-		err = player_prepare_rgb_frames(&video_decoder_state, state);
-		if (err < 0)
-			goto error;
-		if ((err = player_preapre_sws_context(player)) < 0)
-			goto error;
+	pthread_mutex_lock(&player->mutex_queue);
+	if (player->next_preparing) {
+		pthread_mutex_unlock(&player->mutex_queue);
+		pthread_mutex_unlock(&player->mutex_operation);
+		return -ERROR_ALREADY_PREPARING_NEXT;
 	}
+	old_input = player->next_input;
+	player->next_input = NULL;
+	player->next_preparing = TRUE;
+	player->next_abort = FALSE;
+	pthread_mutex_unlock(&player->mutex_queue);
+	// player_free_playback waits for next_preparing so current input stays
+	// open until we are done
+	pthread_mutex_unlock(&player->mutex_operation);
 
-	if ((err = player_alloc_frames(player)) < 0)
-		goto error;
-
-	if ((err = player_alloc_queues(state)) < 0)
-		goto error;
+	if (old_input != NULL)
+		player_free_prepared_input(player, old_input);
 
-	player_get_video_duration(player);
-	player_update_time(state, 0.0);
+	input = av_mallocz(sizeof(PlayerInput));
+	if (input == NULL) {
+		err = -ERROR_COULD_NOT_ALLOCATE_MEMORY;
+		goto end;
+	}
+	memset(input->stream_indexs, -1, sizeof(input->stream_indexs));
+	input->video_index = input->audio_index = -1;
+	pthread_mutex_lock(&player->mutex_queue);
+	input->serial = ++player->last_serial;
+	pthread_mutex_unlock(&player->mutex_queue);
 
-	player_play_prepare(player);
+	if ((err = player_open_source(player, input, file_path, dictionary,
+			&interrupt_cb, &player->next_open_time)) < 0)
+		goto end;
 
-	if ((err = player_create_decoding_threads(player)) < 0) {
-		goto error;
+	input->gapless = player_input_gapless(player, input);
+	if (input->gapless) {
+		if (input->input_codec_ctxs[AVMEDIA_TYPE_AUDIO]
+				&& (err = player_alloc_swr_context(player, input)) < 0)
+			goto end;
 	}
+	LOGI(3, "player_prepare_next opened: %s, gapless: %d", file_path,
+			input->gapless);
 
-	player->playing = TRUE;
-	LOGI(3, "player_set_data_source success");
-	pthread_mutex_unlock(&player->mutex_operation);
-	return err;
-
-error:
-	LOGI(3, "player_set_data_source error");
+	err = player_prefill_next(player, input);
 
-	player_signal_stop(player);
-	player_free_decoding_threads(player);
-	player_free_audio_track(player, state);
-	player_free_sws_context(player);
-	player_free_queues(state);
-	player_free_frames(player);
-	player_free_streams(player);
-	player_free_input(player);
-	pthread_mutex_unlock(&player->mutex_operation);
+end:
+	pthread_mutex_lock(&player->mutex_queue);
+	player->next_preparing = FALSE;
+	if (err >= 0 && player->next_abort)
+		err = -ERROR_NO_NEXT_DATA_SOURCE;
+	if (err >= 0) {
+		player->next_input = input;
+		input = NULL;
+	}
+	player_signal_control(player);
+	pthread_mutex_unlock(&player->mutex_queue);
+	if (input != NULL)
+		player_free_prepared_input(player, input);
 	return err;
 }
 
+/*
+ * Frees input prepared by player_prepare_next or swapped out of player.
+ */
+static void player_free_prepared_input(Player *player, PlayerInput *input) {
+	player_free_queues(player, input);
+	player_free_frames(input);
+	swr_free(&input->swr_context);
+	player_free_streams(input);
+	player_free_input(input);
+	av_free(input);
+}
+
 static QueueCheckFuncRet player_render_frame_check(Queue *queue, Player *player, int *check_ret_data) {
 	if (player->interrupt_renderer) {
 		*check_ret_data = RENDER_CHECK_MSG_INTERRUPT;
 		LOGI(6, "player_render_frame_check: interrupt_renderer")
 		return QUEUE_CHECK_FUNC_RET_SKIP;
 	}
-	if (player->flush_video_play) {
-		LOGI(6, "player_render_frame_check: flush_video_play");
-		*check_ret_data = RENDER_CHECK_MSG_FLUSH;
-		return QUEUE_CHECK_FUNC_RET_SKIP;
-	}
 	if (player->pause) {
 		LOGI(6, "player_render_frame_check: pause")
 		return QUEUE_CHECK_FUNC_RET_WAIT;
@@ -1646,7 +3182,7 @@ void jni_player_seek(JNIEnv *env, jobject thiz, jint position) {
 	}
 	pthread_mutex_lock(&player->mutex_queue);
 	player->seek_position = position;
-	pthread_cond_broadcast(&player->cond_queue);
+	player_signal_control(player);
 
 	while (player->seek_position != DO_NOT_SEEK)
 		pthread_cond_wait(&player->cond_queue, &player->mutex_queue);
@@ -1671,16 +3207,11 @@ void jni_player_pause(JNIEnv *env, jobject thiz) {
 	if (player->pause)
 		goto do_nothing;
 	LOGI(3, "jni_player_pause Pausing");
-	update_external_clock_pts(player, get_external_clock(player));
+	if (!player->buffering)
+		player_clocks_stop(player, env);
 	player->pause = TRUE;
 
-	if (player->audio_track) {
-		(*env)->CallVoidMethod(env, player->audio_track, player->audio_track_pause);
-	}
-
-	player->audio_pause_time = av_gettime();
-
-	pthread_cond_broadcast(&player->cond_queue);
+	player_signal_control(player);
 
 do_nothing:
 	pthread_mutex_unlock(&player->mutex_queue);
@@ -1703,21 +3234,10 @@ void jni_player_resume(JNIEnv *env, jobject thiz) {
 	if (!player->pause)
 		goto do_nothing;
 	player->pause = FALSE;
+	if (!player->buffering)
+		player_clocks_start(player, env);
 
-	if (player->audio_track) {
-		(*env)->CallVoidMethod(env, player->audio_track, player->audio_track_play);
-	}
-
-	player->audio_resume_time = av_gettime();
-	if (player->audio_write_time < player->audio_pause_time) {
-		player->audio_write_time = player->audio_resume_time;
-	} else if (player->audio_write_time < player->audio_resume_time) {
-		player->audio_write_time += player->audio_resume_time - player->audio_pause_time;
-	}
-	player->video_current_pts_drift = player->video_current_pts - av_gettime() / 1000000.0;
-	update_external_clock_pts(player, get_external_clock(player));
-
-	pthread_cond_broadcast(&player->cond_queue);
+	player_signal_control(player);
 
 do_nothing:
 	pthread_mutex_unlock(&player->mutex_queue);
@@ -1793,6 +3313,88 @@ int jni_player_set_data_source(JNIEnv *env, jobject thiz, jstring string,
 	return ret;
 }
 
+int jni_player_prepare_next(JNIEnv *env, jobject thiz, jstring string,
+		jobject dictionary) {
+	AVDictionary *dict = NULL;
+	if (dictionary != NULL) {
+		jni_player_read_dictionary(env, &dict, dictionary);
+		(*env)->DeleteLocalRef(env, dictionary);
+	}
+
+	const char *file_path = (*env)->GetStringUTFChars(env, string, NULL);
+	Player *player = player_get_player_field(env, thiz);
+	State state = { player, env, thiz };
+
+	int ret = player_prepare_next(&state, file_path, dict);
+
+	(*env)->ReleaseStringUTFChars(env, string, file_path);
+	return ret;
+}
+
+/*
+ * Gapless input is swapped in by read thread, otherwise output is
+ * recreated for next input.
+ */
+int jni_player_play_next(JNIEnv *env, jobject thiz) {
+	Player *player = player_get_player_field(env, thiz);
+	State state = { player, env, thiz };
+	PlayerInput *input;
+	int pause, err = ERROR_NO_ERROR;
+
+	pthread_mutex_lock(&player->mutex_operation);
+	if (!player->playing) {
+		err = -ERROR_NOT_PLAYING;
+		goto end;
+	}
+	pthread_mutex_lock(&player->mutex_queue);
+	input = player->next_input;
+	if (input == NULL) {
+		pthread_mutex_unlock(&player->mutex_queue);
+		err = -ERROR_NO_NEXT_DATA_SOURCE;
+		goto end;
+	}
+	if (input->gapless) {
+		// onNextDataSourceStarted is called by read thread
+		player->seek_position = SEEK_TO_NEXT_INPUT;
+		player_signal_control(player);
+		while (player->seek_position == SEEK_TO_NEXT_INPUT && !player->stop)
+			pthread_cond_wait(&player->cond_queue, &player->mutex_queue);
+		pthread_mutex_unlock(&player->mutex_queue);
+		goto end;
+	}
+	player->next_input = NULL;
+	pthread_mutex_unlock(&player->mutex_queue);
+
+	LOGI(3, "jni_player_play_next restarting output");
+	pause = player->pause;
+	player_free_playback(&state);
+	player->input = *input;
+	av_free(input);
+	player->input.format_ctx->interrupt_callback.callback = decoder_interrupt_cb;
+	player->serial = player->input.serial;
+	player->pause = TRUE;
+	player->audio_pause_time = player->audio_resume_time = av_gettime();
+	update_external_clock_pts(player, av_gettime() / (double) AV_NOPTS_VALUE);
+	update_external_clock_speed(player, 1.0);
+	player->video_current_pts_drift = -av_gettime() / 1000000.0;
+	if ((err = player_start_output(&state)) < 0) {
+		player_free_playback(&state);
+		player->playing = FALSE;
+		goto end;
+	}
+	if (!pause) {
+		pthread_mutex_lock(&player->mutex_queue);
+		player->pause = FALSE;
+		player_clocks_start(player, env);
+		player_signal_control(player);
+		pthread_mutex_unlock(&player->mutex_queue);
+	}
+	(*env)->CallVoidMethod(env, thiz, player->onNextDataSourceStarted);
+end:
+	pthread_mutex_unlock(&player->mutex_operation);
+	return err;
+}
+
 void jni_player_dealloc(JNIEnv *env, jobject thiz) {
 	LOGI(1, "jni_player_dealloc");
 	Player *player = player_get_player_field(env, thiz);
@@ -1804,23 +3406,35 @@ void jni_player_dealloc(JNIEnv *env, jobject thiz) {
 		LOGI(1, "jni_player_dealloc: waiting render stop...");
 		usleep(10);
 	}
-	State state = { player, env, thiz };
-	if (player->rgb_video_queue != NULL) {
+	if (player->video_frames_queue != NULL) {
 		LOGI(7, "player_set_data_source free_video_frames_queue");
-		queue_free(player->rgb_video_queue, &player->mutex_queue, &player->cond_queue, &state);
-		player->rgb_video_queue = NULL;
+		queue_free(player->video_frames_queue, &player->mutex_queue, player);
+		player->video_frames_queue = NULL;
 		LOGI(7, "player_set_data_source fried_video_frames_queue");
 	}
+	if (player->rgb_frame != NULL) {
+		player_free_video_rgb_frame(player, player->rgb_frame);
+		player->rgb_frame = NULL;
+	}
+	if (player->sws_context != NULL) {
+		sws_freeContext(player->sws_context);
+		player->sws_context = NULL;
+	}
 	pthread_mutex_unlock(&player->mutex_operation);
 	LOGI(1, "jni_player_dealloc: render stopped...");
 	pthread_mutex_destroy(&player->mutex_operation);
 	pthread_mutex_destroy(&player->mutex_queue);
 	pthread_cond_destroy(&player->cond_queue);
+	(*env)->DeleteGlobalRef(env, player->thiz);
+	packet_pool_free(player->packet_pool);
+	decode_governor_free(player->decode_governor);
+	frame_pool_free(player->frame_pool);
+	av_freep(&player->cache_dir);
 	free(player);
 	LOGI(1, "jni_player_dealloc: bye bye");
 }
 
-int jni_player_init(JNIEnv *env, jobject thiz) {
+int jni_player_init(JNIEnv *env, jobject thiz, jint cpu_count) {
 #ifdef PROFILER
 #warning "Profiler enabled"
 	setenv("CPUPROFILE_FREQUENCY", "1000", 1);
@@ -1830,11 +3444,11 @@ int jni_player_init(JNIEnv *env, jobject thiz) {
 	LOGI(1, "jni_player_init");
 	Player *player = malloc(sizeof(Player));
 	memset(player, 0, sizeof(Player));
-	player->audio_index = -1;
-	player->video_index = -1;
+	player->input.audio_index = -1;
+	player->input.video_index = -1;
 	player->rendering = FALSE;
-	player->thiz = thiz;
 	player->last_audio_clock = 0;
+	player->cpu_count = cpu_count;
 
 	int err = ERROR_NO_ERROR;
 
@@ -1881,6 +3495,27 @@ int jni_player_init(JNIEnv *env, jobject thiz) {
 			err = ERROR_NOT_FOUND_PREPARE_AUDIO_TRACK_METHOD;
 			goto free_player;
 		}
+
+		player->onBuffering = java_get_method(env,
+				player_class, player_onBuffering);
+		if (player->onBuffering == NULL) {
+			err = ERROR_NOT_FOUND_ON_BUFFERING_METHOD;
+			goto free_player;
+		}
+
+		player->onNextDataSourceStarted = java_get_method(env,
+				player_class, player_onNextDataSourceStarted);
+		if (player->onNextDataSourceStarted == NULL) {
+			err = ERROR_NOT_FOUND_ON_NEXT_DATA_SOURCE_STARTED_METHOD;
+			goto free_player;
+		}
+
+		player->onDegradation = java_get_method(env,
+				player_class, player_onDegradation);
+		if (player->onDegradation == NULL) {
+			err = ERROR_NOT_FOUND_ON_DEGRADATION_METHOD;
+			goto free_player;
+		}
 		(*env)->DeleteLocalRef(env, player_class);
 	}
 
@@ -1950,6 +3585,31 @@ int jni_player_init(JNIEnv *env, jobject thiz) {
 		goto delete_audio_track_global_ref;
 	}
 
+	// used by decoding threads and by queues fill/free functions
+	player->thiz = (*env)->NewGlobalRef(env, thiz);
+	if (player->thiz == NULL) {
+		err = ERROR_COULD_NOT_CREATE_GLOBAL_REF_FOR_PLAYER;
+		goto delete_audio_track_global_ref;
+	}
+
+	player->packet_pool = packet_pool_init();
+	if (player->packet_pool == NULL) {
+		err = ERROR_COULD_NOT_ALLOCATE_MEMORY;
+		goto delete_player_global_ref;
+	}
+
+	player->decode_governor = decode_governor_init();
+	if (player->decode_governor == NULL) {
+		err = ERROR_COULD_NOT_ALLOCATE_MEMORY;
+		goto free_packet_pool;
+	}
+
+	player->frame_pool = frame_pool_init();
+	if (player->frame_pool == NULL) {
+		err = ERROR_COULD_NOT_ALLOCATE_MEMORY;
+		goto free_decode_governor;
+	}
+
 	pthread_mutex_init(&player->mutex_operation, NULL);
 	pthread_mutex_init(&player->mutex_queue, NULL);
 	pthread_cond_init(&player->cond_queue, NULL);
@@ -1957,8 +3617,13 @@ int jni_player_init(JNIEnv *env, jobject thiz) {
 	player->playing = FALSE;
 	player->pause = FALSE;
 	player->stop = FALSE;
-	player->flush_video_play = FALSE;
-	player->streaming_type = FALSE;
+	player->serial = 0;
+	player->packets_bytes_moved = 0;
+	player->packets_bytes_copied = 0;
+	player->read_eagains = 0;
+	player->frames_late = 0;
+	player->frames_dropped = 0;
+	player->input.streaming_type = FALSE;
 
 	av_log_set_level(AV_LOG_WARNING);
 	avformat_network_init();
@@ -1969,9 +3634,16 @@ int jni_player_init(JNIEnv *env, jobject thiz) {
 #ifdef MODULE_ENCRYPT
 	register_aes_protocol();
 #endif
+	register_cache_protocol();
 
 	goto end;
 
+free_decode_governor:
+	decode_governor_free(player->decode_governor);
+free_packet_pool:
+	packet_pool_free(player->packet_pool);
+delete_player_global_ref:
+	(*env)->DeleteGlobalRef(env, player->thiz);
 delete_audio_track_global_ref:
 	(*env)->DeleteGlobalRef(env, player->audio_track_class);
 free_player:
@@ -1987,7 +3659,7 @@ void jni_player_render_frame_start(JNIEnv *env, jobject thiz) {
 	player->rendering = TRUE;
 	LOGI(7, "jni_player_render_frame_start")
 	player->interrupt_renderer = FALSE;
-	pthread_cond_broadcast(&player->cond_queue);
+	player_signal_control(player);
 	pthread_mutex_unlock(&player->mutex_queue);
 }
 
@@ -1998,18 +3670,92 @@ void jni_player_render_frame_stop(JNIEnv *env, jobject thiz) {
 	player->rendering = FALSE;
 	LOGI(7, "jni_player_render_frame_stop")
 	player->interrupt_renderer = TRUE;
-	pthread_cond_broadcast(&player->cond_queue);
+	player_signal_control(player);
 	pthread_mutex_unlock(&player->mutex_queue);
 }
 
+/*
+ * Convert frame chosen by renderer to player->rgb_frame bitmap, bitmap is
+ * created again when frame size changes. Called without mutex_queue held.
+ */
+static int player_convert_video_frame(Player *player, JNIEnv *env,
+		VideoFrameElem *elem) {
+	VideoRGBFrameElem *rgb_frame = player->rgb_frame;
+	AVFrame *frame = elem->frame;
+	void *buffer;
+	int ret;
+	int err = 0;
+
+	if (rgb_frame != NULL && (rgb_frame->width != elem->width
+			|| rgb_frame->height != elem->height)) {
+		player_free_video_rgb_frame(player, rgb_frame);
+		player->rgb_frame = rgb_frame = NULL;
+	}
+	if (rgb_frame == NULL) {
+		rgb_frame = player_alloc_video_rgb_frame(player, env, elem->width,
+				elem->height);
+		if (rgb_frame == NULL)
+			return -ERROR_COULD_NOT_PREPARE_RGB_QUEUE;
+		player->rgb_frame = rgb_frame;
+	}
+
+	if ((ret = AndroidBitmap_lockPixels(env, rgb_frame->jbitmap, &buffer)) < 0) {
+		LOGE(1, "AndroidBitmap_lockPixels() failed ! error=%d", ret);
+		return -ERROR_WHILE_LOCING_BITMAP;
+	}
+
+	avpicture_fill((AVPicture *) rgb_frame->frame, buffer, player->out_format,
+			elem->width, elem->height);
+
+	LOGI(7, "player_convert_video_frame copying...");
+#ifdef YUV2RGB
+	if (elem->format == AV_PIX_FMT_YUV420P) {
+		LOGI(9, "Using yuv420_2_rgb565");
+		yuv420_2_rgb565(rgb_frame->frame->data[0], frame->data[0],
+			frame->data[1], frame->data[2], elem->width, elem->height,
+			frame->linesize[0], frame->linesize[1], elem->width << 1,
+			yuv2rgb565_table, player->dither++);
+	} else if (elem->format == AV_PIX_FMT_NV12) {
+		LOGI(9, "Using nv12_2_rgb565");
+		nv12_2_rgb565(rgb_frame->frame->data[0], frame->data[0],
+			frame->data[1], frame->data[1]+1, elem->width, elem->height,
+			frame->linesize[0], frame->linesize[1], elem->width << 1,
+			yuv2rgb565_table, player->dither++);
+	} else
+#endif
+	{
+		LOGI(9, "Using sws_scale");
+		player->sws_context = sws_getCachedContext(player->sws_context,
+				elem->width, elem->height, elem->format,
+				elem->width, elem->height, player->out_format,
+				SWS_BICUBIC, NULL, NULL, NULL);
+		if (player->sws_context == NULL) {
+			LOGE(1, "could not initialize conversion context from: %d"
+					", to :%d\n", elem->format, player->out_format);
+			err = -ERROR_COULD_NOT_GET_SWS_CONTEXT;
+			goto unlock_bitmap;
+		}
+		sws_scale(player->sws_context,
+				(const uint8_t * const *) frame->data,
+				frame->linesize, 0, elem->height,
+				rgb_frame->frame->data, rgb_frame->frame->linesize);
+	}
+
+unlock_bitmap:
+	AndroidBitmap_unlockPixels(env, rgb_frame->jbitmap);
+	return err;
+}
+
 jobject jni_player_render_frame(JNIEnv *env, jobject thiz) {
 	Player *player = player_get_player_field(env, thiz);
 	State state = { player, env, thiz };
 	int interrupt_ret;
-	VideoRGBFrameElem *elem;
+	int err;
+	int64_t start;
+	VideoFrameElem *elem;
 
 #if 0
-	if (!player->input_codec_ctxs[AVMEDIA_TYPE_VIDEO]) {
+	if (!player->input.input_codec_ctxs[AVMEDIA_TYPE_VIDEO]) {
 		player_update_time(&state, player->audio_clock);
 		usleep(MIN_SLEEP_TIME_US*5);
 		// MUST throw exception to driver next render
@@ -2029,18 +3775,18 @@ jobject jni_player_render_frame(JNIEnv *env, jobject thiz) {
 	LOGI(7, "jni_player_render_frame render wait...");
 	pthread_mutex_lock(&player->mutex_queue);
 
-	if(!player->rgb_video_queue) {
-		LOGI(1, "jni_player_render_frame: rgb_video_queue freed ...");
+	if(!player->video_frames_queue) {
+		LOGI(1, "jni_player_render_frame: video_frames_queue freed ...");
 		usleep(MIN_SLEEP_TIME_US);
 		pthread_mutex_unlock(&player->mutex_queue);
-		throw_interrupted_exception(env, "RGB video queue is NULL");
+		throw_interrupted_exception(env, "Video frames queue is NULL");
 		return NULL;
 	}
 
 pop:
 	LOGI(7, "jni_player_render_frame reading from queue");
-	elem = queue_pop_start_impl(&player->rgb_video_queue,
-			&player->mutex_queue, &player->cond_queue,
+	elem = queue_pop_start_impl(&player->video_frames_queue,
+			&player->mutex_queue,
 			(QueueCheckFunc)player_render_frame_check, player,
 			&interrupt_ret);
 	for (;;) {
@@ -2048,16 +3794,25 @@ pop:
 		if (elem == NULL) {
 			skip = TRUE;
 		} else {
-			if (elem->end_of_stream) {
+			QueueCheckFuncRet ret;
+test:
+			// frame decoded before last seek, could become stale while
+			// we are waiting for its time
+			if (elem->serial != player->serial) {
+				LOGI(4, "jni_player_render_frame dropping stale frame");
+				player_video_frame_unref(player, elem);
+				queue_pop_finish_impl(player->video_frames_queue,
+						&player->mutex_queue);
+				goto pop;
+			}
+			if (elem->type == QUEUE_ENTRY_EOS) {
 				LOGI(4, "jni_player_render_frame end of stream");
 				player_update_current_time(&state, TRUE);
-				queue_pop_finish_impl(player->rgb_video_queue,
-						&player->mutex_queue, &player->cond_queue);
+				queue_pop_finish_impl(player->video_frames_queue,
+						&player->mutex_queue);
 				goto pop;
 			}
-			QueueCheckFuncRet ret;
-test:
-			ret = player_render_frame_check(player->rgb_video_queue, player, &interrupt_ret);
+			ret = player_render_frame_check(player->video_frames_queue, player, &interrupt_ret);
 			switch (ret) {
 			case QUEUE_CHECK_FUNC_RET_WAIT:
 				LOGI(3, "jni_player_render_frame queue wait");
@@ -2066,7 +3821,7 @@ test:
 			case QUEUE_CHECK_FUNC_RET_SKIP:
 				skip = TRUE;
 				LOGI(3, "jni_player_render_frame queue skip");
-				queue_pop_finish_impl(player->rgb_video_queue, &player->mutex_queue, &player->cond_queue);
+				queue_pop_finish_impl(player->video_frames_queue, &player->mutex_queue);
 				break;
 			case QUEUE_CHECK_FUNC_RET_TEST:
 				usleep(100);
@@ -2083,16 +3838,6 @@ test:
 				usleep(MIN_SLEEP_TIME_US);
 				throw_interrupted_exception(env, "Render frame was interrupted by user");
 				return NULL;
-			} else if (interrupt_ret == RENDER_CHECK_MSG_FLUSH) {
-				LOGI(2, "jni_player_render_frame flush");
-				VideoRGBFrameElem *elem;
-				while ((elem = queue_pop_start_impl_non_block(player->rgb_video_queue)) != NULL) {
-					queue_pop_finish_impl(player->rgb_video_queue, &player->mutex_queue, &player->cond_queue);
-				}
-				LOGI(2, "jni_player_render_frame flushed");
-				player->flush_video_play = FALSE;
-				pthread_cond_broadcast(&player->cond_queue);
-				goto pop;
 			} else {
 				assert(FALSE);
 			}
@@ -2116,6 +3861,26 @@ test:
 					video_clock, sleep_time);
 		}
 
+		if (sleep_time < -player->late_frame_ms) {
+			VideoFrameElem *next = queue_pop_peek_next_impl(
+					player->video_frames_queue);
+			if (player->late_frame_drop && next != NULL
+					&& next->type == QUEUE_ENTRY_DATA
+					&& next->serial == player->serial) {
+				LOGI(4, "jni_player_render_frame dropping late frame: "
+						"%lld ms", -sleep_time);
+				player->frames_dropped += 1;
+				player_video_frame_unref(player, elem);
+				queue_pop_finish_impl(player->video_frames_queue,
+						&player->mutex_queue);
+				goto pop;
+			}
+			player->frames_late += 1;
+			break;
+		}
+
+		// frame is converted after waking up
+		sleep_time -= player->convert_us / 1000;
 		if (sleep_time <= MIN_SLEEP_TIME_MS) {
 			break;
 		}
@@ -2131,18 +3896,33 @@ test:
 		}
 		LOGI(9, "jni_player_render_frame condition occurs");
 	}
+	player_first_frame_shown(player);
 	player_update_time(&state, elem->time);
 	update_video_pts(player,elem->time);
 	pthread_mutex_unlock(&player->mutex_queue);
 
+	// element is kept until jni_player_release_frame so queue_free waits
+	// for renderer to finish with the bitmap
+	start = av_gettime();
+	err = player_convert_video_frame(player, env, elem);
+	player_video_frame_unref(player, elem);
+	player->convert_us = av_gettime() - start;
+	if (err < 0) {
+		LOGE(1, "jni_player_render_frame could not convert frame: %d", err);
+		queue_pop_finish(player->video_frames_queue, &player->mutex_queue);
+		usleep(MIN_SLEEP_TIME_US);
+		throw_interrupted_exception(env, "Could not convert frame");
+		return NULL;
+	}
+
 	LOGI(7, "jni_player_render_frame rendering...");
 
-	return elem->jbitmap;
+	return player->rgb_frame->jbitmap;
 }
 
 void jni_player_release_frame(JNIEnv *env, jobject thiz) {
 	Player *player = player_get_player_field(env, thiz);
-	queue_pop_finish(player->rgb_video_queue, &player->mutex_queue, &player->cond_queue);
+	queue_pop_finish(player->video_frames_queue, &player->mutex_queue);
 	LOGI(7, "jni_player_release_frame rendered");
 }
 
@@ -2163,11 +3943,102 @@ void jni_player_stop(JNIEnv *env, jobject thiz) {
 
 int jni_player_get_video_duration(JNIEnv *env, jobject thiz) {
 	Player *player = player_get_player_field(env, thiz);
-	return player->video_duration;
+	return player->input.video_duration;
 }
 
 //1: seekable, 0:streaming
 int jni_player_get_streaming_type(JNIEnv *env, jobject thiz) {
 	Player *player = player_get_player_field(env, thiz);
-	return player->streaming_type;
+	return player->input.streaming_type;
+}
+
+static void player_get_queue_stats(Queue *queue, jlong *out) {
+	QueueStats stats;
+	int count, bytes, duration, i;
+	if (queue == NULL)
+		return;
+	queue_get_stats(queue, &stats);
+	queue_get_usage(queue, &count, &bytes, &duration);
+	out[QUEUE_STATS_SIZE] = queue_get_size(queue);
+	out[QUEUE_STATS_COUNT] = count;
+	out[QUEUE_STATS_BYTES] = bytes;
+	out[QUEUE_STATS_DURATION_MS] = duration;
+	out[QUEUE_STATS_HIGH_WATER] = stats.high_water;
+	out[QUEUE_STATS_PUSH_WAITS] = stats.push_waits;
+	out[QUEUE_STATS_PUSH_WAIT_US] = stats.push_wait_us;
+	out[QUEUE_STATS_POP_WAITS] = stats.pop_waits;
+	out[QUEUE_STATS_POP_WAIT_US] = stats.pop_wait_us;
+	out[QUEUE_STATS_WAKEUPS] = stats.wakeups;
+	out[QUEUE_STATS_SPURIOUS_WAKEUPS] = stats.spurious_wakeups;
+	out[QUEUE_STATS_FLUSHES] = stats.flushes;
+	out[QUEUE_STATS_FLUSHED] = stats.flushed;
+	out[QUEUE_STATS_ALLOCATED] = stats.allocated;
+	for (i = 0; i < QUEUE_HISTOGRAM_BUCKETS; ++i)
+		out[QUEUE_STATS_HISTOGRAM + i] = stats.histogram[i];
+}
+
+jlongArray jni_player_get_stats(JNIEnv *env, jobject thiz) {
+	Player *player = player_get_player_field(env, thiz);
+	jlong stats[PLAYER_STATS_NB];
+	PacketPoolStats pool_stats;
+	FramePoolStats frame_pool_stats;
+	DecodeGovernorStats governor_stats;
+	jlongArray array;
+	memset(stats, 0, sizeof(stats));
+
+	// player_free_queues detaches packets queues with mutex_queue held
+	pthread_mutex_lock(&player->mutex_queue);
+	player_get_queue_stats(player->input.packets_queue[AVMEDIA_TYPE_VIDEO],
+			&stats[PLAYER_STATS_QUEUES
+					+ PLAYER_STATS_QUEUE_VIDEO_PACKETS * QUEUE_STATS_NB]);
+	player_get_queue_stats(player->input.packets_queue[AVMEDIA_TYPE_AUDIO],
+			&stats[PLAYER_STATS_QUEUES
+					+ PLAYER_STATS_QUEUE_AUDIO_PACKETS * QUEUE_STATS_NB]);
+	player_get_queue_stats(player->video_frames_queue,
+			&stats[PLAYER_STATS_QUEUES
+					+ PLAYER_STATS_QUEUE_VIDEO_FRAMES * QUEUE_STATS_NB]);
+	stats[PLAYER_STATS_FRAMES_LATE] = player->frames_late;
+	stats[PLAYER_STATS_FRAMES_DROPPED] = player->frames_dropped;
+	pthread_mutex_unlock(&player->mutex_queue);
+
+	packet_pool_get_stats(player->packet_pool, &pool_stats);
+	stats[PLAYER_STATS_PACKET_POOL + PACKET_POOL_STATS_MALLOCS] =
+			pool_stats.mallocs;
+	stats[PLAYER_STATS_PACKET_POOL + PACKET_POOL_STATS_FREES] =
+			pool_stats.frees;
+	stats[PLAYER_STATS_PACKET_POOL + PACKET_POOL_STATS_REUSES] =
+			pool_stats.reuses;
+	stats[PLAYER_STATS_PACKET_POOL + PACKET_POOL_STATS_OVERSIZED] =
+			pool_stats.oversized;
+	stats[PLAYER_STATS_PACKET_POOL + PACKET_POOL_STATS_CACHED_BYTES] =
+			pool_stats.cached_bytes;
+	stats[PLAYER_STATS_PACKETS_BYTES_MOVED] = player->packets_bytes_moved;
+	stats[PLAYER_STATS_PACKETS_BYTES_COPIED] = player->packets_bytes_copied;
+	stats[PLAYER_STATS_KEYFRAME_INDEX_ENTRIES] = player->input.keyframe_index_entries;
+	stats[PLAYER_STATS_KEYFRAME_INDEX_SEEKS] = player->input.keyframe_index_seeks;
+	stats[PLAYER_STATS_READ_EAGAINS] = player->read_eagains;
+	stats[PLAYER_STATS_PROBE_US] = player->input.probe_time_us;
+	stats[PLAYER_STATS_PROBE_FALLBACK] = player->input.probe_fallback;
+	stats[PLAYER_STATS_PROBE_CACHED] = player->input.stream_info_cached;
+	stats[PLAYER_STATS_TIME_TO_FIRST_FRAME_US] = player->time_to_first_frame_us;
+	stats[PLAYER_STATS_DECODER_THREADS] = player->input.decoder_threads;
+	decode_governor_get_stats(player->decode_governor, av_gettime(),
+			&governor_stats);
+	stats[PLAYER_STATS_DEGRADATION_LEVEL] = governor_stats.level;
+	stats[PLAYER_STATS_DEGRADATION_ESCALATIONS] = governor_stats.escalations;
+	stats[PLAYER_STATS_DEGRADATION_DEESCALATIONS] =
+			governor_stats.deescalations;
+	stats[PLAYER_STATS_DEGRADED_US] = governor_stats.degraded_us;
+
+	frame_pool_get_stats(player->frame_pool, &frame_pool_stats);
+	stats[PLAYER_STATS_FRAME_POOL_HITS] = frame_pool_stats.hits;
+	stats[PLAYER_STATS_FRAME_POOL_MISSES] = frame_pool_stats.misses;
+	stats[PLAYER_STATS_FRAME_POOL_RESIDENT_BYTES] =
+			frame_pool_stats.resident_bytes;
+
+	array = (*env)->NewLongArray(env, PLAYER_STATS_NB);
+	if (array == NULL)
+		return NULL;
+	(*env)->SetLongArrayRegion(env, array, 0, PLAYER_STATS_NB, stats);
+	return array;
 }
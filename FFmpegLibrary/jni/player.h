@@ -91,6 +91,13 @@ enum PlayerErrors {
 	ERROR_COULD_NOT_ALLOCATE_MEMORY,
 
 	ERROR_NOT_STOP_LAST_INSTANCE,
+	ERROR_NOT_FOUND_ON_NEXT_DATA_SOURCE_STARTED_METHOD,
+	ERROR_NOT_PLAYING,
+	ERROR_NO_NEXT_DATA_SOURCE,
+	ERROR_ALREADY_PREPARING_NEXT,
+	ERROR_NOT_FOUND_ON_DEGRADATION_METHOD,
+	ERROR_NOT_FOUND_ON_BUFFERING_METHOD,
+	ERROR_COULD_NOT_CREATE_GLOBAL_REF_FOR_PLAYER,
 };
 
 enum DecodeCheckMsg {
@@ -102,17 +109,20 @@ enum ReadFromStreamCheckMsg {
 };
 
 enum RenderCheckMsg {
-	RENDER_CHECK_MSG_INTERRUPT = 0, RENDER_CHECK_MSG_FLUSH,
+	RENDER_CHECK_MSG_INTERRUPT = 0,
 };
 
 // Player
-int jni_player_init(JNIEnv *env, jobject thiz);
+int jni_player_init(JNIEnv *env, jobject thiz, jint cpu_count);
 void jni_player_dealloc(JNIEnv *env, jobject thiz);
 void jni_player_seek(JNIEnv *env, jobject thiz, jint position);
 void jni_player_pause(JNIEnv *env, jobject thiz);
 void jni_player_resume(JNIEnv *env, jobject thiz);
 int jni_player_set_data_source(JNIEnv *env, jobject thiz, jstring string,
 	jobject dictionary, int video_index, int audio_index, int subtitle_index);
+int jni_player_prepare_next(JNIEnv *env, jobject thiz, jstring string,
+	jobject dictionary);
+int jni_player_play_next(JNIEnv *env, jobject thiz);
 void jni_player_stop(JNIEnv *env, jobject thiz);
 void jni_player_render_frame_start(JNIEnv *env, jobject thiz);
 void jni_player_render_frame_stop(JNIEnv *env, jobject thiz);
@@ -120,5 +130,6 @@ jobject jni_player_render_frame(JNIEnv *env, jobject thiz);
 void jni_player_release_frame (JNIEnv *env, jobject thiz);
 int jni_player_get_video_duration(JNIEnv *env, jobject thiz);
 int jni_player_get_streaming_type(JNIEnv *env, jobject thiz);
+jlongArray jni_player_get_stats(JNIEnv *env, jobject thiz);
 
 #endif
@@ -41,6 +41,9 @@ static const struct {
 static JavaField player_mNativePlayer = {"mNativePlayer", "I"};
 static JavaMethod player_onUpdateTime = {"onUpdateTime","(IIZ)V"};
 static JavaMethod player_prepareAudioTrack = {"prepareAudioTrack", "(II)Landroid/media/AudioTrack;"};
+static JavaMethod player_onBuffering = {"onBuffering", "(Z)V"};
+static JavaMethod player_onNextDataSourceStarted = {"onNextDataSourceStarted", "()V"};
+static JavaMethod player_onDegradation = {"onDegradation", "(I)V"};
 static JavaMethod player_prepareFrame = {"prepareFrame", "(II)Landroid/graphics/Bitmap;"};
 
 // AudioTrack
@@ -18,28 +18,132 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
 #include <pthread.h>
+#include <time.h>
 
+#ifdef __ANDROID__
 #include <android/log.h>
 #include <jni.h>
 
 #include "helpers.h"
+#else
+// queue does not depend on the player so it could be built and measured
+// on the host, logs go to stderr there
+#define LOGI(level, ...) do { \
+		if (level <= LOG_LEVEL) { \
+			fprintf(stderr, __VA_ARGS__); \
+			fputc('\n', stderr); \
+		} \
+	} while (0)
+#define LOGE(level, ...) LOGI(level, __VA_ARGS__)
+
+#define FALSE 0
+#define TRUE  1
+#endif
 #include "queue.h"
 
 #define LOG_LEVEL 1
 #define LOG_TAG "AVEngine:queue.c"
 
+/*
+ * Producers wait on not_full and consumers on not_empty, so a push wakes
+ * only threads waiting for data and a pop only threads waiting for space.
+ * Both conditions are signalled only when push_waiters/pop_waiters shows
+ * that somebody is actually blocked.
+ *
+ * In QUEUE_MODE_SPSC next_to_write is only stored by the producer and
+ * next_to_read only by the consumer, so both sides can publish their index
+ * without the lock. The other side takes the lock to wake a blocked thread
+ * only when the corresponding *_waiters counter is set. total_bytes and
+ * total_duration are changed by both sides so they are updated atomically.
+ *
+ * *_many variants reserve or take several contiguous slots with a single
+ * lock acquisition and a single wake up of the other side. in_read is
+ * the number of elements taken by the consumer.
+ *
+ * In QUEUE_MODE_MULTI_CONSUMER consumers claim elements at next_to_claim
+ * and mark them QUEUE_SLOT_DONE in any order. next_to_read follows the
+ * first not finished element so slots are given back to the producer in
+ * push order. in_read is the number of claimed, not finished elements.
+ *
+ * Elements are not bound to slots. They are created with fill_func when a
+ * slot is reserved and no spare element exists, and given back to the pool
+ * when the slot is released. Pool is a ring written only by the consumer
+ * and read only by the producer so it does not need a lock in
+ * QUEUE_MODE_SPSC. Producer frees surplus pool elements when usage stayed
+ * low for QUEUE_SHRINK_WINDOW pushes.
+ */
+#define queue_barrier() __sync_synchronize()
+
+/*
+ * Indices, waiter counters and totals are read by the other side without
+ * the lock. Toolchains with __atomic builtins access them as atomics so
+ * ThreadSanitizer also sees the ordering given by queue_barrier(), older
+ * ones rely on volatile and the barriers alone.
+ */
+#ifdef __ATOMIC_SEQ_CST
+#define queue_load(ptr) __atomic_load_n((ptr), __ATOMIC_SEQ_CST)
+#define queue_store(ptr, value) \
+	__atomic_store_n((ptr), (value), __ATOMIC_SEQ_CST)
+#else
+#define queue_load(ptr) (*(ptr))
+#define queue_store(ptr, value) (*(ptr) = (value))
+#endif
+
+#define QUEUE_SHRINK_WINDOW 256
+
+enum {
+	QUEUE_SLOT_FREE = 0,
+	QUEUE_SLOT_CLAIMED,
+	QUEUE_SLOT_DONE,
+};
+
 struct _Queue {
-	int next_to_write;
-	int next_to_read;
+	volatile int next_to_write;
+	volatile int next_to_read;
 	int *ready;
 
+	int next_to_claim;
+	int *claimed;
+	pthread_cond_t turn;
+	int turn_waiters;
+
 	int in_read;
 
+	queue_fill_func fill_func;
 	queue_free_func free_func;
+	void *fill_obj;
+	void *free_obj;
+	void **pool;
+	volatile int pool_write;
+	volatile int pool_read;
+	void *spare;
+	int allocated;
+	int window_pushes;
+	int window_used;
 
 	int is_custom_lock;
+	QueueMode mode;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	volatile int push_waiters;
+	volatile int pop_waiters;
+	QueueStats stats;
+
+	queue_measure_func measure_func;
+	void *measure_obj;
+	int max_bytes;
+	int max_duration;
+	volatile int total_bytes;
+	volatile int total_duration;
+	int *bytes;
+	int *durations;
+
+	int low_watermark;
+	int high_watermark;
+
 	int size;
 	void ** tab;
 };
@@ -48,9 +152,9 @@ int queue_get_next(Queue *queue, int value) {
 	return (value + 1) % queue->size;
 }
 
-Queue *queue_init_with_custom_lock(int size, queue_fill_func fill_func,
-		queue_free_func free_func, void *obj, void *free_obj, pthread_mutex_t *custom_lock,
-		pthread_cond_t *custom_cond) {
+Queue *queue_init_with_custom_lock(int size, QueueMode mode,
+		queue_fill_func fill_func, queue_free_func free_func, void *obj,
+		void *free_obj, pthread_mutex_t *custom_lock) {
 	Queue *queue = malloc(sizeof(Queue));
 	if (queue == NULL)
 		return NULL;
@@ -61,36 +165,78 @@ Queue *queue_init_with_custom_lock(int size, queue_fill_func fill_func,
 	if (queue->ready == NULL)
 		goto free_queue;
 
-	queue->in_read = FALSE;
+	queue->next_to_claim = 0;
+	queue->turn_waiters = 0;
+	queue->claimed = malloc(sizeof(*queue->claimed) * size);
+	if (queue->claimed == NULL)
+		goto free_ready;
+	memset(queue->claimed, 0, sizeof(*queue->claimed) * size);
+
+	queue->measure_func = NULL;
+	queue->measure_obj = NULL;
+	queue->max_bytes = 0;
+	queue->max_duration = 0;
+	queue->total_bytes = 0;
+	queue->total_duration = 0;
+	queue->bytes = malloc(sizeof(*queue->bytes) * size);
+	if (queue->bytes == NULL)
+		goto free_claimed;
+	queue->durations = malloc(sizeof(*queue->durations) * size);
+	if (queue->durations == NULL)
+		goto free_bytes;
 
+	queue->low_watermark = 0;
+	queue->high_watermark = 0;
+
+	queue->in_read = 0;
+
+	queue->fill_func = fill_func;
 	queue->free_func = free_func;
+	queue->fill_obj = obj;
+	queue->free_obj = free_obj;
+	queue->pool_write = 0;
+	queue->pool_read = 0;
+	queue->spare = NULL;
+	queue->allocated = 0;
+	queue->window_pushes = 0;
+	queue->window_used = 0;
 
 	queue->is_custom_lock = TRUE;
 
+	queue->mode = mode;
+	queue->push_waiters = 0;
+	queue->pop_waiters = 0;
+	memset(&queue->stats, 0, sizeof(queue->stats));
+
 	queue->size = size;
 
 	queue->tab = malloc(sizeof(*queue->tab) * size);
 	if (queue->tab == NULL)
-		goto free_ready;
+		goto free_durations;
 	memset(queue->tab, 0, sizeof(*queue->tab) * size);
-	int i;
-	for (i = queue->size - 1; i >= 0; --i) {
-		void * elem = fill_func(obj);
-		if (elem == NULL)
-			goto free_tabs;
-		queue->tab[i] = elem;
-	}
+
+	// every element could be in the pool
+	queue->pool = malloc(sizeof(*queue->pool) * (size + 1));
+	if (queue->pool == NULL)
+		goto free_tab;
+
+	pthread_cond_init(&queue->not_empty, NULL);
+	pthread_cond_init(&queue->not_full, NULL);
+	pthread_cond_init(&queue->turn, NULL);
 
 	goto end;
-free_tabs:
-	for (i = queue->size - 1; i >= 0; --i) {
-		void *elem = queue->tab[i];
-		if (elem == NULL)
-			continue;
-		queue->free_func(free_obj, elem);
-	}
+free_tab:
 	free(queue->tab);
 
+free_durations:
+	free(queue->durations);
+
+free_bytes:
+	free(queue->bytes);
+
+free_claimed:
+	free(queue->claimed);
+
 free_ready:
 	free(queue->ready);
 
@@ -102,33 +248,376 @@ end:
 	return queue;
 }
 
-void queue_free(Queue *queue, pthread_mutex_t * mutex, pthread_cond_t *cond, void *free_obj) {
+void queue_free(Queue *queue, pthread_mutex_t * mutex, void *free_obj) {
 	pthread_mutex_lock(mutex);
+	__sync_fetch_and_add(&queue->push_waiters, 1);
 	while (queue->in_read)
-		pthread_cond_wait(cond, mutex);
+		pthread_cond_wait(&queue->not_full, mutex);
+	__sync_fetch_and_sub(&queue->push_waiters, 1);
 
 	int i;
 	for (i = queue->size - 1; i >= 0; --i) {
 		void *elem = queue->tab[i];
-		queue->free_func(free_obj, elem);
+		if (elem != NULL)
+			queue->free_func(free_obj, elem);
 	}
+	for (i = queue->pool_read; i != queue->pool_write;
+			i = (i + 1) % (queue->size + 1))
+		queue->free_func(free_obj, queue->pool[i]);
+	if (queue->spare != NULL)
+		queue->free_func(free_obj, queue->spare);
 	pthread_mutex_unlock(mutex);
 
+	pthread_cond_destroy(&queue->not_empty);
+	pthread_cond_destroy(&queue->not_full);
+	pthread_cond_destroy(&queue->turn);
+	free(queue->pool);
 	free(queue->tab);
+	free(queue->durations);
+	free(queue->bytes);
+	free(queue->claimed);
 	free(queue->ready);
 	free(queue);
 }
 
-void *queue_push_start_impl(Queue *queue, pthread_mutex_t * mutex,
-		pthread_cond_t *cond, int *to_write, QueueCheckFunc func,
+static int queue_has_space(Queue *queue) {
+	int next_next_to_write = queue_get_next(queue,
+			queue_load(&queue->next_to_write));
+	if (next_next_to_write == queue_load(&queue->next_to_read))
+		return FALSE;
+	if (queue->max_bytes
+			&& queue_load(&queue->total_bytes) >= queue->max_bytes)
+		return FALSE;
+	if (queue->max_duration
+			&& queue_load(&queue->total_duration) >= queue->max_duration)
+		return FALSE;
+	return TRUE;
+}
+
+static int queue_pool_count(Queue *queue) {
+	return (queue_load(&queue->pool_write) - queue->pool_read
+			+ queue->size + 1) % (queue->size + 1);
+}
+
+/*
+ * Called by consumer when slot is released.
+ */
+static void queue_recycle(Queue *queue, int slot) {
+	void *elem = queue->tab[slot];
+	queue->tab[slot] = NULL;
+	queue->pool[queue->pool_write] = elem;
+	// element has to be visible to producer before pool_write
+	queue_barrier();
+	queue_store(&queue->pool_write,
+			(queue->pool_write + 1) % (queue->size + 1));
+}
+
+/*
+ * Called by producer. Returns spare or recycled element or creates new one.
+ */
+static void *queue_get_element(Queue *queue) {
+	void *elem;
+	if (queue->spare != NULL) {
+		elem = queue->spare;
+		queue->spare = NULL;
+		return elem;
+	}
+	if (queue->pool_read != queue_load(&queue->pool_write)) {
+		queue_barrier();
+		elem = queue->pool[queue->pool_read];
+		queue->pool_read = (queue->pool_read + 1) % (queue->size + 1);
+		return elem;
+	}
+	if (queue->allocated >= queue->size)
+		return NULL;
+	elem = queue->fill_func(queue->fill_obj);
+	if (elem == NULL) {
+		LOGE(1, "queue_get_element could not create element");
+		return NULL;
+	}
+	queue->allocated += 1;
+	return elem;
+}
+
+/*
+ * Called by producer on every reservation, frees pool elements that were
+ * not needed during last QUEUE_SHRINK_WINDOW pushes.
+ */
+static void queue_shrink(Queue *queue) {
+	int used = queue->allocated - queue_pool_count(queue)
+			- (queue->spare != NULL ? 1 : 0);
+	if (used > queue->window_used)
+		queue->window_used = used;
+	if (++queue->window_pushes < QUEUE_SHRINK_WINDOW)
+		return;
+
+	// keep one element for the next push
+	while (queue->allocated > queue->window_used + 1
+			&& queue->pool_read != queue_load(&queue->pool_write)) {
+		void *elem;
+		queue_barrier();
+		elem = queue->pool[queue->pool_read];
+		queue->pool_read = (queue->pool_read + 1) % (queue->size + 1);
+		queue->free_func(queue->free_obj, elem);
+		queue->allocated -= 1;
+	}
+	queue->window_pushes = 0;
+	queue->window_used = 0;
+}
+
+/*
+ * Called by producer. When fill_func fails queue behaves as full until an
+ * element is given back by consumer.
+ */
+static int queue_can_push(Queue *queue) {
+	if (!queue_has_space(queue))
+		return FALSE;
+	if (queue->tab[queue->next_to_write] != NULL || queue->spare != NULL)
+		return TRUE;
+	queue->spare = queue_get_element(queue);
+	return queue->spare != NULL;
+}
+
+static int queue_can_pop(Queue *queue) {
+	int to_read = queue->mode == QUEUE_MODE_MULTI_CONSUMER ?
+			queue->next_to_claim : queue->next_to_read;
+	if (to_read == queue_load(&queue->next_to_write))
+		return FALSE;
+	// make sure that element content is read after next_to_write
+	queue_barrier();
+	return queue->ready[to_read];
+}
+
+static int64_t queue_time_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/*
+ * Blocking wait for cond. Time spent is added to wait_us, time is only
+ * measured here so non blocking push/pop do not pay for clock_gettime.
+ */
+static void queue_wait(Queue *queue, pthread_cond_t *cond,
+		pthread_mutex_t *mutex, int was_woken, int64_t *wait_us) {
+	int64_t start = queue_time_us();
+	if (was_woken)
+		queue->stats.spurious_wakeups += 1;
+	pthread_cond_wait(cond, mutex);
+	queue->stats.wakeups += 1;
+	*wait_us += queue_time_us() - start;
+}
+
+/*
+ * Fill level against the tightest of slots, bytes and duration limits, in
+ * range 0 - QUEUE_HISTOGRAM_BUCKETS - 1.
+ */
+static int queue_occupancy_bucket(Queue *queue, int count) {
+	int64_t fill = (int64_t) count * QUEUE_HISTOGRAM_BUCKETS / queue->size;
+	int64_t tmp;
+	if (queue->max_bytes) {
+		tmp = (int64_t) queue_load(&queue->total_bytes)
+				* QUEUE_HISTOGRAM_BUCKETS / queue->max_bytes;
+		if (tmp > fill)
+			fill = tmp;
+	}
+	if (queue->max_duration) {
+		tmp = (int64_t) queue_load(&queue->total_duration)
+				* QUEUE_HISTOGRAM_BUCKETS
+				/ queue->max_duration;
+		if (tmp > fill)
+			fill = tmp;
+	}
+	if (fill >= QUEUE_HISTOGRAM_BUCKETS)
+		fill = QUEUE_HISTOGRAM_BUCKETS - 1;
+	return fill;
+}
+
+/*
+ * Called by producer after publishing elements.
+ */
+static void queue_update_occupancy(Queue *queue) {
+	int count = (queue->next_to_write - queue_load(&queue->next_to_read)
+			+ queue->size) % queue->size;
+	if (count > queue->stats.high_water)
+		queue->stats.high_water = count;
+	queue->stats.histogram[queue_occupancy_bucket(queue, count)] += 1;
+}
+
+static int queue_get_free(Queue *queue) {
+	// one slot is always left empty to tell full queue from empty one
+	return (queue_load(&queue->next_to_read) - queue->next_to_write - 1
+			+ queue->size) % queue->size;
+}
+
+/*
+ * Number of elements, at most count, that fit into what is left of limit
+ * when each of them is as big as the average of queued ones.
+ */
+static int queue_limit_room(int count, int queued, int total, int limit) {
+	int64_t room;
+	if (total <= 0)
+		return count;
+	room = ((int64_t) (limit - total) * queued + total - 1) / total;
+	if (room < 1)
+		room = 1;
+	return room < count ? room : count;
+}
+
+/*
+ * Clamp batch reservation to bytes and duration limits. Sizes of elements
+ * are known only when they are published so the room is estimated from
+ * queued elements, queue_has_space already made sure that one fits.
+ */
+static int queue_clamp_to_limits(Queue *queue, int count) {
+	int queued;
+	if (count <= 1 || queue->measure_func == NULL)
+		return count;
+	if (!queue->max_bytes && !queue->max_duration)
+		return count;
+	queued = (queue->next_to_write - queue_load(&queue->next_to_read)
+			+ queue->size) % queue->size;
+	// nothing to estimate from
+	if (queued == 0)
+		return 1;
+	if (queue->max_bytes)
+		count = queue_limit_room(count, queued,
+				queue_load(&queue->total_bytes), queue->max_bytes);
+	if (queue->max_duration)
+		count = queue_limit_room(count, queued,
+				queue_load(&queue->total_duration), queue->max_duration);
+	return count;
+}
+
+/*
+ * Reserve up to max contiguous slots starting from next_to_write.
+ * queue_can_push has to be TRUE so at least one slot is reserved.
+ */
+static int queue_push_reserve(Queue *queue, void **elems, int max,
+		int *to_write) {
+	int count = queue_get_free(queue);
+	int slot = queue->next_to_write;
+	int i;
+	if (count > max)
+		count = max;
+	count = queue_clamp_to_limits(queue, count);
+	*to_write = slot;
+	for (i = 0; i < count; ++i) {
+		// element could be left in free slot by not written reservation
+		if (queue->tab[slot] == NULL) {
+			void *elem = queue_get_element(queue);
+			if (elem == NULL)
+				break;
+			queue->tab[slot] = elem;
+		}
+		queue->ready[slot] = FALSE;
+		elems[i] = queue->tab[slot];
+		slot = queue_get_next(queue, slot);
+	}
+	// queue_can_push made sure that there is at least one element
+	assert(i > 0);
+	count = i;
+	queue_shrink(queue);
+
+	if (queue->mode != QUEUE_MODE_SPSC) {
+		queue_store(&queue->next_to_write, slot);
+	}
+	// in QUEUE_MODE_SPSC slots are published by queue_push_finish
+	return count;
+}
+
+/*
+ * Publish count written elements. Returns TRUE if consumer have to be
+ * woken up.
+ */
+static int queue_push_publish(Queue *queue, int to_write, int count) {
+	int slot = to_write;
+	int i;
+	for (i = 0; i < count; ++i) {
+		int bytes = 0, duration = 0;
+		if (queue->measure_func != NULL)
+			queue->measure_func(queue->measure_obj, queue->tab[slot], &bytes,
+					&duration);
+		queue->bytes[slot] = bytes;
+		queue->durations[slot] = duration;
+		__sync_fetch_and_add(&queue->total_bytes, bytes);
+		__sync_fetch_and_add(&queue->total_duration, duration);
+
+		queue->ready[slot] = TRUE;
+		slot = queue_get_next(queue, slot);
+	}
+	if (queue->mode != QUEUE_MODE_SPSC) {
+		queue_update_occupancy(queue);
+		return queue_load(&queue->pop_waiters) > 0;
+	}
+
+	assert(to_write == queue->next_to_write);
+	queue_barrier();
+	queue_store(&queue->next_to_write, slot);
+	queue_barrier();
+	queue_update_occupancy(queue);
+	return queue_load(&queue->pop_waiters) > 0;
+}
+
+/*
+ * Take up to max ready contiguous elements starting from next_to_read.
+ */
+static int queue_pop_take(Queue *queue, void **elems, int max) {
+	int to_write = queue_load(&queue->next_to_write);
+	int slot = queue->next_to_read;
+	int count = 0;
+	assert(queue->mode != QUEUE_MODE_MULTI_CONSUMER);
+	assert(!queue->in_read);
+	// make sure that elements content is read after next_to_write
+	queue_barrier();
+	while (count < max && slot != to_write && queue->ready[slot]) {
+		elems[count++] = queue->tab[slot];
+		slot = queue_get_next(queue, slot);
+	}
+	queue->in_read = count;
+	return count;
+}
+
+/*
+ * Release first count of taken elements, rest of them are rolled back.
+ * Returns TRUE if producer have to be woken up.
+ */
+static int queue_pop_release(Queue *queue, int count) {
+	int slot = queue->next_to_read;
+	int i;
+	assert(count <= queue->in_read);
+	queue->in_read = 0;
+	for (i = 0; i < count; ++i) {
+		__sync_fetch_and_sub(&queue->total_bytes, queue->bytes[slot]);
+		__sync_fetch_and_sub(&queue->total_duration, queue->durations[slot]);
+		queue_recycle(queue, slot);
+		slot = queue_get_next(queue, slot);
+	}
+	if (queue->mode != QUEUE_MODE_SPSC) {
+		queue_store(&queue->next_to_read, slot);
+		return queue_load(&queue->push_waiters) > 0;
+	}
+
+	queue_barrier();
+	queue_store(&queue->next_to_read, slot);
+	queue_barrier();
+	return queue_load(&queue->push_waiters) > 0;
+}
+
+int queue_push_start_many_impl(Queue *queue, pthread_mutex_t * mutex,
+		void **elems, int max, int *to_write, QueueCheckFunc func,
 		void *check_data, void *check_ret_data) {
-	int next_next_to_write;
+	int ret = 0;
+	int was_woken = FALSE;
+	assert(max > 0);
+	// has to be visible to consumer before we test the queue
+	__sync_fetch_and_add(&queue->push_waiters, 1);
 	while (1) {
 		if (func == NULL)
 			goto test;
 		QueueCheckFuncRet check = func(queue, check_data, check_ret_data);
 		if (check == QUEUE_CHECK_FUNC_RET_SKIP)
-			return NULL;
+			goto end;
 		else if (check == QUEUE_CHECK_FUNC_RET_WAIT)
 			goto wait;
 		else if (check == QUEUE_CHECK_FUNC_RET_TEST)
@@ -136,68 +625,139 @@ void *queue_push_start_impl(Queue *queue, pthread_mutex_t * mutex,
 		else
 			assert(FALSE);
 test:
-		next_next_to_write = queue_get_next(queue, queue->next_to_write);
-		if (next_next_to_write != queue->next_to_read) {
+		if (queue_can_push(queue)) {
 			break;
 		}
 wait:
-		pthread_cond_wait(cond, mutex);
+		queue_wait(queue, &queue->not_full, mutex, was_woken,
+				&queue->stats.push_wait_us);
+		was_woken = TRUE;
 	}
-	*to_write = queue->next_to_write;
-	queue->ready[*to_write] = FALSE;
-
-	queue->next_to_write = next_next_to_write;
-	pthread_cond_broadcast(cond);
-	return queue->tab[*to_write];
+	ret = queue_push_reserve(queue, elems, max, to_write);
+end:
+	if (was_woken)
+		queue->stats.push_waits += 1;
+	__sync_fetch_and_sub(&queue->push_waiters, 1);
+	return ret;
 }
 
-void *queue_push_start(Queue *queue, pthread_mutex_t * mutex,
-		pthread_cond_t *cond, int *to_write, QueueCheckFunc func,
+int queue_push_start_many(Queue *queue, pthread_mutex_t * mutex,
+		void **elems, int max, int *to_write, QueueCheckFunc func,
 		void *check_data, void *check_ret_data) {
-	void *ret;
+	int ret;
+	if (queue->mode == QUEUE_MODE_SPSC) {
+		QueueCheckFuncRet check = QUEUE_CHECK_FUNC_RET_TEST;
+		if (func != NULL)
+			check = func(queue, check_data, check_ret_data);
+		if (check == QUEUE_CHECK_FUNC_RET_SKIP)
+			return 0;
+		if (check == QUEUE_CHECK_FUNC_RET_TEST && queue_can_push(queue))
+			return queue_push_reserve(queue, elems, max, to_write);
+	}
 	pthread_mutex_lock(mutex);
-	ret = queue_push_start_impl(queue, mutex, cond, to_write, func,
-			check_data, check_ret_data);
+	ret = queue_push_start_many_impl(queue, mutex, elems, max, to_write,
+			func, check_data, check_ret_data);
 	pthread_mutex_unlock(mutex);
 	return ret;
 }
 
-void queue_push_finish_impl(Queue *queue, pthread_mutex_t * mutex,
-		pthread_cond_t *cond, int to_write) {
-	queue->ready[to_write] = TRUE;
-	pthread_cond_broadcast(cond);
+void *queue_push_start_impl(Queue *queue, pthread_mutex_t * mutex,
+		int *to_write, QueueCheckFunc func, void *check_data,
+		void *check_ret_data) {
+	void *elem;
+	if (!queue_push_start_many_impl(queue, mutex, &elem, 1, to_write, func,
+			check_data, check_ret_data))
+		return NULL;
+	return elem;
 }
 
-void queue_push_finish(Queue *queue, pthread_mutex_t * mutex,
-		pthread_cond_t *cond, int to_write) {
+void *queue_push_start(Queue *queue, pthread_mutex_t * mutex,
+		int *to_write, QueueCheckFunc func, void *check_data,
+		void *check_ret_data) {
+	void *elem;
+	if (!queue_push_start_many(queue, mutex, &elem, 1, to_write, func,
+			check_data, check_ret_data))
+		return NULL;
+	return elem;
+}
+
+void queue_push_finish_many_impl(Queue *queue, pthread_mutex_t * mutex,
+		int to_write, int reserved, int written) {
+	assert(written <= reserved);
+	if (queue->mode != QUEUE_MODE_SPSC && written < reserved) {
+		// give back not written slots, producer could not reserve
+		// anything after them
+		assert(queue->next_to_write == (to_write + reserved) % queue->size);
+		queue_store(&queue->next_to_write,
+				(to_write + written) % queue->size);
+	}
+	if (queue_push_publish(queue, to_write, written))
+		pthread_cond_broadcast(&queue->not_empty);
+}
+
+void queue_push_finish_many(Queue *queue, pthread_mutex_t * mutex,
+		int to_write, int reserved, int written) {
+	if (queue->mode == QUEUE_MODE_SPSC) {
+		assert(written <= reserved);
+		if (!queue_push_publish(queue, to_write, written))
+			return;
+		pthread_mutex_lock(mutex);
+		pthread_cond_broadcast(&queue->not_empty);
+		pthread_mutex_unlock(mutex);
+		return;
+	}
 	pthread_mutex_lock(mutex);
-	queue_push_finish_impl(queue, mutex, cond, to_write);
+	queue_push_finish_many_impl(queue, mutex, to_write, reserved, written);
 	pthread_mutex_unlock(mutex);
 }
 
+void queue_push_finish_impl(Queue *queue, pthread_mutex_t * mutex,
+		int to_write) {
+	queue_push_finish_many_impl(queue, mutex, to_write, 1, 1);
+}
+
+void queue_push_finish(Queue *queue, pthread_mutex_t * mutex,
+		int to_write) {
+	queue_push_finish_many(queue, mutex, to_write, 1, 1);
+}
+
 void *queue_pop_start_impl_non_block(Queue *queue) {
-	assert(!queue->in_read);
-	int to_read = queue->next_to_read;
-	if (to_read == queue->next_to_write)
-		return NULL;
-	if (!queue->ready[to_read])
+	void *elem;
+	if (!queue_pop_take(queue, &elem, 1))
 		return NULL;
+	return elem;
+}
 
-	queue->in_read = TRUE;
-	return queue->tab[to_read];
+void *queue_pop_peek_next_impl(Queue *queue) {
+	int to_write = queue_load(&queue->next_to_write);
+	int slot = queue->next_to_read;
+	int i;
+	assert(queue->mode != QUEUE_MODE_MULTI_CONSUMER);
+	assert(queue->in_read);
+	// make sure that element content is read after next_to_write
+	queue_barrier();
+	for (i = 0; i < queue->in_read; ++i)
+		slot = queue_get_next(queue, slot);
+	if (slot == to_write || !queue->ready[slot])
+		return NULL;
+	return queue->tab[slot];
 }
 
-void *queue_pop_start_impl(Queue **queue, pthread_mutex_t * mutex,
-		pthread_cond_t *cond, QueueCheckFunc func, void *check_data,
+int queue_pop_start_many_impl(Queue **queue, pthread_mutex_t * mutex,
+		void **elems, int max, QueueCheckFunc func, void *check_data,
 		void *check_ret_data) {
-	int to_read;
-	Queue *q;
+	int was_woken = FALSE;
+	int ret = 0;
+	Queue *q = *queue;
+	assert(max > 0);
+	// has to be visible to producer before we test the queue
+	__sync_fetch_and_add(&q->pop_waiters, 1);
 	while (1) {
 		if (func == NULL)
 			goto test;
 		QueueCheckFuncRet check = func(*queue, check_data, check_ret_data);
 		if (check == QUEUE_CHECK_FUNC_RET_SKIP)
-			goto skip;
+			goto end;
 		else if (check == QUEUE_CHECK_FUNC_RET_WAIT)
 			goto wait;
 		else if (check == QUEUE_CHECK_FUNC_RET_TEST)
@@ -205,81 +765,325 @@ void *queue_pop_start_impl(Queue **queue, pthread_mutex_t * mutex,
 		else
 			assert(FALSE);
 test:
-		q = *queue;
 		assert(!q->in_read);
-		if (q->next_to_read != q->next_to_write
-				&& q->ready[q->next_to_read])
+		if (queue_can_pop(q))
 			break;
 wait:
-		pthread_cond_wait(cond, mutex);
+		queue_wait(q, &q->not_empty, mutex, was_woken,
+				&q->stats.pop_wait_us);
+		was_woken = TRUE;
 	}
-	q=*queue;
-	to_read = q->next_to_read;
-	q->in_read = TRUE;
-	return q->tab[to_read];
+	ret = queue_pop_take(q, elems, max);
+end:
+	if (was_woken)
+		q->stats.pop_waits += 1;
+	__sync_fetch_and_sub(&q->pop_waiters, 1);
+	return ret;
+}
 
-skip:
-	return NULL;
+int queue_pop_start_many(Queue **queue, pthread_mutex_t * mutex,
+		void **elems, int max, QueueCheckFunc func, void *check_data,
+		void *check_ret_data) {
+	int ret;
+	Queue *q = *queue;
+	if (q->mode == QUEUE_MODE_SPSC) {
+		QueueCheckFuncRet check = QUEUE_CHECK_FUNC_RET_TEST;
+		if (func != NULL)
+			check = func(q, check_data, check_ret_data);
+		if (check == QUEUE_CHECK_FUNC_RET_SKIP)
+			return 0;
+		if (check == QUEUE_CHECK_FUNC_RET_TEST) {
+			ret = queue_pop_take(q, elems, max);
+			if (ret > 0)
+				return ret;
+		}
+	}
+	pthread_mutex_lock(mutex);
+	ret = queue_pop_start_many_impl(queue, mutex, elems, max, func,
+			check_data, check_ret_data);
+	pthread_mutex_unlock(mutex);
+	return ret;
+}
+
+void *queue_pop_start_impl(Queue **queue, pthread_mutex_t * mutex,
+		QueueCheckFunc func, void *check_data, void *check_ret_data) {
+	void *elem;
+	if (!queue_pop_start_many_impl(queue, mutex, &elem, 1, func, check_data,
+			check_ret_data))
+		return NULL;
+	return elem;
 }
 
 void *queue_pop_start(Queue **queue, pthread_mutex_t * mutex,
-		pthread_cond_t *cond, QueueCheckFunc func, void *check_data,
+		QueueCheckFunc func, void *check_data, void *check_ret_data) {
+	void *elem;
+	if (!queue_pop_start_many(queue, mutex, &elem, 1, func, check_data,
+			check_ret_data))
+		return NULL;
+	return elem;
+}
+
+void queue_pop_roll_back_impl(Queue *queue, pthread_mutex_t * mutex) {
+	assert(queue->mode != QUEUE_MODE_MULTI_CONSUMER);
+	assert(queue->in_read);
+	queue->in_read = 0;
+
+	// queue_free could wait for in_read
+	if (queue_load(&queue->push_waiters) > 0)
+		pthread_cond_broadcast(&queue->not_full);
+}
+
+void queue_pop_roll_back(Queue *queue, pthread_mutex_t * mutex) {
+	pthread_mutex_lock(mutex);
+	queue_pop_roll_back_impl(queue, mutex);
+	pthread_mutex_unlock(mutex);
+}
+
+void queue_pop_finish_many_impl(Queue *queue, pthread_mutex_t * mutex,
+		int count) {
+	if (queue_pop_release(queue, count))
+		pthread_cond_broadcast(&queue->not_full);
+}
+
+void queue_pop_finish_many(Queue *queue, pthread_mutex_t * mutex, int count) {
+	if (queue->mode == QUEUE_MODE_SPSC) {
+		if (!queue_pop_release(queue, count))
+			return;
+		pthread_mutex_lock(mutex);
+		pthread_cond_broadcast(&queue->not_full);
+		pthread_mutex_unlock(mutex);
+		return;
+	}
+	pthread_mutex_lock(mutex);
+	queue_pop_finish_many_impl(queue, mutex, count);
+	pthread_mutex_unlock(mutex);
+}
+
+void queue_pop_finish_impl(Queue *queue, pthread_mutex_t * mutex) {
+	assert(queue->in_read == 1);
+	queue_pop_finish_many_impl(queue, mutex, 1);
+}
+
+void queue_pop_finish(Queue *queue, pthread_mutex_t * mutex) {
+	assert(queue->in_read == 1);
+	queue_pop_finish_many(queue, mutex, 1);
+}
+
+static void *queue_claim(Queue *queue, int *to_read) {
+	int slot = queue->next_to_claim;
+	assert(queue->claimed[slot] == QUEUE_SLOT_FREE);
+	queue->claimed[slot] = QUEUE_SLOT_CLAIMED;
+	queue->next_to_claim = queue_get_next(queue, slot);
+	queue->in_read += 1;
+	*to_read = slot;
+	return queue->tab[slot];
+}
+
+void *queue_claim_start_impl(Queue **queue, pthread_mutex_t * mutex,
+		int *to_read, QueueCheckFunc func, void *check_data,
+		void *check_ret_data) {
+	int was_woken = FALSE;
+	void *ret = NULL;
+	Queue *q = *queue;
+	assert(q->mode == QUEUE_MODE_MULTI_CONSUMER);
+	__sync_fetch_and_add(&q->pop_waiters, 1);
+	while (1) {
+		if (func == NULL)
+			goto test;
+		QueueCheckFuncRet check = func(*queue, check_data, check_ret_data);
+		if (check == QUEUE_CHECK_FUNC_RET_SKIP)
+			goto end;
+		else if (check == QUEUE_CHECK_FUNC_RET_WAIT)
+			goto wait;
+		else if (check == QUEUE_CHECK_FUNC_RET_TEST)
+			goto test;
+		else
+			assert(FALSE);
+test:
+		if (queue_can_pop(q))
+			break;
+wait:
+		queue_wait(q, &q->not_empty, mutex, was_woken,
+				&q->stats.pop_wait_us);
+		was_woken = TRUE;
+	}
+	ret = queue_claim(q, to_read);
+end:
+	if (was_woken)
+		q->stats.pop_waits += 1;
+	__sync_fetch_and_sub(&q->pop_waiters, 1);
+	return ret;
+}
+
+void *queue_claim_start(Queue **queue, pthread_mutex_t * mutex,
+		int *to_read, QueueCheckFunc func, void *check_data,
 		void *check_ret_data) {
 	void *ret;
 	pthread_mutex_lock(mutex);
-	ret = queue_pop_start_impl(queue, mutex, cond, func, check_data,
+	ret = queue_claim_start_impl(queue, mutex, to_read, func, check_data,
 			check_ret_data);
 	pthread_mutex_unlock(mutex);
 	return ret;
 }
 
-void queue_pop_roll_back_impl(Queue *queue, pthread_mutex_t * mutex,
-		pthread_cond_t *cond) {
-	assert(queue->in_read);
-	queue->in_read = FALSE;
-
-	pthread_cond_broadcast(cond);
+void queue_claim_wait_turn_impl(Queue *queue, pthread_mutex_t * mutex,
+		int to_read) {
+	int was_woken = FALSE;
+	assert(queue->claimed[to_read] == QUEUE_SLOT_CLAIMED);
+	queue->turn_waiters += 1;
+	while (queue->next_to_read != to_read) {
+		queue_wait(queue, &queue->turn, mutex, was_woken,
+				&queue->stats.pop_wait_us);
+		was_woken = TRUE;
+	}
+	queue->turn_waiters -= 1;
 }
 
-void queue_pop_roll_back(Queue *queue, pthread_mutex_t * mutex,
-		pthread_cond_t *cond) {
+void queue_claim_wait_turn(Queue *queue, pthread_mutex_t * mutex,
+		int to_read) {
 	pthread_mutex_lock(mutex);
-	queue_pop_roll_back_impl(queue, mutex, cond);
+	queue_claim_wait_turn_impl(queue, mutex, to_read);
 	pthread_mutex_unlock(mutex);
 }
 
-void queue_pop_finish_impl(Queue *queue, pthread_mutex_t * mutex,
-		pthread_cond_t *cond) {
-	assert(queue->in_read);
-	queue->in_read = FALSE;
-	queue->next_to_read = queue_get_next(queue, queue->next_to_read);
+void queue_claim_finish_impl(Queue *queue, pthread_mutex_t * mutex,
+		int to_read) {
+	int advanced = FALSE;
+	assert(queue->claimed[to_read] == QUEUE_SLOT_CLAIMED);
+	queue->claimed[to_read] = QUEUE_SLOT_DONE;
+	queue->in_read -= 1;
 
-	pthread_cond_broadcast(cond);
+	// give back finished prefix in push order
+	while (queue->next_to_read != queue->next_to_claim
+			&& queue->claimed[queue->next_to_read] == QUEUE_SLOT_DONE) {
+		int slot = queue->next_to_read;
+		queue->claimed[slot] = QUEUE_SLOT_FREE;
+		__sync_fetch_and_sub(&queue->total_bytes, queue->bytes[slot]);
+		__sync_fetch_and_sub(&queue->total_duration, queue->durations[slot]);
+		queue_recycle(queue, slot);
+		queue_store(&queue->next_to_read, queue_get_next(queue, slot));
+		advanced = TRUE;
+	}
+	if (advanced && queue->turn_waiters > 0)
+		pthread_cond_broadcast(&queue->turn);
+	// queue_free could also wait for in_read
+	if (queue_load(&queue->push_waiters) > 0)
+		pthread_cond_broadcast(&queue->not_full);
 }
 
-void queue_pop_finish(Queue *queue, pthread_mutex_t * mutex,
-		pthread_cond_t *cond) {
+void queue_claim_finish(Queue *queue, pthread_mutex_t * mutex, int to_read) {
 	pthread_mutex_lock(mutex);
-	queue_pop_finish_impl(queue, mutex, cond);
+	queue_claim_finish_impl(queue, mutex, to_read);
 	pthread_mutex_unlock(mutex);
 }
 
+int queue_flush_impl(Queue *queue, pthread_mutex_t * mutex,
+		queue_flush_func flush_func, void *flush_obj) {
+	void *elems[16];
+	int count, i, flushed = 0;
+	if (queue->mode == QUEUE_MODE_MULTI_CONSUMER) {
+		// elements claimed by other consumers are left to them
+		int to_read;
+		while (queue_can_pop(queue)) {
+			void *elem = queue_claim(queue, &to_read);
+			if (flush_func != NULL)
+				flush_func(flush_obj, elem);
+			queue_claim_finish_impl(queue, mutex, to_read);
+			flushed += 1;
+		}
+		goto end;
+	}
+	while ((count = queue_pop_take(queue, elems, 16)) > 0) {
+		if (flush_func != NULL) {
+			for (i = 0; i < count; ++i)
+				flush_func(flush_obj, elems[i]);
+		}
+		queue_pop_finish_many_impl(queue, mutex, count);
+		flushed += count;
+	}
+end:
+	queue->stats.flushes += 1;
+	queue->stats.flushed += flushed;
+	return flushed;
+}
+
+int queue_flush(Queue *queue, pthread_mutex_t * mutex,
+		queue_flush_func flush_func, void *flush_obj) {
+	int flushed;
+	pthread_mutex_lock(mutex);
+	__sync_fetch_and_add(&queue->push_waiters, 1);
+	while (queue->in_read)
+		pthread_cond_wait(&queue->not_full, mutex);
+	__sync_fetch_and_sub(&queue->push_waiters, 1);
+	flushed = queue_flush_impl(queue, mutex, flush_func, flush_obj);
+	pthread_mutex_unlock(mutex);
+	return flushed;
+}
+
+void queue_wake_all(Queue *queue) {
+	pthread_cond_broadcast(&queue->not_empty);
+	pthread_cond_broadcast(&queue->not_full);
+}
+
+void queue_set_limits(Queue *queue, queue_measure_func measure_func,
+		void *measure_obj, int max_bytes, int max_duration) {
+	queue->measure_func = measure_func;
+	queue->measure_obj = measure_obj;
+	queue->max_bytes = max_bytes;
+	queue->max_duration = max_duration;
+}
+
+void queue_set_watermarks(Queue *queue, int low, int high) {
+	assert(low <= high);
+	queue->low_watermark = low;
+	queue->high_watermark = high;
+}
+
+QueueWatermark queue_get_watermark(Queue *queue) {
+	int level;
+	if (queue->measure_func != NULL) {
+		level = queue_load(&queue->total_duration);
+	} else {
+		level = (queue_load(&queue->next_to_write)
+				- queue_load(&queue->next_to_read) + queue->size) % queue->size;
+	}
+	// producer could not raise level any more
+	if (level >= queue->high_watermark || !queue_has_space(queue))
+		return QUEUE_WATERMARK_ABOVE_HIGH;
+	if (level < queue->low_watermark)
+		return QUEUE_WATERMARK_BELOW_LOW;
+	return QUEUE_WATERMARK_BETWEEN;
+}
+
 int queue_get_size(Queue *queue) {
 	return queue->size;
 }
 
-void queue_wait_for(Queue *queue, int size, pthread_mutex_t * mutex,
-		pthread_cond_t *cond) {
+void queue_get_usage(Queue *queue, int *count, int *bytes, int *duration) {
+	*count = (queue_load(&queue->next_to_write)
+			- queue_load(&queue->next_to_read) + queue->size) % queue->size;
+	*bytes = queue_load(&queue->total_bytes);
+	*duration = queue_load(&queue->total_duration);
+}
+
+void queue_get_stats(Queue *queue, QueueStats *stats) {
+	*stats = queue->stats;
+	stats->allocated = queue->allocated;
+}
+
+void queue_wait_for(Queue *queue, int size, pthread_mutex_t * mutex) {
 	assert(queue->size >= size);
 
+	int was_woken = FALSE;
 	pthread_mutex_lock(mutex);
+	__sync_fetch_and_add(&queue->pop_waiters, 1);
 	while (1) {
 		int next = queue->next_to_read;
 		int i;
 		int all_ok = TRUE;
 		for (i = 0; i < size; ++i) {
-			if (next == queue->next_to_write
-					|| !queue->ready[queue->next_to_read]) {
+			if (next == queue_load(&queue->next_to_write)
+					|| !queue->ready[next]) {
 				all_ok = FALSE;
 				break;
 			}
@@ -290,7 +1094,10 @@ void queue_wait_for(Queue *queue, int size, pthread_mutex_t * mutex,
 		if (all_ok)
 			break;
 
-		pthread_cond_wait(cond, mutex);
+		queue_wait(queue, &queue->not_empty, mutex, was_woken,
+				&queue->stats.pop_wait_us);
+		was_woken = TRUE;
 	}
+	__sync_fetch_and_sub(&queue->pop_waiters, 1);
 	pthread_mutex_unlock(mutex);
 }
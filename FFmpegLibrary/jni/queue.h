@@ -19,10 +19,37 @@
 #ifndef QUEUE_H_
 #define QUEUE_H_
 
+#include <stdint.h>
+#include <pthread.h>
+
+#define QUEUE_HISTOGRAM_BUCKETS 8
+
 typedef struct _Queue Queue;
 
+typedef struct QueueStats {
+	// number of push/pop calls that had to block and time spent blocked
+	int push_waits;
+	int64_t push_wait_us;
+	int pop_waits;
+	int64_t pop_wait_us;
+	int wakeups;
+	int spurious_wakeups;
+	// maximal number of queued elements
+	int high_water;
+	// occupancy sampled on every push, bucket i counts pushes after which
+	// queue was filled in i/QUEUE_HISTOGRAM_BUCKETS of its tightest limit
+	int histogram[QUEUE_HISTOGRAM_BUCKETS];
+	int flushes;
+	int flushed;
+	// number of elements created with fill_func and not freed yet
+	int allocated;
+} QueueStats;
+
 typedef void * (*queue_fill_func)(void * obj);
 typedef void (*queue_free_func)(void * obj, void *elem);
+typedef void (*queue_measure_func)(void *obj, void *elem, int *bytes,
+		int *duration);
+typedef void (*queue_flush_func)(void *obj, void *elem);
 
 typedef enum {
 	QUEUE_CHECK_FUNC_RET_WAIT = -1,
@@ -30,45 +57,170 @@ typedef enum {
 	QUEUE_CHECK_FUNC_RET_SKIP = 1
 } QueueCheckFuncRet;
 
+typedef enum {
+	QUEUE_WATERMARK_BELOW_LOW = -1,
+	QUEUE_WATERMARK_BETWEEN = 0,
+	QUEUE_WATERMARK_ABOVE_HIGH = 1,
+} QueueWatermark;
+
 typedef QueueCheckFuncRet (*QueueCheckFunc)(Queue *queue, void* check_data,
 		void *check_ret_data);
 
-Queue *queue_init_with_custom_lock(int size, queue_fill_func fill_func,
-		queue_free_func free_func, void *obj, void *free_obj,
-		pthread_mutex_t *custom_lock, pthread_cond_t *custom_cond);
-void queue_free(Queue *queue, pthread_mutex_t * mutex, pthread_cond_t *cond,
-		void *free_obj);
+typedef enum {
+	// every transition is done under custom_lock
+	QUEUE_MODE_LOCKED = 0,
+	// exactly one producer thread and one consumer thread - push/pop
+	// wrappers do not take custom_lock unless one side has to wait
+	QUEUE_MODE_SPSC,
+	// as QUEUE_MODE_LOCKED but elements are consumed only with
+	// queue_claim_* so several consumers can hold elements at once
+	QUEUE_MODE_MULTI_CONSUMER,
+} QueueMode;
+
+/*
+ * Elements are created with fill_func(obj) on first use by the producer
+ * thread, at most size of them, and surplus is freed with
+ * free_func(free_obj) by the producer when queue usage stays low.
+ */
+Queue *queue_init_with_custom_lock(int size, QueueMode mode,
+		queue_fill_func fill_func, queue_free_func free_func, void *obj,
+		void *free_obj, pthread_mutex_t *custom_lock);
+void queue_free(Queue *queue, pthread_mutex_t * mutex, void *free_obj);
 
 void *queue_push_start_impl(Queue *queue, pthread_mutex_t * mutex,
-		pthread_cond_t *cond, int *to_write, QueueCheckFunc func,
-		void *check_data, void *check_ret_data);
+		int *to_write, QueueCheckFunc func, void *check_data,
+		void *check_ret_data);
 void *queue_push_start(Queue *queue, pthread_mutex_t * mutex,
-		pthread_cond_t *cond, int *to_write, QueueCheckFunc func,
-		void *check_data, void *check_ret_data);
+		int *to_write, QueueCheckFunc func, void *check_data,
+		void *check_ret_data);
 void queue_push_finish_impl(Queue *queue, pthread_mutex_t * mutex,
-		pthread_cond_t *cond, int to_write);
+		int to_write);
 void queue_push_finish(Queue *queue, pthread_mutex_t * mutex,
-		pthread_cond_t *cond, int to_write);
+		int to_write);
 
 void *queue_pop_start_impl_non_block(Queue *queue);
 void *queue_pop_start_impl(Queue **queue, pthread_mutex_t * mutex,
-		pthread_cond_t *cond, QueueCheckFunc func, void *check_data,
-		void *check_ret_data);
+		QueueCheckFunc func, void *check_data, void *check_ret_data);
 void *queue_pop_start(Queue **queue, pthread_mutex_t * mutex,
-		pthread_cond_t *cond, QueueCheckFunc func, void *check_data,
+		QueueCheckFunc func, void *check_data, void *check_ret_data);
+void queue_pop_roll_back_impl(Queue *queue, pthread_mutex_t * mutex);
+void queue_pop_roll_back(Queue *queue, pthread_mutex_t * mutex);
+void queue_pop_finish_impl(Queue *queue, pthread_mutex_t * mutex);
+void queue_pop_finish(Queue *queue, pthread_mutex_t * mutex);
+
+/*
+ * Element pushed right after the ones taken by queue_pop_start, NULL when
+ * there is none yet. Element stays in the queue, caller has to hold mutex
+ * until it is done with it.
+ */
+void *queue_pop_peek_next_impl(Queue *queue);
+
+/*
+ * Batch variants. queue_push_start_many reserves up to max contiguous
+ * elements (at least one) and returns their number or 0 when check func
+ * skipped. With queue_set_limits batch is also clamped to the bytes and
+ * duration left, estimated from average of queued elements, so bigger
+ * than average elements could take queue above a limit.
+ * queue_push_finish_many publishes first written of reserved elements,
+ * the rest are given back. No other element can be reserved until the
+ * batch is finished.
+ *
+ * queue_pop_start_many takes up to max ready elements (at least one) and
+ * returns their number or 0 when check func skipped.
+ * queue_pop_finish_many releases first count of taken elements, the rest
+ * are rolled back.
+ */
+int queue_push_start_many_impl(Queue *queue, pthread_mutex_t * mutex,
+		void **elems, int max, int *to_write, QueueCheckFunc func,
+		void *check_data, void *check_ret_data);
+int queue_push_start_many(Queue *queue, pthread_mutex_t * mutex,
+		void **elems, int max, int *to_write, QueueCheckFunc func,
+		void *check_data, void *check_ret_data);
+void queue_push_finish_many_impl(Queue *queue, pthread_mutex_t * mutex,
+		int to_write, int reserved, int written);
+void queue_push_finish_many(Queue *queue, pthread_mutex_t * mutex,
+		int to_write, int reserved, int written);
+
+int queue_pop_start_many_impl(Queue **queue, pthread_mutex_t * mutex,
+		void **elems, int max, QueueCheckFunc func, void *check_data,
 		void *check_ret_data);
-void queue_pop_roll_back_impl(Queue *queue, pthread_mutex_t * mutex,
-		pthread_cond_t *cond);
-void queue_pop_roll_back(Queue *queue, pthread_mutex_t * mutex,
-		pthread_cond_t *cond);
-void queue_pop_finish_impl(Queue *queue, pthread_mutex_t * mutex,
-		pthread_cond_t *cond);
-void queue_pop_finish(Queue *queue, pthread_mutex_t * mutex,
-		pthread_cond_t *cond);
+int queue_pop_start_many(Queue **queue, pthread_mutex_t * mutex,
+		void **elems, int max, QueueCheckFunc func, void *check_data,
+		void *check_ret_data);
+void queue_pop_finish_many_impl(Queue *queue, pthread_mutex_t * mutex,
+		int count);
+void queue_pop_finish_many(Queue *queue, pthread_mutex_t * mutex, int count);
+
+/*
+ * QUEUE_MODE_MULTI_CONSUMER only. queue_claim_start claims next ready
+ * element and stores its slot in to_read. Claimed elements could be
+ * finished in any order but their slots are given back to producer in push
+ * order. queue_claim_wait_turn blocks until every element pushed before
+ * to_read is finished so results could be emitted in stream order.
+ */
+void *queue_claim_start_impl(Queue **queue, pthread_mutex_t * mutex,
+		int *to_read, QueueCheckFunc func, void *check_data,
+		void *check_ret_data);
+void *queue_claim_start(Queue **queue, pthread_mutex_t * mutex,
+		int *to_read, QueueCheckFunc func, void *check_data,
+		void *check_ret_data);
+void queue_claim_wait_turn_impl(Queue *queue, pthread_mutex_t * mutex,
+		int to_read);
+void queue_claim_wait_turn(Queue *queue, pthread_mutex_t * mutex,
+		int to_read);
+void queue_claim_finish_impl(Queue *queue, pthread_mutex_t * mutex,
+		int to_read);
+void queue_claim_finish(Queue *queue, pthread_mutex_t * mutex, int to_read);
+
+/*
+ * Drop every ready element calling flush_func (if not NULL) for each of
+ * them. Has to be called with custom lock held by consumer that does not
+ * hold any element; in QUEUE_MODE_MULTI_CONSUMER elements claimed by other
+ * consumers are not dropped. Returns number of dropped elements.
+ */
+int queue_flush_impl(Queue *queue, pthread_mutex_t * mutex,
+		queue_flush_func flush_func, void *flush_obj);
+
+/*
+ * Same as queue_flush_impl but takes custom lock itself and first waits
+ * until consumer gives back elements it holds, like queue_free.
+ */
+int queue_flush(Queue *queue, pthread_mutex_t * mutex,
+		queue_flush_func flush_func, void *flush_obj);
+
+/*
+ * Wake every thread blocked in this queue so it re-evaluates its
+ * QueueCheckFunc. Has to be called with custom lock held after changing
+ * state that check functions depend on.
+ */
+void queue_wake_all(Queue *queue);
+
+/*
+ * Bound queue by sum of elements bytes and duration (0 - no limit) as
+ * reported by measure_func when element is pushed. Has to be called before
+ * queue is used.
+ */
+void queue_set_limits(Queue *queue, queue_measure_func measure_func,
+		void *measure_obj, int max_bytes, int max_duration);
+
+/*
+ * Queue level is the sum of durations reported by measure_func or number of
+ * queued elements when queue is not measured. queue_get_watermark reports
+ * QUEUE_WATERMARK_ABOVE_HIGH also when queue is full by any of its limits
+ * because producer could not raise the level any more. Could be called
+ * without lock.
+ */
+void queue_set_watermarks(Queue *queue, int low, int high);
+QueueWatermark queue_get_watermark(Queue *queue);
 
 int queue_get_size(Queue *queue);
+void queue_get_usage(Queue *queue, int *count, int *bytes, int *duration);
+/*
+ * Copy of queue counters. Counters are updated without synchronization
+ * with the reader so the snapshot is only approximately consistent.
+ */
+void queue_get_stats(Queue *queue, QueueStats *stats);
 
-void queue_wait_for(Queue *queue, int size, pthread_mutex_t * mutex,
-		pthread_cond_t *cond);
+void queue_wait_for(Queue *queue, int size, pthread_mutex_t * mutex);
 
 #endif /* QUEUE_H_ */
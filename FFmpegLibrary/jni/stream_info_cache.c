@@ -0,0 +1,281 @@
+/*
+ * stream_info_cache.c
+ * Copyright (c) 2026 FFmpegAndroid contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libavformat/avformat.h>
+#include <libavutil/mem.h>
+
+#include <android/log.h>
+#include <jni.h>
+
+#include "helpers.h"
+#include "stream_info_cache.h"
+
+#define LOG_LEVEL 2
+#define LOG_TAG "AVEngine:stream_info_cache.c"
+
+#define STREAM_INFO_CACHE_MAGIC 0x53494e46 // "SINF"
+#define STREAM_INFO_CACHE_VERSION 1
+#define STREAM_INFO_CACHE_MAX_KEY_LENGTH 4096
+#define STREAM_INFO_CACHE_MAX_STREAMS 64
+#define STREAM_INFO_CACHE_MAX_EXTRADATA (1024 * 1024)
+
+typedef struct StreamInfoCacheHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t key_length;
+	uint32_t nb_streams;
+	int64_t duration;
+	int64_t start_time;
+	int32_t bit_rate;
+} StreamInfoCacheHeader;
+
+typedef struct StreamInfoCacheStream {
+	int32_t codec_type;
+	int32_t codec_id;
+	uint32_t codec_tag;
+	int32_t time_base_num;
+	int32_t time_base_den;
+	int32_t bit_rate;
+
+	int32_t width;
+	int32_t height;
+	int32_t pix_fmt;
+	int32_t sample_aspect_ratio_num;
+	int32_t sample_aspect_ratio_den;
+	int32_t avg_frame_rate_num;
+	int32_t avg_frame_rate_den;
+	int32_t r_frame_rate_num;
+	int32_t r_frame_rate_den;
+
+	int32_t sample_rate;
+	int32_t channels;
+	int32_t sample_fmt;
+	int32_t frame_size;
+	int32_t block_align;
+	uint64_t channel_layout;
+
+	int64_t start_time;
+	int64_t duration;
+	int32_t extradata_size;
+} StreamInfoCacheStream;
+
+typedef struct StreamInfoCacheWrite {
+	AVFormatContext *ic;
+	const char *key;
+} StreamInfoCacheWrite;
+
+static void stream_info_cache_fill(StreamInfoCacheStream *cs, AVStream *st) {
+	AVCodecContext *ctx = st->codec;
+	memset(cs, 0, sizeof(*cs));
+	cs->codec_type = ctx->codec_type;
+	cs->codec_id = ctx->codec_id;
+	cs->codec_tag = ctx->codec_tag;
+	cs->time_base_num = st->time_base.num;
+	cs->time_base_den = st->time_base.den;
+	cs->bit_rate = ctx->bit_rate;
+
+	cs->width = ctx->width;
+	cs->height = ctx->height;
+	cs->pix_fmt = ctx->pix_fmt;
+	cs->sample_aspect_ratio_num = ctx->sample_aspect_ratio.num;
+	cs->sample_aspect_ratio_den = ctx->sample_aspect_ratio.den;
+	cs->avg_frame_rate_num = st->avg_frame_rate.num;
+	cs->avg_frame_rate_den = st->avg_frame_rate.den;
+	cs->r_frame_rate_num = st->r_frame_rate.num;
+	cs->r_frame_rate_den = st->r_frame_rate.den;
+
+	cs->sample_rate = ctx->sample_rate;
+	cs->channels = ctx->channels;
+	cs->sample_fmt = ctx->sample_fmt;
+	cs->frame_size = ctx->frame_size;
+	cs->block_align = ctx->block_align;
+	cs->channel_layout = ctx->channel_layout;
+
+	cs->start_time = st->start_time;
+	cs->duration = st->duration;
+	cs->extradata_size = ctx->extradata != NULL ? ctx->extradata_size : 0;
+}
+
+static void stream_info_cache_apply(StreamInfoCacheStream *cs,
+		uint8_t *extradata, AVStream *st) {
+	AVCodecContext *ctx = st->codec;
+	ctx->codec_id = cs->codec_id;
+	ctx->codec_tag = cs->codec_tag;
+	ctx->bit_rate = cs->bit_rate;
+
+	ctx->width = cs->width;
+	ctx->height = cs->height;
+	ctx->pix_fmt = cs->pix_fmt;
+	ctx->sample_aspect_ratio.num = cs->sample_aspect_ratio_num;
+	ctx->sample_aspect_ratio.den = cs->sample_aspect_ratio_den;
+	st->avg_frame_rate.num = cs->avg_frame_rate_num;
+	st->avg_frame_rate.den = cs->avg_frame_rate_den;
+	st->r_frame_rate.num = cs->r_frame_rate_num;
+	st->r_frame_rate.den = cs->r_frame_rate_den;
+
+	ctx->sample_rate = cs->sample_rate;
+	ctx->channels = cs->channels;
+	ctx->sample_fmt = cs->sample_fmt;
+	ctx->frame_size = cs->frame_size;
+	ctx->block_align = cs->block_align;
+	ctx->channel_layout = cs->channel_layout;
+
+	st->start_time = cs->start_time;
+	st->duration = cs->duration;
+	// extradata given by demuxer header wins
+	if (extradata != NULL && ctx->extradata == NULL) {
+		ctx->extradata = extradata;
+		ctx->extradata_size = cs->extradata_size;
+	} else {
+		av_free(extradata);
+	}
+}
+
+static int stream_info_cache_write(FILE *file, StreamInfoCacheWrite *save) {
+	AVFormatContext *ic = save->ic;
+	StreamInfoCacheHeader header;
+	StreamInfoCacheStream cs;
+	int i;
+
+	memset(&header, 0, sizeof(header));
+	header.magic = STREAM_INFO_CACHE_MAGIC;
+	header.version = STREAM_INFO_CACHE_VERSION;
+	header.key_length = strlen(save->key);
+	header.nb_streams = ic->nb_streams;
+	header.duration = ic->duration;
+	header.start_time = ic->start_time;
+	header.bit_rate = ic->bit_rate;
+	if (fwrite(&header, sizeof(header), 1, file) != 1)
+		return -1;
+	if (fwrite(save->key, 1, header.key_length, file) != header.key_length)
+		return -1;
+	for (i = 0; i < ic->nb_streams; ++i) {
+		AVStream *st = ic->streams[i];
+		stream_info_cache_fill(&cs, st);
+		if (cs.extradata_size > STREAM_INFO_CACHE_MAX_EXTRADATA)
+			return -1;
+		if (fwrite(&cs, sizeof(cs), 1, file) != 1)
+			return -1;
+		if (cs.extradata_size > 0 && fwrite(st->codec->extradata, 1,
+				cs.extradata_size, file) != cs.extradata_size)
+			return -1;
+	}
+	return 0;
+}
+
+int stream_info_cache_save(AVFormatContext *ic, const char *path,
+		const char *key) {
+	StreamInfoCacheWrite save = { ic, key };
+
+	if (ic->nb_streams > STREAM_INFO_CACHE_MAX_STREAMS
+			|| strlen(key) > STREAM_INFO_CACHE_MAX_KEY_LENGTH)
+		return -1;
+	if (file_write_atomic(path, (file_write_func) stream_info_cache_write,
+			&save) < 0) {
+		LOGE(2, "stream_info_cache_save could not write: %s", path);
+		return -1;
+	}
+	return 0;
+}
+
+int stream_info_cache_load(AVFormatContext *ic, const char *path,
+		const char *key) {
+	StreamInfoCacheHeader header;
+	StreamInfoCacheStream *streams = NULL;
+	uint8_t **extradata = NULL;
+	char *file_key = NULL;
+	int i, ret = -1;
+	FILE *file = fopen(path, "rb");
+	if (file == NULL)
+		return -1;
+
+	if (fread(&header, sizeof(header), 1, file) != 1)
+		goto end;
+	if (header.magic != STREAM_INFO_CACHE_MAGIC
+			|| header.version != STREAM_INFO_CACHE_VERSION
+			|| header.key_length != strlen(key))
+		goto end;
+	file_key = malloc(header.key_length);
+	if (file_key == NULL)
+		goto end;
+	if (fread(file_key, 1, header.key_length, file) != header.key_length
+			|| memcmp(file_key, key, header.key_length) != 0)
+		goto end;
+	// streams are created by demuxer, we only fill them
+	if (header.nb_streams != ic->nb_streams || header.nb_streams == 0) {
+		LOGI(3, "stream_info_cache_load streams count changed: %d != %d",
+				header.nb_streams, ic->nb_streams);
+		goto end;
+	}
+
+	streams = calloc(header.nb_streams, sizeof(StreamInfoCacheStream));
+	extradata = calloc(header.nb_streams, sizeof(uint8_t *));
+	if (streams == NULL || extradata == NULL)
+		goto end;
+	for (i = 0; i < header.nb_streams; ++i) {
+		StreamInfoCacheStream *cs = &streams[i];
+		AVStream *st = ic->streams[i];
+		if (fread(cs, sizeof(*cs), 1, file) != 1)
+			goto end;
+		if (cs->codec_type != st->codec->codec_type
+				|| (st->codec->codec_id != AV_CODEC_ID_NONE
+						&& cs->codec_id != st->codec->codec_id)
+				|| cs->time_base_num != st->time_base.num
+				|| cs->time_base_den != st->time_base.den) {
+			LOGI(3, "stream_info_cache_load stream %d changed", i);
+			goto end;
+		}
+		if (cs->extradata_size < 0
+				|| cs->extradata_size > STREAM_INFO_CACHE_MAX_EXTRADATA)
+			goto end;
+		if (cs->extradata_size == 0)
+			continue;
+		extradata[i] = av_mallocz(
+				cs->extradata_size + FF_INPUT_BUFFER_PADDING_SIZE);
+		if (extradata[i] == NULL)
+			goto end;
+		if (fread(extradata[i], 1, cs->extradata_size, file)
+				!= cs->extradata_size)
+			goto end;
+	}
+
+	// everything is read, nothing can fail now
+	for (i = 0; i < header.nb_streams; ++i) {
+		stream_info_cache_apply(&streams[i], extradata[i], ic->streams[i]);
+		extradata[i] = NULL;
+	}
+	ic->duration = header.duration;
+	ic->start_time = header.start_time;
+	ic->bit_rate = header.bit_rate;
+	ret = 0;
+
+end:
+	if (extradata != NULL) {
+		for (i = 0; i < header.nb_streams; ++i)
+			av_free(extradata[i]);
+		free(extradata);
+	}
+	free(streams);
+	free(file_key);
+	fclose(file);
+	return ret;
+}
@@ -0,0 +1,40 @@
+/*
+ * stream_info_cache.h
+ * Copyright (c) 2026 FFmpegAndroid contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef STREAM_INFO_CACHE_H_
+#define STREAM_INFO_CACHE_H_
+
+#include <libavformat/avformat.h>
+
+/*
+ * Stores what avformat_find_stream_info found out about streams (codec
+ * parameters, extradata, durations) of ic.
+ */
+int stream_info_cache_save(AVFormatContext *ic, const char *path,
+		const char *key);
+
+/*
+ * Fills codec parameters of streams created by avformat_open_input from file
+ * written for the same key. Nothing is changed and negative value is
+ * returned when file does not exist or streams do not match the ones
+ * opened by demuxer.
+ */
+int stream_info_cache_load(AVFormatContext *ic, const char *path,
+		const char *key);
+
+#endif /* STREAM_INFO_CACHE_H_ */
@@ -0,0 +1,228 @@
+/*
+ * queue_bench.c
+ * Copyright (c) 2026 FFmpegAndroid contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+/*
+ * Host benchmark of queue.c. Every case moves count elements from
+ * producers to a single consumer and reports throughput and percentiles of
+ * time between push_finish and pop_start of each element.
+ *
+ * usage: queue_bench [count]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "queue.h"
+
+#define BENCH_DEFAULT_COUNT 1000000
+#define BENCH_MAX_BATCH 64
+#define BENCH_MAX_PRODUCERS 8
+
+typedef struct BenchElem {
+	int64_t seq;
+	int64_t pushed_ns;
+} BenchElem;
+
+typedef struct BenchCase {
+	const char *name;
+	QueueMode mode;
+	int producers;
+	int batch;
+} BenchCase;
+
+typedef struct BenchRun {
+	Queue *queue;
+	pthread_mutex_t mutex;
+	BenchCase *bench_case;
+	int64_t count;
+	int64_t *latencies;
+} BenchRun;
+
+typedef struct BenchProducer {
+	BenchRun *run;
+	int index;
+} BenchProducer;
+
+static BenchCase bench_cases[] = {
+	{"1:1 locked", QUEUE_MODE_LOCKED, 1, 1},
+	{"1:1 spsc", QUEUE_MODE_SPSC, 1, 1},
+	{"1:1 spsc batch 16", QUEUE_MODE_SPSC, 1, 16},
+	{"2:1 locked", QUEUE_MODE_LOCKED, 2, 1},
+	{"4:1 locked", QUEUE_MODE_LOCKED, 4, 1},
+	{"4:1 locked batch 16", QUEUE_MODE_LOCKED, 4, 16},
+};
+
+static int bench_sizes[] = {4, 16, 64, 256};
+
+static int64_t bench_time_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void *bench_fill(void *obj) {
+	return malloc(sizeof(BenchElem));
+}
+
+static void bench_free(void *obj, void *elem) {
+	free(elem);
+}
+
+static int bench_compare(const void *a, const void *b) {
+	int64_t x = *(const int64_t *) a;
+	int64_t y = *(const int64_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Producer i pushes seqs i, i + producers, i + 2 * producers... so every
+ * element has its own latency slot.
+ */
+static void *bench_producer(void *data) {
+	BenchProducer *producer = data;
+	BenchRun *run = producer->run;
+	int producers = run->bench_case->producers;
+	int64_t seq = producer->index;
+	void *elems[BENCH_MAX_BATCH];
+
+	while (seq < run->count) {
+		int64_t left = (run->count - seq + producers - 1) / producers;
+		int max = run->bench_case->batch;
+		int to_write, reserved, i;
+		int64_t now;
+		if (max > left)
+			max = left;
+		// all reserved elements are written, several producers could not
+		// give slots back
+		reserved = queue_push_start_many(run->queue, &run->mutex, elems,
+				max, &to_write, NULL, NULL, NULL);
+		now = bench_time_ns();
+		for (i = 0; i < reserved; ++i) {
+			BenchElem *elem = elems[i];
+			elem->seq = seq;
+			elem->pushed_ns = now;
+			seq += producers;
+		}
+		queue_push_finish_many(run->queue, &run->mutex, to_write, reserved,
+				reserved);
+	}
+	return NULL;
+}
+
+static void bench_consume(BenchRun *run) {
+	void *elems[BENCH_MAX_BATCH];
+	int64_t consumed = 0;
+
+	while (consumed < run->count) {
+		int count = queue_pop_start_many(&run->queue, &run->mutex, elems,
+				run->bench_case->batch, NULL, NULL, NULL);
+		int64_t now = bench_time_ns();
+		int i;
+		for (i = 0; i < count; ++i) {
+			BenchElem *elem = elems[i];
+			run->latencies[elem->seq] = now - elem->pushed_ns;
+		}
+		queue_pop_finish_many(run->queue, &run->mutex, count);
+		consumed += count;
+	}
+}
+
+static int bench_run(BenchCase *bench_case, int size, int64_t count,
+		int64_t *latencies) {
+	BenchRun run;
+	BenchProducer producers[BENCH_MAX_PRODUCERS];
+	pthread_t threads[BENCH_MAX_PRODUCERS];
+	QueueStats stats;
+	int64_t start, elapsed;
+	int i;
+
+	memset(&run, 0, sizeof(run));
+	run.bench_case = bench_case;
+	run.count = count;
+	run.latencies = latencies;
+	pthread_mutex_init(&run.mutex, NULL);
+	run.queue = queue_init_with_custom_lock(size, bench_case->mode,
+			bench_fill, bench_free, &run, &run, &run.mutex);
+	if (run.queue == NULL) {
+		fprintf(stderr, "could not create queue\n");
+		return -1;
+	}
+
+	start = bench_time_ns();
+	for (i = 0; i < bench_case->producers; ++i) {
+		producers[i].run = &run;
+		producers[i].index = i;
+		pthread_create(&threads[i], NULL, bench_producer, &producers[i]);
+	}
+	bench_consume(&run);
+	for (i = 0; i < bench_case->producers; ++i)
+		pthread_join(threads[i], NULL);
+	elapsed = bench_time_ns() - start;
+
+	queue_get_stats(run.queue, &stats);
+	queue_free(run.queue, &run.mutex, &run);
+	pthread_mutex_destroy(&run.mutex);
+
+	qsort(latencies, count, sizeof(*latencies), bench_compare);
+	printf("%-20s %5d %8.2f %9lld %9lld %9lld %9d %9d\n", bench_case->name,
+			size, count * 1000.0 / elapsed,
+			(long long) latencies[count / 2],
+			(long long) latencies[count * 99 / 100],
+			(long long) latencies[count * 999 / 1000],
+			stats.push_waits, stats.pop_waits);
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	int64_t count = BENCH_DEFAULT_COUNT;
+	int64_t *latencies;
+	int c, s;
+	int ret = 0;
+
+	if (argc > 1)
+		count = atoll(argv[1]);
+	if (count <= 0) {
+		fprintf(stderr, "usage: %s [count]\n", argv[0]);
+		return 1;
+	}
+	latencies = malloc(sizeof(*latencies) * count);
+	if (latencies == NULL) {
+		fprintf(stderr, "could not allocate latencies\n");
+		return 1;
+	}
+
+	printf("%-20s %5s %8s %9s %9s %9s %9s %9s\n", "case", "size", "Mops/s",
+			"p50 ns", "p99 ns", "p99.9 ns", "push wait", "pop wait");
+	for (c = 0; c < sizeof(bench_cases) / sizeof(bench_cases[0]); ++c) {
+		for (s = 0; s < sizeof(bench_sizes) / sizeof(bench_sizes[0]); ++s) {
+			if (bench_run(&bench_cases[c], bench_sizes[s], count, latencies)
+					< 0) {
+				ret = 1;
+				goto end;
+			}
+		}
+	}
+
+end:
+	free(latencies);
+	return ret;
+}
@@ -0,0 +1,471 @@
+/*
+ * queue_stress.c
+ * Copyright (c) 2026 FFmpegAndroid contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+/*
+ * Randomized stress test of queue.c, meant to be run under
+ * ThreadSanitizer. Producers push single elements and batches that are
+ * partially given back, consumers pop, peek, roll back, finish part of a
+ * batch, claim and flush in random order. Every element carries the seq
+ * of its producer and the test checks that each written element is
+ * consumed or flushed exactly once, in push order unless it was claimed,
+ * and that no element leaks.
+ *
+ * usage: queue_stress [seed] [count]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "queue.h"
+
+#define STRESS_DEFAULT_COUNT 20000
+#define STRESS_MAX_BATCH 8
+#define STRESS_MAX_THREADS 4
+#define STRESS_MAGIC 0x5a5a5a5a
+
+#define FALSE 0
+#define TRUE  1
+
+typedef struct StressElem {
+	int producer;
+	int seq;
+	int check;
+	int bytes;
+} StressElem;
+
+typedef struct StressCase {
+	QueueMode mode;
+	int size;
+	int producers;
+	int consumers;
+	int limits;
+} StressCase;
+
+typedef struct StressRun {
+	Queue *queue;
+	pthread_mutex_t mutex;
+	StressCase *stress_case;
+	unsigned int seed;
+	int count;
+	volatile int live;
+	volatile int producers_done;
+	// written elements of each producer
+	int written[STRESS_MAX_THREADS];
+	// QUEUE_MODE_MULTI_CONSUMER only, guarded by mutex
+	char *done;
+	int done_prefix;
+	// the rest is only touched by the single consumer or with mutex held
+	int last_seq[STRESS_MAX_THREADS];
+	int consumed;
+	int flushed;
+	int rolled_back;
+	int errors;
+} StressRun;
+
+typedef struct StressThread {
+	StressRun *run;
+	int index;
+	unsigned int seed;
+} StressThread;
+
+static StressCase stress_cases[] = {
+	{QUEUE_MODE_LOCKED, 2, 1, 1, FALSE},
+	{QUEUE_MODE_LOCKED, 5, 1, 1, TRUE},
+	{QUEUE_MODE_LOCKED, 16, 3, 1, FALSE},
+	{QUEUE_MODE_LOCKED, 7, 2, 1, TRUE},
+	{QUEUE_MODE_SPSC, 2, 1, 1, FALSE},
+	{QUEUE_MODE_SPSC, 3, 1, 1, FALSE},
+	{QUEUE_MODE_SPSC, 16, 1, 1, TRUE},
+	{QUEUE_MODE_MULTI_CONSUMER, 4, 1, 3, FALSE},
+	{QUEUE_MODE_MULTI_CONSUMER, 16, 1, 2, TRUE},
+};
+
+static void stress_fail(StressRun *run, const char *what, StressElem *elem) {
+	fprintf(stderr, "mode %d size %d: %s, producer %d seq %d\n",
+			run->stress_case->mode, run->stress_case->size, what,
+			elem->producer, elem->seq);
+	run->errors += 1;
+}
+
+static void *stress_fill(void *obj) {
+	StressRun *run = obj;
+	StressElem *elem = malloc(sizeof(StressElem));
+	if (elem == NULL)
+		return NULL;
+	// stale content is caught by the check field
+	elem->producer = -1;
+	elem->seq = -1;
+	elem->check = 0;
+	elem->bytes = 0;
+	__sync_fetch_and_add(&run->live, 1);
+	return elem;
+}
+
+static void stress_free(void *obj, void *elem) {
+	StressRun *run = obj;
+	free(elem);
+	__sync_fetch_and_sub(&run->live, 1);
+}
+
+static void stress_measure(void *obj, void *elem, int *bytes,
+		int *duration) {
+	StressElem *stress_elem = elem;
+	*bytes = stress_elem->bytes;
+	*duration = 1;
+}
+
+static int stress_valid(StressElem *elem) {
+	return elem->check == (elem->seq ^ STRESS_MAGIC);
+}
+
+/*
+ * Consumed or flushed element. Without claims every producer's elements
+ * have to come one after another.
+ */
+static void stress_account(StressRun *run, StressElem *elem, int flushed) {
+	if (!stress_valid(elem)) {
+		stress_fail(run, "corrupted element", elem);
+		return;
+	}
+	if (run->stress_case->mode == QUEUE_MODE_MULTI_CONSUMER) {
+		if (run->done[elem->seq])
+			stress_fail(run, "element seen twice", elem);
+		run->done[elem->seq] = TRUE;
+		while (run->done_prefix < run->count && run->done[run->done_prefix])
+			run->done_prefix += 1;
+	} else {
+		if (elem->seq != run->last_seq[elem->producer] + 1)
+			stress_fail(run, "element out of order", elem);
+		run->last_seq[elem->producer] = elem->seq;
+	}
+	if (flushed)
+		run->flushed += 1;
+	else
+		run->consumed += 1;
+}
+
+static void stress_flush_func(void *obj, void *elem) {
+	stress_account(obj, elem, TRUE);
+}
+
+static QueueCheckFuncRet stress_consumer_check(Queue *queue,
+		void *check_data, void *check_ret_data) {
+	StressRun *run = check_data;
+	// nothing will be pushed, leftovers are flushed by the consumer
+	if (__sync_fetch_and_add(&run->producers_done, 0)
+			== run->stress_case->producers)
+		return QUEUE_CHECK_FUNC_RET_SKIP;
+	return QUEUE_CHECK_FUNC_RET_TEST;
+}
+
+static void stress_write(StressRun *run, int producer, StressElem *elem,
+		unsigned int *seed) {
+	elem->producer = producer;
+	elem->seq = run->written[producer];
+	elem->check = elem->seq ^ STRESS_MAGIC;
+	elem->bytes = 1 + rand_r(seed) % 64;
+	run->written[producer] += 1;
+}
+
+static void *stress_producer(void *data) {
+	StressThread *thread = data;
+	StressRun *run = thread->run;
+	int producer = thread->index;
+	int count = run->count / run->stress_case->producers;
+	void *elems[STRESS_MAX_BATCH];
+
+	while (run->written[producer] < count) {
+		int left = count - run->written[producer];
+		int op = rand_r(&thread->seed) % 8;
+		int to_write, reserved, written, max, i;
+
+		if (op == 0) {
+			sched_yield();
+			continue;
+		}
+		if (op < 4) {
+			StressElem *elem = queue_push_start(run->queue, &run->mutex,
+					&to_write, NULL, NULL, NULL);
+			stress_write(run, producer, elem, &thread->seed);
+			queue_push_finish(run->queue, &run->mutex, to_write);
+			continue;
+		}
+
+		max = 1 + rand_r(&thread->seed) % STRESS_MAX_BATCH;
+		if (max > left)
+			max = left;
+		reserved = queue_push_start_many(run->queue, &run->mutex, elems,
+				max, &to_write, NULL, NULL, NULL);
+		// only a single producer could give reserved slots back
+		written = reserved;
+		if (run->stress_case->producers == 1)
+			written = rand_r(&thread->seed) % (reserved + 1);
+		for (i = 0; i < written; ++i)
+			stress_write(run, producer, elems[i], &thread->seed);
+		queue_push_finish_many(run->queue, &run->mutex, to_write, reserved,
+				written);
+	}
+
+	pthread_mutex_lock(&run->mutex);
+	__sync_fetch_and_add(&run->producers_done, 1);
+	queue_wake_all(run->queue);
+	pthread_mutex_unlock(&run->mutex);
+	return NULL;
+}
+
+/*
+ * Single consumer of QUEUE_MODE_LOCKED and QUEUE_MODE_SPSC queues. After
+ * roll back the same element has to be returned again.
+ */
+static void stress_consume(StressRun *run, unsigned int *seed) {
+	void *elems[STRESS_MAX_BATCH];
+	int expected_producer = -1;
+	int expected_seq = -1;
+
+	while (1) {
+		int op = rand_r(seed) % 16;
+		StressElem *first;
+		int count, finished, i;
+
+		if (op == 0) {
+			sched_yield();
+			continue;
+		}
+		if (op == 1) {
+			pthread_mutex_lock(&run->mutex);
+			queue_flush_impl(run->queue, &run->mutex, stress_flush_func, run);
+			pthread_mutex_unlock(&run->mutex);
+			expected_producer = -1;
+			continue;
+		}
+		if (op == 2) {
+			// peek has to be done under the lock
+			StressElem *next;
+			pthread_mutex_lock(&run->mutex);
+			first = queue_pop_start_impl(&run->queue, &run->mutex,
+					stress_consumer_check, run, NULL);
+			if (first == NULL) {
+				pthread_mutex_unlock(&run->mutex);
+				break;
+			}
+			next = queue_pop_peek_next_impl(run->queue);
+			if (next != NULL && next->producer == first->producer
+					&& next->seq != first->seq + 1)
+				stress_fail(run, "peeked element out of order", next);
+			if (next != NULL && !stress_valid(next))
+				stress_fail(run, "peeked element corrupted", next);
+			if (rand_r(seed) % 2) {
+				stress_account(run, first, FALSE);
+				queue_pop_finish_impl(run->queue, &run->mutex);
+				expected_producer = -1;
+			} else {
+				queue_pop_roll_back_impl(run->queue, &run->mutex);
+				run->rolled_back += 1;
+				expected_producer = first->producer;
+				expected_seq = first->seq;
+			}
+			pthread_mutex_unlock(&run->mutex);
+			continue;
+		}
+
+		count = queue_pop_start_many(&run->queue, &run->mutex, elems,
+				1 + rand_r(seed) % STRESS_MAX_BATCH, stress_consumer_check,
+				run, NULL);
+		if (count == 0)
+			break;
+		first = elems[0];
+		if (expected_producer >= 0 && (first->producer != expected_producer
+				|| first->seq != expected_seq))
+			stress_fail(run, "rolled back element lost", first);
+		finished = count;
+		if (op < 6)
+			finished = rand_r(seed) % (count + 1);
+		for (i = 0; i < finished; ++i)
+			stress_account(run, elems[i], FALSE);
+		if (finished < count) {
+			StressElem *rolled_back = elems[finished];
+			run->rolled_back += 1;
+			expected_producer = rolled_back->producer;
+			expected_seq = rolled_back->seq;
+		} else {
+			expected_producer = -1;
+		}
+		queue_pop_finish_many(run->queue, &run->mutex, finished);
+	}
+
+	// producers are done, rest of elements is dropped
+	pthread_mutex_lock(&run->mutex);
+	queue_flush_impl(run->queue, &run->mutex, stress_flush_func, run);
+	pthread_mutex_unlock(&run->mutex);
+}
+
+/*
+ * One of consumers of QUEUE_MODE_MULTI_CONSUMER queue. After
+ * queue_claim_wait_turn every earlier element has to be done.
+ */
+static void *stress_claimer(void *data) {
+	StressThread *thread = data;
+	StressRun *run = thread->run;
+
+	while (1) {
+		int op = rand_r(&thread->seed) % 8;
+		StressElem *elem;
+		int to_read;
+
+		if (op == 0) {
+			sched_yield();
+			continue;
+		}
+		if (op == 1) {
+			pthread_mutex_lock(&run->mutex);
+			queue_flush_impl(run->queue, &run->mutex, stress_flush_func, run);
+			pthread_mutex_unlock(&run->mutex);
+			continue;
+		}
+
+		elem = queue_claim_start(&run->queue, &run->mutex, &to_read,
+				stress_consumer_check, run, NULL);
+		if (elem == NULL)
+			break;
+		if (op < 4)
+			sched_yield();
+		pthread_mutex_lock(&run->mutex);
+		if (op < 5) {
+			queue_claim_wait_turn_impl(run->queue, &run->mutex, to_read);
+			if (run->done_prefix != elem->seq)
+				stress_fail(run, "turn given before earlier elements", elem);
+		}
+		stress_account(run, elem, FALSE);
+		queue_claim_finish_impl(run->queue, &run->mutex, to_read);
+		pthread_mutex_unlock(&run->mutex);
+	}
+
+	pthread_mutex_lock(&run->mutex);
+	queue_flush_impl(run->queue, &run->mutex, stress_flush_func, run);
+	pthread_mutex_unlock(&run->mutex);
+	return NULL;
+}
+
+static int stress_run(StressCase *stress_case, unsigned int seed, int count) {
+	StressRun run;
+	StressThread producers[STRESS_MAX_THREADS];
+	StressThread consumers[STRESS_MAX_THREADS];
+	pthread_t producer_threads[STRESS_MAX_THREADS];
+	pthread_t consumer_threads[STRESS_MAX_THREADS];
+	int total = 0;
+	int i;
+
+	memset(&run, 0, sizeof(run));
+	run.stress_case = stress_case;
+	run.seed = seed;
+	run.count = count;
+	for (i = 0; i < STRESS_MAX_THREADS; ++i)
+		run.last_seq[i] = -1;
+	run.done = calloc(count, 1);
+	if (run.done == NULL) {
+		fprintf(stderr, "could not allocate done flags\n");
+		return -1;
+	}
+	pthread_mutex_init(&run.mutex, NULL);
+	run.queue = queue_init_with_custom_lock(stress_case->size,
+			stress_case->mode, stress_fill, stress_free, &run, &run,
+			&run.mutex);
+	if (run.queue == NULL) {
+		fprintf(stderr, "could not create queue\n");
+		free(run.done);
+		return -1;
+	}
+	if (stress_case->limits)
+		queue_set_limits(run.queue, stress_measure, &run, 128,
+				stress_case->size / 2 + 1);
+
+	for (i = 0; i < stress_case->producers; ++i) {
+		producers[i].run = &run;
+		producers[i].index = i;
+		producers[i].seed = seed * 31 + i;
+		pthread_create(&producer_threads[i], NULL, stress_producer,
+				&producers[i]);
+	}
+	if (stress_case->mode == QUEUE_MODE_MULTI_CONSUMER) {
+		for (i = 0; i < stress_case->consumers; ++i) {
+			consumers[i].run = &run;
+			consumers[i].index = i;
+			consumers[i].seed = seed * 17 + i;
+			pthread_create(&consumer_threads[i], NULL, stress_claimer,
+					&consumers[i]);
+		}
+		for (i = 0; i < stress_case->consumers; ++i)
+			pthread_join(consumer_threads[i], NULL);
+	} else {
+		unsigned int consumer_seed = seed * 17;
+		stress_consume(&run, &consumer_seed);
+	}
+	for (i = 0; i < stress_case->producers; ++i) {
+		pthread_join(producer_threads[i], NULL);
+		total += run.written[i];
+	}
+
+	if (run.consumed + run.flushed != total) {
+		fprintf(stderr, "mode %d size %d: %d written, %d consumed, %d "
+				"flushed\n", stress_case->mode, stress_case->size, total,
+				run.consumed, run.flushed);
+		run.errors += 1;
+	}
+	queue_free(run.queue, &run.mutex, &run);
+	pthread_mutex_destroy(&run.mutex);
+	if (run.live != 0) {
+		fprintf(stderr, "mode %d size %d: %d elements leaked\n",
+				stress_case->mode, stress_case->size, run.live);
+		run.errors += 1;
+	}
+	free(run.done);
+
+	printf("mode %d size %2d producers %d consumers %d limits %d: "
+			"%d consumed, %d flushed, %d rolled back, %s\n",
+			stress_case->mode, stress_case->size, stress_case->producers,
+			stress_case->consumers, stress_case->limits, run.consumed,
+			run.flushed, run.rolled_back, run.errors ? "FAILED" : "ok");
+	return run.errors ? -1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+	unsigned int seed = 1;
+	int count = STRESS_DEFAULT_COUNT;
+	int ret = 0;
+	int c;
+
+	if (argc > 1)
+		seed = strtoul(argv[1], NULL, 10);
+	if (argc > 2)
+		count = atoi(argv[2]);
+	if (count <= 0) {
+		fprintf(stderr, "usage: %s [seed] [count]\n", argv[0]);
+		return 1;
+	}
+
+	printf("seed %u\n", seed);
+	for (c = 0; c < sizeof(stress_cases) / sizeof(stress_cases[0]); ++c) {
+		if (stress_run(&stress_cases[c], seed, count) < 0)
+			ret = 1;
+	}
+	return ret;
+}
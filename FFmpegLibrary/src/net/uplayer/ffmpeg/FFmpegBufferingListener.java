@@ -0,0 +1,33 @@
+/*
+ * FFmpegBufferingListener.java
+ * Copyright (c) 2026 FFmpegAndroid contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+package net.uplayer.ffmpeg;
+
+/**
+ * Optional, implemented by {@link FFmpegListener} given to
+ * {@link FFmpegPlayer#setMpegListener(FFmpegListener)} which wants to know
+ * about buffering
+ */
+public interface FFmpegBufferingListener {
+	/**
+	 * Called when playback stops because packet queues ran low
+	 * (buffering == true) and when enough data was buffered to continue
+	 */
+	void onFFBuffering(boolean buffering);
+
+}
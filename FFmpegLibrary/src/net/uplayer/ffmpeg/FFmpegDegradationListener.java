@@ -0,0 +1,36 @@
+/*
+ * FFmpegDegradationListener.java
+ * Copyright (c) 2026 FFmpegAndroid contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+package net.uplayer.ffmpeg;
+
+/**
+ * Optional, implemented by {@link FFmpegListener} given to
+ * {@link FFmpegPlayer#setMpegListener(FFmpegListener)} which wants to know
+ * about decoding degradation
+ */
+public interface FFmpegDegradationListener {
+	/**
+	 * Called when video decoding got degraded because device could not keep
+	 * up or got back after load dropped
+	 * 
+	 * @param level
+	 *            - one of FFmpegStats.DEGRADATION_* levels
+	 */
+	void onFFDegradation(int level);
+
+}
@@ -0,0 +1,41 @@
+/*
+ * FFmpegNextDataSourceListener.java
+ * Copyright (c) 2026 FFmpegAndroid contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+package net.uplayer.ffmpeg;
+
+/**
+ * Optional, implemented by {@link FFmpegListener} given to
+ * {@link FFmpegPlayer#setMpegListener(FFmpegListener)} which uses
+ * {@link FFmpegPlayer#prepareNextDataSource(String, java.util.Map)}
+ */
+public interface FFmpegNextDataSourceListener {
+	/**
+	 * Called when media given to
+	 * {@link FFmpegPlayer#prepareNextDataSource(String, java.util.Map)} is
+	 * ready to play (err == null) or could not be opened
+	 */
+	void onFFNextDataSourcePrepared(FFmpegError err);
+
+	/**
+	 * Called when next media started playing (err == null), either
+	 * automatically after current one ended or by
+	 * {@link FFmpegPlayer#playNextDataSource()}
+	 */
+	void onFFNextDataSourceStarted(FFmpegError err);
+
+}
@@ -26,6 +26,7 @@ import android.media.AudioFormat;
 import android.media.AudioManager;
 import android.media.AudioTrack;
 import android.os.AsyncTask;
+import android.os.Build;
 
 public class FFmpegPlayer {
 	private static class StopTask extends AsyncTask<Void, Void, Void> {
@@ -98,6 +99,63 @@ public class FFmpegPlayer {
 
 	}
 
+	private static class PrepareNextDataSourceTask extends
+			AsyncTask<Object, Void, FFmpegError> {
+
+		private final FFmpegPlayer player;
+
+		public PrepareNextDataSourceTask(FFmpegPlayer player) {
+			this.player = player;
+		}
+
+		@Override
+		protected FFmpegError doInBackground(Object... params) {
+			String url = (String) params[0];
+			@SuppressWarnings("unchecked")
+			Map<String, String> map = (Map<String, String>) params[1];
+			int err = player.prepareNextDataSourceNative(url, map);
+			if (err < 0)
+				return new FFmpegError(err);
+			return null;
+		}
+
+		@Override
+		protected void onPostExecute(FFmpegError result) {
+			if (player.mpegListener instanceof FFmpegNextDataSourceListener)
+				((FFmpegNextDataSourceListener) player.mpegListener)
+						.onFFNextDataSourcePrepared(result);
+		}
+
+	}
+
+	private static class PlayNextDataSourceTask extends
+			AsyncTask<Void, Void, FFmpegError> {
+
+		private final FFmpegPlayer player;
+
+		public PlayNextDataSourceTask(FFmpegPlayer player) {
+			this.player = player;
+		}
+
+		@Override
+		protected FFmpegError doInBackground(Void... params) {
+			int err = player.playNextDataSourceNative();
+			if (err < 0)
+				return new FFmpegError(err);
+			return null;
+		}
+
+		@Override
+		protected void onPostExecute(FFmpegError result) {
+			// success is reported by onNextDataSourceStarted
+			if (result != null
+					&& player.mpegListener instanceof FFmpegNextDataSourceListener)
+				((FFmpegNextDataSourceListener) player.mpegListener)
+						.onFFNextDataSourceStarted(result);
+		}
+
+	}
+
 	private static class SeekTask extends
 			AsyncTask<Integer, Void, NotPlayingException> {
 
@@ -179,8 +237,11 @@ public class FFmpegPlayer {
 
 	}
 
+	private static final int sCpuCount;
+
 	static {
 		NativeTester nativeTester = new NativeTester();
+		sCpuCount = nativeTester.getCpuCount();
 		if (nativeTester.isNeon()) {
 			System.loadLibrary("ffmpeg-neon");
 			System.loadLibrary("ffmpeg-jni-neon");
@@ -208,6 +269,44 @@ public class FFmpegPlayer {
 
 	};
 
+	private Runnable bufferingRunnable = new Runnable() {
+
+		@Override
+		public void run() {
+			if (mpegListener instanceof FFmpegBufferingListener) {
+				((FFmpegBufferingListener) mpegListener)
+						.onFFBuffering(mIsBuffering);
+			}
+		}
+
+	};
+
+	private Runnable nextDataSourceStartedRunnable = new Runnable() {
+
+		@Override
+		public void run() {
+			if (mpegListener instanceof FFmpegNextDataSourceListener) {
+				((FFmpegNextDataSourceListener) mpegListener)
+						.onFFNextDataSourceStarted(null);
+			}
+		}
+
+	};
+
+	private Runnable degradationRunnable = new Runnable() {
+
+		@Override
+		public void run() {
+			if (mpegListener instanceof FFmpegDegradationListener) {
+				((FFmpegDegradationListener) mpegListener)
+						.onFFDegradation(mDegradationLevel);
+			}
+		}
+
+	};
+
+	private volatile boolean mIsBuffering = false;
+	private volatile int mDegradationLevel = 0;
 	private int mCurrentTimeS;
 	private int mVideoDurationS;
 	private FFmpegStreamInfo[] mStreamsInfos = null;
@@ -222,7 +321,7 @@ public class FFmpegPlayer {
 
 	public FFmpegPlayer(FFmpegDisplay videoView, Activity activity) {
 		this.activity = activity;
-		int error = initNative();
+		int error = initNative(sCpuCount);
 		if (error != 0)
 			throw new RuntimeException(String.format(
 					"Could not initialize player: %d", error));
@@ -240,7 +339,7 @@ public class FFmpegPlayer {
 		deallocNative();
 	}
 
-	private native int initNative();
+	private native int initNative(int cpuCount);
 
 	private native void deallocNative();
 
@@ -248,6 +347,11 @@ public class FFmpegPlayer {
 			Map<String, String> dictionary, int videoStreamNo,
 			int audioStreamNo, int subtitleStreamNo);
 
+	private native int prepareNextDataSourceNative(String url,
+			Map<String, String> dictionary);
+
+	private native int playNextDataSourceNative();
+
 	private native void stopNative();
 
 	native void renderFrameStart();
@@ -262,6 +366,20 @@ public class FFmpegPlayer {
 
 	private native int getVideoDurationNative();
 	private native int getStreamingTypeNative();
+	private native long[] getStatsNative();
+
+	/**
+	 * Cheap snapshot of native queues counters, could be called from any
+	 * thread
+	 *
+	 * @return stats or null if could not allocate memory
+	 */
+	public FFmpegStats getStats() {
+		long[] raw = getStatsNative();
+		if (raw == null)
+			return null;
+		return new FFmpegStats(raw);
+	}
 
 	/**
 	 * 
@@ -319,6 +437,20 @@ public class FFmpegPlayer {
 		activity.runOnUiThread(updateTimeRunnable);
 	}
 
+	private void onBuffering(boolean isBuffering) {
+		this.mIsBuffering = isBuffering;
+		activity.runOnUiThread(bufferingRunnable);
+	}
+
+	private void onDegradation(int level) {
+		this.mDegradationLevel = level;
+		activity.runOnUiThread(degradationRunnable);
+	}
+
+	private void onNextDataSourceStarted() {
+		activity.runOnUiThread(nextDataSourceStartedRunnable);
+	}
+
 	private AudioTrack prepareAudioTrack(int sampleRateInHz,
 			int numberOfChannels) {
 
@@ -372,12 +504,82 @@ public class FFmpegPlayer {
 		setDataSource(url, null, null, null, null);
 	}
 
+	/**
+	 * Open media asynchronously, result is reported by
+	 * {@link FFmpegListener#onFFDataSourceLoaded(FFmpegError, FFmpegStreamInfo[])}
+	 * 
+	 * @param dictionary
+	 *            - could be null, options passed to FFmpeg. Player also
+	 *            understands: audio_queue_max_bytes,
+	 *            audio_queue_max_duration_ms, video_queue_max_bytes,
+	 *            video_queue_max_duration_ms (0 - no limit),
+	 *            buffering_low_ms, buffering_high_ms (packets queues
+	 *            watermarks reported by
+	 *            {@link FFmpegBufferingListener#onFFBuffering(boolean)}, 0 high
+	 *            watermark disables buffering), pause_buffer_bytes (packets
+	 *            read ahead while paused, 0 - reading stops on pause),
+	 *            fast_start (1 - probe streams with small limits first,
+	 *            compare with {@link FFmpegStats#getTimeToFirstFrameUs()}),
+	 *            decoder_threads (video decoding threads, 0 - one per core,
+	 *            {@link FFmpegStats#getDecoderThreads()}),
+	 *            decoder_degradation (0 - video is always fully decoded,
+	 *            otherwise decoding is degraded while device can not keep
+	 *            up, see {@link FFmpegDegradationListener#onFFDegradation(int)}),
+	 *            late_frame_drop (0 - late frames are always shown,
+	 *            otherwise frame later than late_frame_ms is skipped when
+	 *            newer one is ready, see {@link FFmpegStats#getFramesDropped()}),
+	 *            video_frame_pool (0 - decoder allocates pictures itself,
+	 *            otherwise they are reused from player's pool, see
+	 *            {@link FFmpegStats#getFramePoolHits()}). Urls
+	 *            prefixed with "cache+" (e.g. "cache+http://...") are read
+	 *            ahead into disk cache configured by: cache_dir (required, e.g.
+	 *            {@link android.content.Context#getCacheDir()}),
+	 *            cache_size, cache_readahead (bytes). When cache_dir is set
+	 *            probed streams parameters and keyframes indexed while
+	 *            playing media without own index (e.g. MPEG-TS) are kept
+	 *            there and reused by next open
+	 */
 	public void setDataSource(String url, Map<String, String> dictionary,
 			FFmpegStreamInfo videoStream, FFmpegStreamInfo audioStream,
 			FFmpegStreamInfo subtitlesStream) {
 		new SetDataSourceTask(this).execute(url, dictionary, videoStream, audioStream, subtitlesStream);
 	}
 
+	/**
+	 * Open next media in background while current one plays, result is
+	 * reported by
+	 * {@link FFmpegNextDataSourceListener#onFFNextDataSourcePrepared(FFmpegError)}.
+	 * Playback options given to setDataSource (queues limits, buffering,
+	 * cache_dir, fast_start) apply to it too and its packets queues are
+	 * filled up to buffering_high_ms. When it has the same kind of streams,
+	 * video size and audio format as current media it is played without a
+	 * gap as soon as current media ends (or on {@link #playNextDataSource()})
+	 * by the same AudioTrack and threads. Preparing again replaces previously
+	 * prepared media.
+	 * 
+	 * @param dictionary
+	 *            - could be null, options passed to FFmpeg
+	 */
+	public void prepareNextDataSource(String url, Map<String, String> dictionary) {
+		PrepareNextDataSourceTask task = new PrepareNextDataSourceTask(this);
+		// opening takes long, it must not hold back pause or seek queued
+		// after it
+		if (Build.VERSION.SDK_INT >= Build.VERSION_CODES.HONEYCOMB)
+			task.executeOnExecutor(AsyncTask.THREAD_POOL_EXECUTOR, url,
+					dictionary);
+		else
+			task.execute(url, dictionary);
+	}
+
+	/**
+	 * Play prepared next media now. Media which can not be played without a
+	 * gap are started by recreating output. Start is reported by
+	 * {@link FFmpegNextDataSourceListener#onFFNextDataSourceStarted(FFmpegError)}.
+	 */
+	public void playNextDataSource() {
+		new PlayNextDataSourceTask(this).execute();
+	}
+
 	RenderedFrame renderFrame() throws InterruptedException {
 		this.mRenderedFrame.bitmap = this.renderFrameNative();
 		return this.mRenderedFrame;
@@ -0,0 +1,434 @@
+/*
+ * FFmpegStats.java
+ * Copyright (c) 2026 FFmpegAndroid contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+package net.uplayer.ffmpeg;
+
+/**
+ * Snapshot of native pipeline counters returned by
+ * {@link FFmpegPlayer#getStats()}. Layout of the raw array has to be kept in
+ * sync with PlayerStats enums in player.c
+ */
+public class FFmpegStats {
+	public static final int QUEUE_VIDEO_PACKETS = 0;
+	public static final int QUEUE_AUDIO_PACKETS = 1;
+	public static final int QUEUE_VIDEO_FRAMES = 2;
+	private static final int QUEUES_NB = 3;
+
+	public static final int HISTOGRAM_BUCKETS = 8;
+
+	/**
+	 * Video decoding degradation levels, every level keeps skips of lower
+	 * ones
+	 */
+	public static final int DEGRADATION_NONE = 0;
+	/** no deblocking of frames nothing refers to */
+	public static final int DEGRADATION_SKIP_LOOP_FILTER = 1;
+	/** frames nothing refers to (B-frames mostly) are not decoded */
+	public static final int DEGRADATION_SKIP_NONREF = 2;
+	/** only keyframes are decoded */
+	public static final int DEGRADATION_SKIP_NONKEY = 3;
+
+	private static final int STATS_QUEUES = 0;
+	private static final int STATS_PACKET_POOL = STATS_QUEUES + QUEUES_NB
+			* QueueStats.FIELDS_NB;
+	private static final int PACKET_POOL_MALLOCS = 0;
+	private static final int PACKET_POOL_FREES = 1;
+	private static final int PACKET_POOL_REUSES = 2;
+	private static final int PACKET_POOL_OVERSIZED = 3;
+	private static final int PACKET_POOL_CACHED_BYTES = 4;
+	private static final int PACKET_POOL_FIELDS_NB = 5;
+	private static final int STATS_PACKETS_BYTES_MOVED = STATS_PACKET_POOL
+			+ PACKET_POOL_FIELDS_NB;
+	private static final int STATS_PACKETS_BYTES_COPIED = STATS_PACKETS_BYTES_MOVED + 1;
+	private static final int STATS_KEYFRAME_INDEX_ENTRIES = STATS_PACKETS_BYTES_COPIED + 1;
+	private static final int STATS_KEYFRAME_INDEX_SEEKS = STATS_KEYFRAME_INDEX_ENTRIES + 1;
+	private static final int STATS_READ_EAGAINS = STATS_KEYFRAME_INDEX_SEEKS + 1;
+	private static final int STATS_PROBE_US = STATS_READ_EAGAINS + 1;
+	private static final int STATS_PROBE_FALLBACK = STATS_PROBE_US + 1;
+	private static final int STATS_PROBE_CACHED = STATS_PROBE_FALLBACK + 1;
+	private static final int STATS_TIME_TO_FIRST_FRAME_US = STATS_PROBE_CACHED + 1;
+	private static final int STATS_DECODER_THREADS = STATS_TIME_TO_FIRST_FRAME_US + 1;
+	private static final int STATS_DEGRADATION_LEVEL = STATS_DECODER_THREADS + 1;
+	private static final int STATS_DEGRADATION_ESCALATIONS = STATS_DEGRADATION_LEVEL + 1;
+	private static final int STATS_DEGRADATION_DEESCALATIONS = STATS_DEGRADATION_ESCALATIONS + 1;
+	private static final int STATS_DEGRADED_US = STATS_DEGRADATION_DEESCALATIONS + 1;
+	private static final int STATS_FRAMES_LATE = STATS_DEGRADED_US + 1;
+	private static final int STATS_FRAMES_DROPPED = STATS_FRAMES_LATE + 1;
+	private static final int STATS_FRAME_POOL_HITS = STATS_FRAMES_DROPPED + 1;
+	private static final int STATS_FRAME_POOL_MISSES = STATS_FRAME_POOL_HITS + 1;
+	private static final int STATS_FRAME_POOL_RESIDENT_BYTES = STATS_FRAME_POOL_MISSES + 1;
+
+	public static class QueueStats {
+		private static final int SIZE = 0;
+		private static final int COUNT = 1;
+		private static final int BYTES = 2;
+		private static final int DURATION_MS = 3;
+		private static final int HIGH_WATER = 4;
+		private static final int PUSH_WAITS = 5;
+		private static final int PUSH_WAIT_US = 6;
+		private static final int POP_WAITS = 7;
+		private static final int POP_WAIT_US = 8;
+		private static final int WAKEUPS = 9;
+		private static final int SPURIOUS_WAKEUPS = 10;
+		private static final int FLUSHES = 11;
+		private static final int FLUSHED = 12;
+		private static final int ALLOCATED = 13;
+		private static final int HISTOGRAM = 14;
+		private static final int FIELDS_NB = HISTOGRAM + HISTOGRAM_BUCKETS;
+
+		private final long[] mRaw;
+		private final int mOffset;
+
+		QueueStats(long[] raw, int offset) {
+			mRaw = raw;
+			mOffset = offset;
+		}
+
+		/**
+		 * @return number of slots in queue or 0 if queue does not exist
+		 */
+		public int getSize() {
+			return (int) mRaw[mOffset + SIZE];
+		}
+
+		public int getCount() {
+			return (int) mRaw[mOffset + COUNT];
+		}
+
+		public int getBytes() {
+			return (int) mRaw[mOffset + BYTES];
+		}
+
+		public int getDurationMs() {
+			return (int) mRaw[mOffset + DURATION_MS];
+		}
+
+		/**
+		 * @return maximal number of queued elements
+		 */
+		public int getHighWater() {
+			return (int) mRaw[mOffset + HIGH_WATER];
+		}
+
+		/**
+		 * @return number of pushes that blocked because queue was full
+		 */
+		public int getPushWaits() {
+			return (int) mRaw[mOffset + PUSH_WAITS];
+		}
+
+		public long getPushWaitUs() {
+			return mRaw[mOffset + PUSH_WAIT_US];
+		}
+
+		/**
+		 * @return number of pops that blocked because queue was empty
+		 */
+		public int getPopWaits() {
+			return (int) mRaw[mOffset + POP_WAITS];
+		}
+
+		public long getPopWaitUs() {
+			return mRaw[mOffset + POP_WAIT_US];
+		}
+
+		public int getWakeups() {
+			return (int) mRaw[mOffset + WAKEUPS];
+		}
+
+		public int getSpuriousWakeups() {
+			return (int) mRaw[mOffset + SPURIOUS_WAKEUPS];
+		}
+
+		public int getFlushes() {
+			return (int) mRaw[mOffset + FLUSHES];
+		}
+
+		public int getFlushed() {
+			return (int) mRaw[mOffset + FLUSHED];
+		}
+
+		/**
+		 * @return number of elements currently allocated by queue, at most
+		 *         getSize()
+		 */
+		public int getAllocated() {
+			return (int) mRaw[mOffset + ALLOCATED];
+		}
+
+		/**
+		 * Occupancy sampled on every push. Bucket i counts pushes after which
+		 * queue was filled in i/HISTOGRAM_BUCKETS of its tightest limit
+		 * (slots, bytes or duration).
+		 */
+		public int getHistogram(int bucket) {
+			if (bucket < 0 || bucket >= HISTOGRAM_BUCKETS)
+				throw new IndexOutOfBoundsException();
+			return (int) mRaw[mOffset + HISTOGRAM + bucket];
+		}
+
+		@Override
+		public String toString() {
+			StringBuilder sb = new StringBuilder();
+			sb.append(getCount()).append('/').append(getSize());
+			sb.append(" bytes: ").append(getBytes());
+			sb.append(" duration: ").append(getDurationMs()).append("ms");
+			sb.append(" high: ").append(getHighWater());
+			sb.append(" push waits: ").append(getPushWaits());
+			sb.append(" (").append(getPushWaitUs() / 1000).append("ms)");
+			sb.append(" pop waits: ").append(getPopWaits());
+			sb.append(" (").append(getPopWaitUs() / 1000).append("ms)");
+			sb.append(" flushes: ").append(getFlushes());
+			sb.append(" allocated: ").append(getAllocated());
+			sb.append(" histogram: [");
+			for (int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+				if (i != 0)
+					sb.append(' ');
+				sb.append(getHistogram(i));
+			}
+			sb.append(']');
+			return sb.toString();
+		}
+	}
+
+	private final QueueStats[] mQueues = new QueueStats[QUEUES_NB];
+	private final long[] mRaw;
+
+	FFmpegStats(long[] raw) {
+		mRaw = raw;
+		for (int i = 0; i < QUEUES_NB; ++i) {
+			mQueues[i] = new QueueStats(raw, STATS_QUEUES + i
+					* QueueStats.FIELDS_NB);
+		}
+	}
+
+	/**
+	 * @param queue
+	 *            - one of QUEUE_VIDEO_PACKETS, QUEUE_AUDIO_PACKETS or
+	 *            QUEUE_VIDEO_FRAMES
+	 */
+	public QueueStats getQueue(int queue) {
+		return mQueues[queue];
+	}
+
+	/**
+	 * @return number of packet buffers allocated from the heap, does not grow
+	 *         in steady state
+	 */
+	public int getPacketPoolMallocs() {
+		return (int) mRaw[STATS_PACKET_POOL + PACKET_POOL_MALLOCS];
+	}
+
+	public int getPacketPoolFrees() {
+		return (int) mRaw[STATS_PACKET_POOL + PACKET_POOL_FREES];
+	}
+
+	public int getPacketPoolReuses() {
+		return (int) mRaw[STATS_PACKET_POOL + PACKET_POOL_REUSES];
+	}
+
+	/**
+	 * @return number of packets too big for the pool that were allocated
+	 *         separately
+	 */
+	public int getPacketPoolOversized() {
+		return (int) mRaw[STATS_PACKET_POOL + PACKET_POOL_OVERSIZED];
+	}
+
+	public int getPacketPoolCachedBytes() {
+		return (int) mRaw[STATS_PACKET_POOL + PACKET_POOL_CACHED_BYTES];
+	}
+
+	/**
+	 * @return number of packet bytes handed from demuxer to decoders without
+	 *         copying since player was created
+	 */
+	public long getPacketsBytesMoved() {
+		return mRaw[STATS_PACKETS_BYTES_MOVED];
+	}
+
+	/**
+	 * @return number of packet bytes that had to be copied on their way from
+	 *         demuxer to decoders since player was created
+	 */
+	public long getPacketsBytesCopied() {
+		return mRaw[STATS_PACKETS_BYTES_COPIED];
+	}
+
+	/**
+	 * @return number of keyframes indexed while reading current media, 0 when
+	 *         media has its own index
+	 */
+	public int getKeyframeIndexEntries() {
+		return (int) mRaw[STATS_KEYFRAME_INDEX_ENTRIES];
+	}
+
+	/**
+	 * @return number of seeks in current media served from keyframe index
+	 */
+	public int getKeyframeIndexSeeks() {
+		return (int) mRaw[STATS_KEYFRAME_INDEX_SEEKS];
+	}
+
+	/**
+	 * @return number of times demuxer had no data ready (EAGAIN) and reading
+	 *         thread backed off since player was created
+	 */
+	public long getReadEagains() {
+		return mRaw[STATS_READ_EAGAINS];
+	}
+
+	/**
+	 * @return time spent probing streams of current media
+	 */
+	public long getProbeUs() {
+		return mRaw[STATS_PROBE_US];
+	}
+
+	/**
+	 * @return true if fast_start probe was not enough and full probe was done
+	 */
+	public boolean isProbeFallback() {
+		return mRaw[STATS_PROBE_FALLBACK] != 0;
+	}
+
+	/**
+	 * @return true if streams parameters were taken from cache_dir instead of
+	 *         probing
+	 */
+	public boolean isProbeCached() {
+		return mRaw[STATS_PROBE_CACHED] != 0;
+	}
+
+	/**
+	 * @return time from setDataSource to first rendered video frame (first
+	 *         written audio when there is no video), 0 until it is shown
+	 */
+	public long getTimeToFirstFrameUs() {
+		return mRaw[STATS_TIME_TO_FIRST_FRAME_US];
+	}
+
+	/**
+	 * @return number of threads decoding video of current media, 1 when
+	 *         decoder does not support threading
+	 */
+	public int getDecoderThreads() {
+		return (int) mRaw[STATS_DECODER_THREADS];
+	}
+
+	/**
+	 * @return current video decoding degradation, one of DEGRADATION_*
+	 */
+	public int getDegradationLevel() {
+		return (int) mRaw[STATS_DEGRADATION_LEVEL];
+	}
+
+	/**
+	 * @return number of times decoding was degraded one level further since
+	 *         player was created
+	 */
+	public int getDegradationEscalations() {
+		return (int) mRaw[STATS_DEGRADATION_ESCALATIONS];
+	}
+
+	/**
+	 * @return number of times decoding got one level back since player was
+	 *         created
+	 */
+	public int getDegradationDeescalations() {
+		return (int) mRaw[STATS_DEGRADATION_DEESCALATIONS];
+	}
+
+	/**
+	 * @return time video was decoded degraded since player was created
+	 */
+	public long getDegradedUs() {
+		return mRaw[STATS_DEGRADED_US];
+	}
+
+	/**
+	 * @return number of video frames shown later than late_frame_ms since
+	 *         player was created
+	 */
+	public long getFramesLate() {
+		return mRaw[STATS_FRAMES_LATE];
+	}
+
+	/**
+	 * @return number of late video frames skipped by renderer because newer
+	 *         frame was ready since player was created
+	 */
+	public long getFramesDropped() {
+		return mRaw[STATS_FRAMES_DROPPED];
+	}
+
+	/**
+	 * @return number of decoded pictures written to reused frame pool
+	 *         buffers since player was created
+	 */
+	public int getFramePoolHits() {
+		return (int) mRaw[STATS_FRAME_POOL_HITS];
+	}
+
+	/**
+	 * @return number of frame pool buffers allocated since player was
+	 *         created
+	 */
+	public int getFramePoolMisses() {
+		return (int) mRaw[STATS_FRAME_POOL_MISSES];
+	}
+
+	/**
+	 * @return bytes of picture buffers held by frame pool, both free and
+	 *         used by decoder
+	 */
+	public long getFramePoolResidentBytes() {
+		return mRaw[STATS_FRAME_POOL_RESIDENT_BYTES];
+	}
+
+	@Override
+	public String toString() {
+		return "video packets: " + mQueues[QUEUE_VIDEO_PACKETS]
+				+ "\naudio packets: " + mQueues[QUEUE_AUDIO_PACKETS]
+				+ "\nvideo frames: " + mQueues[QUEUE_VIDEO_FRAMES]
+				+ "\npacket pool mallocs: " + getPacketPoolMallocs()
+				+ " frees: " + getPacketPoolFrees()
+				+ " reuses: " + getPacketPoolReuses()
+				+ " oversized: " + getPacketPoolOversized()
+				+ " cached: " + getPacketPoolCachedBytes()
+				+ "\npackets bytes moved: " + getPacketsBytesMoved()
+				+ " copied: " + getPacketsBytesCopied()
+				+ "\nkeyframe index entries: " + getKeyframeIndexEntries()
+				+ " seeks: " + getKeyframeIndexSeeks()
+				+ "\nread eagains: " + getReadEagains()
+				+ "\nprobe us: " + getProbeUs()
+				+ (isProbeCached() ? " (cached)" : "")
+				+ (isProbeFallback() ? " (fallback)" : "")
+				+ " time to first frame us: " + getTimeToFirstFrameUs()
+				+ "\ndecoder threads: " + getDecoderThreads()
+				+ "\ndegradation level: " + getDegradationLevel()
+				+ " escalations: " + getDegradationEscalations()
+				+ " deescalations: " + getDegradationDeescalations()
+				+ " degraded us: " + getDegradedUs()
+				+ "\nframes late: " + getFramesLate()
+				+ " dropped: " + getFramesDropped()
+				+ "\nframe pool hits: " + getFramePoolHits()
+				+ " misses: " + getFramePoolMisses()
+				+ " resident: " + getFramePoolResidentBytes();
+	}
+}
@@ -24,4 +24,9 @@ class NativeTester {
 	}
 	
 	native boolean isNeon();
+
+	/**
+	 * @return number of CPU cores, at least 1
+	 */
+	native int getCpuCount();
 }